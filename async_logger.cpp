@@ -0,0 +1,228 @@
+#include "async_logger.h"
+
+#include "rutil/Lock.hxx"
+using namespace resip;
+
+#include <chrono>
+#include <ctime>
+#include <thread>
+using namespace std;
+
+
+double AsyncLogger::sSampleRatio = 1.0;
+
+AsyncLogger::AsyncLogger(const resip::Data& fileName, UInt64 maxBytes, bool keepAllFiles)
+    : mFileName(fileName.empty() ? Data("resiprocate.log") : fileName)
+    , mMaxBytes(maxBytes)
+    , mKeepAllFiles(keepAllFiles)
+    , mFile(0)
+    , mBytes(0)
+    , mStopped(false)
+{
+    mFile = fopen(mFileName.c_str(), "a");
+    if (mFile)
+    {
+        fseek(mFile, 0, SEEK_END);
+        mBytes = (UInt64)ftell(mFile);
+    }
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    stop();
+    if (mFile)
+    {
+        fclose(mFile);
+    }
+    for (auto r : mRings)
+    {
+        delete r;
+    }
+}
+
+bool AsyncLogger::isSampled(const resip::Data& callId)
+{
+    if (sSampleRatio >= 1.0)
+    {
+        return true;
+    }
+    if (sSampleRatio <= 0.0)
+    {
+        return false;
+    }
+    return (callId.hash() % 10000) < (size_t)(sSampleRatio * 10000);
+}
+
+AsyncLogger::Ring& AsyncLogger::localRing()
+{
+    // one logger per process, the ring of a thread lives as long as the logger
+    static thread_local Ring* ring = 0;
+    if (!ring)
+    {
+        ring = new Ring;
+        Lock lock(mRingsMutex);
+        mRings.push_back(ring);
+    }
+    return *ring;
+}
+
+bool AsyncLogger::operator()(resip::Log::Level level,
+    const resip::Subsystem& subsystem,
+    const resip::Data& appName,
+    const char* file,
+    int line,
+    const resip::Data& message,
+    const resip::Data& messageWithHeaders,
+    const resip::Data& instanceName)
+{
+    // stop() waits for the rings marked busy: a record is either pushed before the last
+    // drain or written directly, both flags are seq_cst so one side always sees the other
+    Ring& r = localRing();
+    r.mBusy.store(true, std::memory_order_seq_cst);
+    if (mStopped.load(std::memory_order_seq_cst))
+    {
+        r.mBusy.store(false, std::memory_order_release);
+        Lock lock(mFileMutex);
+        write(messageWithHeaders.data(), messageWithHeaders.size());
+        write("\n", 1);
+        if (mFile)
+        {
+            fflush(mFile);
+        }
+        return false;
+    }
+
+    size_t tail = r.mTail.load(std::memory_order_relaxed);
+    if (tail - r.mHead.load(std::memory_order_acquire) >= sRingSize)
+    {
+        r.mDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        std::string& slot = r.mSlots[tail % sRingSize];
+        slot.assign(messageWithHeaders.data(), messageWithHeaders.size());
+        slot.push_back('\n');
+        r.mTail.store(tail + 1, std::memory_order_release);
+    }
+    r.mBusy.store(false, std::memory_order_release);
+    return false;
+}
+
+void AsyncLogger::thread()
+{
+    while (!isShutdown())
+    {
+        if (!drain())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+}
+
+void AsyncLogger::stop()
+{
+    if (mStopped.exchange(true))
+    {
+        return;
+    }
+    shutdown();
+    join();
+    // producers now write directly, the ones that had not noticed finish their push first
+    std::vector<Ring*> rings;
+    {
+        Lock lock(mRingsMutex);
+        rings = mRings;
+    }
+    for (auto r : rings)
+    {
+        while (r->mBusy.load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+    }
+    drain();
+}
+
+bool AsyncLogger::drain()
+{
+    std::vector<Ring*> rings;
+    {
+        Lock lock(mRingsMutex);
+        rings = mRings;
+    }
+
+    Lock lock(mFileMutex);
+    bool any = false;
+    for (auto r : rings)
+    {
+        size_t dropped = r->mDropped.exchange(0, std::memory_order_relaxed);
+        if (dropped)
+        {
+            char buf[64];
+            int len = snprintf(buf, sizeof(buf), "[AsyncLogger] %lu log records dropped\n", (unsigned long)dropped);
+            write(buf, (size_t)len);
+        }
+
+        size_t head = r->mHead.load(std::memory_order_relaxed);
+        size_t tail = r->mTail.load(std::memory_order_acquire);
+        for (; head != tail; ++head)
+        {
+            const std::string& slot = r->mSlots[head % sRingSize];
+            write(slot.data(), slot.size());
+            any = true;
+        }
+        r->mHead.store(head, std::memory_order_release);
+    }
+    if (any && mFile)
+    {
+        fflush(mFile);
+    }
+    return any;
+}
+
+void AsyncLogger::write(const char* data, size_t len)
+{
+    if (mMaxBytes && mBytes + len > mMaxBytes)
+    {
+        rotate();
+    }
+    if (!mFile)
+    {
+        return;
+    }
+    fwrite(data, 1, len, mFile);
+    mBytes += len;
+}
+
+void AsyncLogger::rotate()
+{
+    if (mFile)
+    {
+        fclose(mFile);
+        mFile = 0;
+    }
+
+    Data oldName;
+    if (mKeepAllFiles)
+    {
+        char stamp[32];
+        time_t now = time(0);
+        struct tm t;
+#if defined(WIN32)
+        localtime_s(&t, &now);
+#else
+        localtime_r(&now, &t);
+#endif
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &t);
+        oldName = mFileName + "_" + stamp;
+    }
+    else
+    {
+        oldName = mFileName + ".old";
+        remove(oldName.c_str());
+    }
+    rename(mFileName.c_str(), oldName.c_str());
+
+    mFile = fopen(mFileName.c_str(), "w");
+    mBytes = 0;
+}
@@ -0,0 +1,78 @@
+#if !defined(ASYNC_LOGGER__H)
+#define ASYNC_LOGGER__H
+
+#include "rutil/Logger.hxx"
+#include "rutil/Mutex.hxx"
+#include "rutil/ThreadIf.hxx"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// resip ExternalLogger taking the file writes off the DUM and stack threads.
+// Every logging thread owns a single producer ring the background thread drains into
+// the log file, so logging costs the formatting resip already did plus a copy into a
+// slot whose buffer is reused. A full ring drops the record rather than blocking the
+// caller, the number dropped is written to the file once there is room.
+// Rotation follows resip: past `maxBytes` the file is renamed `<file>.old`, or
+// `<file>_<timestamp>` to keep all of them, and a new one is started.
+class AsyncLogger : public resip::ExternalLogger, public resip::ThreadIf
+{
+public:
+    AsyncLogger(const resip::Data& fileName, UInt64 maxBytes, bool keepAllFiles);
+    ~AsyncLogger();
+
+    virtual bool operator()(resip::Log::Level level,
+        const resip::Subsystem& subsystem,
+        const resip::Data& appName,
+        const char* file,
+        int line,
+        const resip::Data& message,
+        const resip::Data& messageWithHeaders,
+        const resip::Data& instanceName);
+
+    virtual void thread();
+    /// drains every ring, later records are written synchronously
+    void stop();
+
+    /// part of the calls whose complete SIP messages are logged, 0 to 1
+    static void setSampleRatio(double ratio) { sSampleRatio = ratio; }
+    /// whether the call identified by `callId` is one of the sampled ones, the same
+    /// Call-ID always gives the same answer
+    static bool isSampled(const resip::Data& callId);
+
+private:
+    static const size_t sRingSize = 4096;
+
+    struct Ring
+    {
+        Ring() : mHead(0), mTail(0), mDropped(0), mBusy(false) {}
+        std::atomic<size_t> mHead;      // written by the background thread
+        std::atomic<size_t> mTail;      // written by the owning thread
+        std::atomic<size_t> mDropped;
+        std::atomic<bool> mBusy;        // the owning thread is logging, see stop()
+        std::string mSlots[sRingSize];
+    };
+
+    Ring& localRing();
+    bool drain();
+    void write(const char* data, size_t len);
+    void rotate();
+
+    const resip::Data mFileName;
+    const UInt64 mMaxBytes;
+    const bool mKeepAllFiles;
+    FILE* mFile;
+    UInt64 mBytes;
+
+    resip::Mutex mRingsMutex;
+    std::vector<Ring*> mRings;
+    std::atomic<bool> mStopped;
+    resip::Mutex mFileMutex;
+
+    static double sSampleRatio;
+};
+
+#endif // #if !defined(ASYNC_LOGGER__H)
@@ -0,0 +1,65 @@
+#include "b2bua.h"
+#include "simple_sbc.h"
+#include "dum_shard.h"
+#include "ss_subsystem.h"
+
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+B2BUA::B2BUA(SimpleSBC& sbc) : mSbc(sbc)
+{
+}
+
+int B2BUA::bridge(SSDialogSet& inbound, const resip::SipMessage& invite, const resip::SdpContents& offer)
+{
+    ContactInstanceRecord rec;
+    int code = resolveTarget(invite.header(h_RequestLine).uri(), rec);
+    if (code)
+    {
+        InfoLog(<< "Can't route " << invite.brief() << ", reject with " << code);
+        return code;
+    }
+
+    std::shared_ptr<UserProfile> profile = inbound.getShard().getProfiles().get(rec.mReceivedFrom, ProfileCache::Bridged, Timer::getTimeSecs());
+    if (!profile)
+    {
+        return 503;
+    }
+
+    // the profile is shared by the calls to the same flow, the From goes on the INVITE
+    NameAddr from(invite.header(h_From));
+    from.remove(p_tag);
+
+    SSDialogSet* outbound = new SSDialogSet(mSbc, inbound.getShard());
+    inbound.pair(*outbound);
+    outbound->initiateCall(rec.mContact, std::move(profile), offer, &from);
+
+    mSbc.addCall(&inbound);
+    return 0;
+}
+
+int B2BUA::resolveTarget(const resip::Uri& ruri, resip::ContactInstanceRecord& rec)
+{
+    Uri aor = ruri.getAorAsUri();
+    SimpleSBC::AorContact reg;
+    if (!mSbc.selectShard(aor).findReg(aor, reg))
+    {
+        // the request uri may carry the port of the sbc while the AOR doesn't
+        if (aor.port() == 0)
+        {
+            return 404;
+        }
+        aor.port() = 0;
+        if (!mSbc.selectShard(aor).findReg(aor, reg))
+        {
+            return 404;
+        }
+    }
+
+    return mSbc.selectContact(reg, rec) ? 0 : 480;
+}
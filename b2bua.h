@@ -0,0 +1,32 @@
+#if !defined(B2BUA__H)
+#define B2BUA__H
+
+#include "resip/stack/SipMessage.hxx"
+#include "resip/stack/SdpContents.hxx"
+#include "resip/dum/ContactInstanceRecord.hxx"
+
+class SimpleSBC;
+class SSDialogSet;
+
+// Routes an inbound INVITE to a user registered to this sbc.
+// The inbound leg is the SSDialogSet created by the factory for the INVITE, the engine
+// resolves its request uri against the registrations and starts the paired outbound
+// leg on the same shard. From then on the two legs relay responses, offers/answers and
+// termination to each other, see SSDialogSet.
+class B2BUA
+{
+public:
+    B2BUA(SimpleSBC& sbc);
+
+    /// called with the offer of a new inbound INVITE, return 0 once the outbound leg is
+    /// started or the status code to reject the INVITE with
+    int bridge(SSDialogSet& inbound, const resip::SipMessage& invite, const resip::SdpContents& offer);
+
+protected:
+    int resolveTarget(const resip::Uri& ruri, resip::ContactInstanceRecord& rec);
+
+private:
+    SimpleSBC& mSbc;
+};
+
+#endif // #if !defined(B2BUA__H)
@@ -0,0 +1,156 @@
+#include "call_pacer.h"
+#include "dum_command.h"
+#include "dum_shard.h"
+#include "simple_sbc.h"
+#include "ss_subsystem.h"
+
+#include "resip/stack/SipStack.hxx"
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+CallPacer::CallPacer(SimpleSBC& sbc, std::vector<resip::Uri> targets, unsigned count, unsigned rate,
+    unsigned holdSecs, const resip::Data& sdpfile)
+    : mSbc(sbc)
+    , mTargets(std::move(targets))
+    , mCount(count)
+    , mRate(rate ? rate : 1)
+    , mHoldSecs(holdSecs)
+    , mSdpFile(sdpfile)
+    , mStartUs(0)
+    , mNext(0)
+    , mCancelled(false)
+    , mStarted(0)
+    , mAnswered(0)
+    , mFailed(0)
+    , mEndUs(0)
+{
+}
+
+void CallPacer::start()
+{
+    mStartUs = Timer::getTimeMicroSec();
+    auto self = shared_from_this();
+    mSbc.getShard(0).post(new DumFunctorCommand([self]() { self->tick(); }, "CallPacer"));
+}
+
+void CallPacer::tick()
+{
+    if (mCancelled)
+    {
+        return;
+    }
+
+    UInt64 now = Timer::getTimeMicroSec();
+    UInt64 due = (now - mStartUs) * mRate / 1000000 + 1;
+    auto self = shared_from_this();
+    for (; mNext < mCount && mNext < due; ++mNext)
+    {
+        unsigned index = mNext;
+        DumShard& shard = mSbc.selectShard(mTargets[index % mTargets.size()]);
+        if (shard.getIndex() == 0)
+        {
+            originate(index);
+        }
+        else
+        {
+            shard.post(new DumFunctorCommand([self, index]() { self->originate(index); }, "CallPacer"));
+        }
+    }
+
+    if (mNext < mCount)
+    {
+        UInt64 nextUs = mStartUs + (UInt64)mNext * 1000000 / mRate;
+        unsigned ms = nextUs > now ? (unsigned)((nextUs - now + 999) / 1000) : 0;
+        DumShard& pacer = mSbc.getShard(0);
+        pacer.getSipStack().postMS(DumFunctorCommand([self]() { self->tick(); }, "CallPacer"), ms, &pacer);
+    }
+}
+
+void CallPacer::originate(unsigned index)
+{
+    ++mStarted;
+    const Uri& aor = mTargets[index % mTargets.size()];
+    DumShard& shard = mSbc.selectShard(aor);
+    SimpleSBC::AorContact reg;
+    if (!shard.findReg(aor, reg) || !mSbc.makeNewCall(shard, reg, mSdpFile, shared_from_this()))
+    {
+        onFailed();
+    }
+}
+
+void CallPacer::onAnswered(SSDialogSet& call, UInt64 setupUs)
+{
+    {
+        Lock lock(mSetupMutex);
+        mSetup.record(setupUs);
+    }
+    mEndUs = Timer::getTimeMicroSec();
+    ++mAnswered;
+
+    DumShard& shard = call.getShard();
+    AppDialogSetHandle h = call.getHandle();
+    shard.getSipStack().postMS(DumFunctorCommand([h]()
+    {
+        if (h.isValid())
+        {
+            static_cast<SSDialogSet*>(h.get())->terminateCall();
+        }
+    }, "CallPacer"), mHoldSecs * 1000, &shard);
+}
+
+void CallPacer::onFailed()
+{
+    mEndUs = Timer::getTimeMicroSec();
+    ++mFailed;
+}
+
+bool CallPacer::wait(unsigned timeoutSecs)
+{
+    UInt64 deadline = Timer::getTimeMs() + timeoutSecs * 1000ull;
+    while (mAnswered + mFailed < mCount)
+    {
+        if (Timer::getTimeMs() > deadline)
+        {
+            mCancelled = true;
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+void CallPacer::report(std::ostream& strm) const
+{
+    unsigned answered = mAnswered;
+    unsigned failed = mFailed;
+    UInt64 endUs = mEndUs;
+    double elapsed = endUs > mStartUs ? (double)(endUs - mStartUs) / 1000000 : 0;
+
+    LatencyHistogram setup;
+    {
+        Lock lock(mSetupMutex);
+        setup = mSetup;
+    }
+
+    strm << "calls: " << mStarted << " started, " << answered << " answered, " << failed << " failed, "
+         << mCount - answered - failed << " pending" << endl;
+    strm << fixed << setprecision(1)
+         << "rate: " << (elapsed > 0 ? (answered + failed) / elapsed : 0) << "/s, target " << mRate << "/s" << endl;
+    strm << "setup ms: p50 " << setup.percentile(0.5) / 1000.0
+         << ", p90 " << setup.percentile(0.9) / 1000.0
+         << ", p99 " << setup.percentile(0.99) / 1000.0
+         << ", max " << setup.max() / 1000.0 << endl;
+    strm.unsetf(ios::floatfield);
+}
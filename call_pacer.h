@@ -0,0 +1,66 @@
+#if !defined(CALL_PACER__H)
+#define CALL_PACER__H
+
+#include "resip/stack/Uri.hxx"
+#include "rutil/Data.hxx"
+#include "rutil/Mutex.hxx"
+
+#include "histogram.h"
+
+#include <atomic>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+
+class SimpleSBC;
+class SSDialogSet;
+
+// `call --count N --rate R`: originates N calls at R per second to the target aors,
+// round robin.
+// The pacer runs on the thread of the first shard. Call i is due at start + i/R, every
+// tick sends what is due to the shard owning its target and sleeps until the next one
+// is due, so the rate holds without drifting or bunching up behind a late tick.
+// Setup time runs from the INVITE to its 200, answered calls are ended after the hold
+// time.
+class CallPacer : public std::enable_shared_from_this<CallPacer>
+{
+public:
+    CallPacer(SimpleSBC& sbc, std::vector<resip::Uri> targets, unsigned count, unsigned rate,
+        unsigned holdSecs, const resip::Data& sdpfile);
+
+    void start();
+    /// wait until every call was answered or failed, no more calls are started
+    /// after it timed out
+    /// @return false if timed out
+    bool wait(unsigned timeoutSecs);
+    void report(std::ostream& strm) const;
+
+    // called by the calls on their shard thread
+    void onAnswered(SSDialogSet& call, UInt64 setupUs);
+    void onFailed();
+
+private:
+    void tick();
+    void originate(unsigned index);
+
+    SimpleSBC& mSbc;
+    const std::vector<resip::Uri> mTargets;
+    const unsigned mCount;
+    const unsigned mRate;
+    const unsigned mHoldSecs;
+    const resip::Data mSdpFile;
+
+    UInt64 mStartUs;
+    unsigned mNext;             // first call not sent yet, pacer thread only
+    std::atomic<bool> mCancelled;
+    std::atomic<unsigned> mStarted;
+    std::atomic<unsigned> mAnswered;
+    std::atomic<unsigned> mFailed;
+    std::atomic<UInt64> mEndUs;
+
+    mutable resip::Mutex mSetupMutex;
+    LatencyHistogram mSetup;
+};
+
+#endif // #if !defined(CALL_PACER__H)
@@ -0,0 +1,323 @@
+#include "cdr_writer.h"
+#include "ss_subsystem.h"
+
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#if !defined(WIN32)
+#include <unistd.h>
+#endif
+#include <chrono>
+#include <ctime>
+#include <thread>
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+namespace
+{
+    const char* sHeader = "call_id,direction,caller,callee,target,source,start,ring,answer,end,setup_ms,duration_ms,status,reason\n";
+    const UInt64 sRetryMs = 1000;
+
+    bool utcTime(time_t secs, struct tm& t)
+    {
+#if defined(WIN32)
+        return gmtime_s(&t, &secs) == 0;
+#else
+        return gmtime_r(&secs, &t) != 0;
+#endif
+    }
+}
+
+CdrWriter::CdrWriter(const resip::Data& prefix, UInt64 maxBytes, unsigned rotateSecs, unsigned syncMs)
+    : mPrefix(prefix)
+    , mMaxBytes(maxBytes)
+    , mRotateMs(rotateSecs * 1000ull)
+    , mSyncMs(syncMs)
+    , mWallOffsetMs(0)
+    , mFile(0)
+    , mBytes(0)
+    , mOpened(0)
+    , mSynced(0)
+    , mDirty(false)
+    , mSequence(0)
+    , mRetryAt(0)
+    , mWritten(0)
+    , mSpilled(0)
+    , mPending(0)
+{
+    SInt64 wall = (SInt64)chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    mWallOffsetMs = wall - (SInt64)Timer::getTimeMs();
+}
+
+CdrWriter::~CdrWriter()
+{
+    shutdown();
+    join();
+    // the call legs destroyed since the thread ended posted here
+    UInt64 now = Timer::getTimeMs();
+    drain(now);
+    if (!mFile && getPending() && open(now))
+    {
+        flush();
+    }
+    if (getPending())
+    {
+        ErrLog(<< getPending() << " call detail records are lost, no CDR file could be opened");
+    }
+    close(now);
+    for (auto r : mRings)
+    {
+        delete r;
+    }
+}
+
+CdrWriter::Ring& CdrWriter::localRing()
+{
+    // one writer per process, the ring of a thread lives as long as the writer
+    static thread_local Ring* ring = 0;
+    if (!ring)
+    {
+        ring = new Ring;
+        Lock lock(mRingsMutex);
+        mRings.push_back(ring);
+    }
+    return *ring;
+}
+
+void CdrWriter::post(CdrRecord&& rec)
+{
+    Ring& r = localRing();
+    size_t tail = r.mTail.load(std::memory_order_relaxed);
+    if (tail - r.mHead.load(std::memory_order_acquire) >= sRingSize)
+    {
+        Lock lock(mSpillMutex);
+        mSpill.push_back(std::move(rec));
+        mSpilled.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    r.mSlots[tail % sRingSize] = std::move(rec);
+    r.mTail.store(tail + 1, std::memory_order_release);
+}
+
+void CdrWriter::thread()
+{
+    InfoLog(<< "Writing call detail records to " << mPrefix << "_*.csv");
+    while (!isShutdown())
+    {
+        UInt64 now = Timer::getTimeMs();
+        size_t count = drain(now);
+        if (!mFile && getPending() && now >= mRetryAt && open(now))
+        {
+            flush();
+        }
+        if (mFile && mRotateMs && now - mOpened >= mRotateMs)
+        {
+            close(now);
+        }
+        else if (mDirty && now - mSynced >= mSyncMs)
+        {
+            sync(now);
+        }
+        if (!count)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+size_t CdrWriter::drain(UInt64 now)
+{
+    std::vector<Ring*> rings;
+    {
+        Lock lock(mRingsMutex);
+        rings = mRings;
+    }
+
+    size_t count = 0;
+    for (auto r : rings)
+    {
+        size_t head = r->mHead.load(std::memory_order_relaxed);
+        size_t tail = r->mTail.load(std::memory_order_acquire);
+        for (; head != tail; ++head)
+        {
+            write(r->mSlots[head % sRingSize], now);
+            ++count;
+        }
+        r->mHead.store(head, std::memory_order_release);
+    }
+
+    std::vector<CdrRecord> spill;
+    {
+        Lock lock(mSpillMutex);
+        spill.swap(mSpill);
+    }
+    for (const auto& rec : spill)
+    {
+        write(rec, now);
+        ++count;
+    }
+
+    // the batch goes in a single write, the fsync waits for the sync period
+    flush();
+    return count;
+}
+
+void CdrWriter::write(const CdrRecord& rec, UInt64 now)
+{
+    mLine.clear();
+    field(rec.mCallId);
+    mLine += rec.mInbound ? ",in," : ",out,";
+    field(rec.mCaller);
+    mLine += ',';
+    field(rec.mCallee);
+    mLine += ',';
+    field(rec.mTarget);
+    mLine += ',';
+    field(rec.mSource);
+    mLine += ',';
+    stamp(rec.mStart);
+    mLine += ',';
+    stamp(rec.mRing);
+    mLine += ',';
+    stamp(rec.mAnswer);
+    mLine += ',';
+    stamp(rec.mEnd);
+
+    UInt64 setup = rec.mAnswer ? rec.mAnswer : rec.mEnd;
+    UInt64 duration = rec.mAnswer && rec.mEnd > rec.mAnswer ? rec.mEnd - rec.mAnswer : 0;
+    char buf[96];
+    snprintf(buf, sizeof(buf), ",%llu,%llu,%d,%s\n",
+        (unsigned long long)(setup > rec.mStart ? setup - rec.mStart : 0),
+        (unsigned long long)duration, rec.mStatus, rec.mReason);
+    mLine += buf;
+
+    if (mFile && mMaxBytes && mBytes + mLine.size() > mMaxBytes)
+    {
+        close(now);
+    }
+    if (!mFile && (now < mRetryAt || !open(now)))
+    {
+        // billing data, kept until a file opens
+        mKept += mLine;
+        mPending.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    mBuffer += mLine;
+    mBytes += mLine.size();
+    mWritten.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CdrWriter::field(const resip::Data& value)
+{
+    if (value.find(",") == Data::npos && value.find("\"") == Data::npos && value.find("\n") == Data::npos)
+    {
+        mLine.append(value.data(), value.size());
+        return;
+    }
+    mLine += '"';
+    for (Data::size_type i = 0; i < value.size(); ++i)
+    {
+        if (value[i] == '"')
+        {
+            mLine += '"';
+        }
+        mLine += value[i];
+    }
+    mLine += '"';
+}
+
+void CdrWriter::stamp(UInt64 ms)
+{
+    // ISO 8601 in UTC, empty for an event that did not happen
+    struct tm t;
+    if (!ms || !utcTime((time_t)(((SInt64)ms + mWallOffsetMs) / 1000), t))
+    {
+        return;
+    }
+    char buf[32];
+    size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &t);
+    snprintf(buf + len, sizeof(buf) - len, ".%03uZ", (unsigned)(((SInt64)ms + mWallOffsetMs) % 1000));
+    mLine += buf;
+}
+
+bool CdrWriter::open(UInt64 now)
+{
+    struct tm t;
+    char started[32] = "";
+    if (utcTime((time_t)(((SInt64)now + mWallOffsetMs) / 1000), t))
+    {
+        strftime(started, sizeof(started), "%Y%m%d-%H%M%S", &t);
+    }
+    // the sequence keeps apart the files rotated within a second
+    Data path = mPrefix + "_" + started + "_" + Data(mSequence + 1) + ".csv";
+    mFile = fopen(path.c_str(), "w");
+    if (!mFile)
+    {
+        mRetryAt = now + sRetryMs;
+        ErrLog(<< "Failed to open the CDR file " << path << ", " << getPending() << " records kept, retrying");
+        return false;
+    }
+    ++mSequence;
+    InfoLog(<< "Started the CDR file " << path);
+    mBuffer = sHeader;
+    UInt64 kept = getPending();
+    if (kept)
+    {
+        mBuffer += mKept;
+        std::string().swap(mKept);
+        mPending.store(0, std::memory_order_relaxed);
+        mWritten.fetch_add(kept, std::memory_order_relaxed);
+        InfoLog(<< "Writing the " << kept << " records kept while no CDR file could be opened");
+    }
+    mBytes = mBuffer.size();
+    mOpened = now;
+    return true;
+}
+
+void CdrWriter::flush()
+{
+    if (!mFile || mBuffer.empty())
+    {
+        return;
+    }
+    fwrite(mBuffer.data(), 1, mBuffer.size(), mFile);
+    mBuffer.clear();
+    fflush(mFile);
+    mDirty = true;
+}
+
+void CdrWriter::sync(UInt64 now)
+{
+    if (mFile && mDirty)
+    {
+#if !defined(WIN32)
+        if (fsync(fileno(mFile)) != 0)
+        {
+            ErrLog(<< "Failed to sync the CDR file");
+        }
+#endif
+    }
+    mDirty = false;
+    mSynced = now;
+}
+
+void CdrWriter::close(UInt64 now)
+{
+    if (!mFile)
+    {
+        return;
+    }
+    flush();
+    sync(now);
+    if (ferror(mFile))
+    {
+        ErrLog(<< "Failed to write the CDR file");
+    }
+    fclose(mFile);
+    mFile = 0;
+}
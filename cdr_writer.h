@@ -0,0 +1,107 @@
+#if !defined(CDR_WRITER__H)
+#define CDR_WRITER__H
+
+#include "rutil/Data.hxx"
+#include "rutil/Mutex.hxx"
+#include "rutil/ThreadIf.hxx"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// One call detail record, filled by the call leg as the call goes and handed over
+// once the leg is gone
+struct CdrRecord
+{
+    CdrRecord() : mInbound(false), mStart(0), mRing(0), mAnswer(0), mEnd(0), mStatus(0), mReason("") {}
+    resip::Data mCallId;
+    bool mInbound;          // bridged call received, else a call originated by a command
+    resip::Data mCaller;    // From uri
+    resip::Data mCallee;    // To uri
+    resip::Data mTarget;    // contact the call was sent to
+    resip::Data mSource;    // address the inbound INVITE came from
+    UInt64 mStart;          // Timer::getTimeMs() of the INVITE, ring, answer and end, 0 if never
+    UInt64 mRing;
+    UInt64 mAnswer;
+    UInt64 mEnd;
+    int mStatus;            // final response, 0 if none was sent or received
+    const char* mReason;    // why the session ended, static string
+};
+
+// Writes the CDRs to CSV files from a background thread.
+// Every posting thread owns a single producer ring the writer drains, so a DUM thread
+// only copies the record into a slot, without a lock or any file io. Records are
+// billing data and never dropped: a full ring spills to a list behind a mutex that
+// the writer empties at once.
+// Every drain is written as one batch, and the file is fsynced once per `syncMs` at
+// most, not per record. A file is closed past `maxBytes` or `rotateSecs` and the next
+// record starts `<prefix>_<utc time>_<sequence>.csv`, so a closed file is complete.
+// While no file can be opened the records are kept in memory and the open is retried
+// every second, they are only lost if it still fails when the writer is destroyed.
+class CdrWriter : public resip::ThreadIf
+{
+public:
+    CdrWriter(const resip::Data& prefix, UInt64 maxBytes, unsigned rotateSecs, unsigned syncMs);
+    /// writes and syncs whatever was posted until then
+    ~CdrWriter();
+
+    void post(CdrRecord&& rec);
+    virtual void thread();
+
+    UInt64 getWritten() const { return mWritten.load(std::memory_order_relaxed); }
+    UInt64 getSpilled() const { return mSpilled.load(std::memory_order_relaxed); }
+    /// records waiting for a file that could not be opened
+    UInt64 getPending() const { return mPending.load(std::memory_order_relaxed); }
+
+private:
+    static const size_t sRingSize = 1024;
+
+    struct Ring
+    {
+        Ring() : mHead(0), mTail(0) {}
+        std::atomic<size_t> mHead;      // written by the writer thread
+        std::atomic<size_t> mTail;      // written by the owning thread
+        CdrRecord mSlots[sRingSize];
+    };
+
+    Ring& localRing();
+    size_t drain(UInt64 now);
+    void write(const CdrRecord& rec, UInt64 now);
+    void field(const resip::Data& value);
+    void stamp(UInt64 ms);
+    bool open(UInt64 now);
+    void flush();
+    void sync(UInt64 now);
+    void close(UInt64 now);
+
+    const resip::Data mPrefix;
+    const UInt64 mMaxBytes;
+    const UInt64 mRotateMs;
+    const UInt64 mSyncMs;
+    SInt64 mWallOffsetMs;       // wall clock minus Timer::getTimeMs()
+
+    // writer thread only, or the destructor once it is joined
+    FILE* mFile;
+    UInt64 mBytes;
+    UInt64 mOpened;
+    UInt64 mSynced;
+    bool mDirty;
+    unsigned mSequence;
+    std::string mLine;
+    std::string mBuffer;       // records of the batch not written yet
+    std::string mKept;         // records formatted while no file could be opened
+    UInt64 mRetryAt;           // next attempt to open a file after a failure
+
+    resip::Mutex mRingsMutex;
+    std::vector<Ring*> mRings;
+    resip::Mutex mSpillMutex;
+    std::vector<CdrRecord> mSpill;
+
+    std::atomic<UInt64> mWritten;
+    std::atomic<UInt64> mSpilled;
+    std::atomic<UInt64> mPending;   // records in mKept
+};
+
+#endif // #if !defined(CDR_WRITER__H)
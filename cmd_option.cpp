@@ -2,8 +2,60 @@
 #include "simple_sbc.h"
 
 using namespace resip;
+
+#include <iostream>
 using namespace std;
 
+
+thread_local std::ostream* CmdOutput::sStrm = 0;
+thread_local FILE* CmdOutput::sFile = 0;
+
+CmdOutput::CmdOutput(std::ostream* strm, FILE* file)
+    : mPrevStrm(sStrm)
+    , mPrevFile(sFile)
+{
+    sStrm = strm;
+    sFile = file;
+}
+
+CmdOutput::~CmdOutput()
+{
+    if (sStrm)
+    {
+        sStrm->flush();
+    }
+    if (sFile)
+    {
+        fflush(sFile);
+    }
+    sStrm = mPrevStrm;
+    sFile = mPrevFile;
+}
+
+std::ostream& CmdOutput::out()
+{
+    return sStrm ? *sStrm : cout;
+}
+
+std::ostream& CmdOutput::err()
+{
+    return sStrm ? *sStrm : cerr;
+}
+
+FILE* CmdOutput::file(FILE* console)
+{
+    if (!sFile)
+    {
+        return console;
+    }
+    // both streams of the connection are interleaved, keep the order
+    if (sStrm)
+    {
+        sStrm->flush();
+    }
+    return sFile;
+}
+
 bool Cmd::toUri(const resip::Data& input, resip::Uri& uri, resip::Data& errmsg, const resip::Data& description/* = resip::Data::Empty*/)
 {
     try
@@ -75,9 +127,9 @@ static void displayArgs(poptContext con,
     /*@modifies fileSystem@*/
 {
     if (key->shortName == 'h')
-        poptPrintHelp(con, stdout, 0);
+        poptPrintHelp(con, CmdOutput::file(stdout), 0);
     else
-        poptPrintUsage(con, stdout, 0);
+        poptPrintUsage(con, CmdOutput::file(stdout), 0);
 }
 
 const struct poptOption Cmd::getHelpTable()
@@ -169,12 +221,61 @@ CmdRunner::CmdRunner(int argc, const char** argv, const char* version)
     , mLogFile("sbc.log")
     , mLogFileSize(5242880)
     , mKeepAllLogFiles(0)
+    , mLogSync(0)
+    , mLogSample(1.0)
     , mSipUdpPort(55555)
     , mSipTcpPort(55555)
+    , mSipTlsPort(0)
+    , mSipWssPort(0)
+    , mTlsSessionCache(20000)
+    , mTlsSessionTimeout(3600)
+    , mIpv6(0)
+    , mDumWorkers(1)
+    , mStackMode(StackSplit)
+    , mUdpSockets(1)
+    , mOverloadQueue(0)
+    , mOverloadWait(0)
+    , mOverloadLatency(0)
+    , mRetryAfter(10)
+    , mRateLimitSources(65536)
+    , mCdrMaxSize(67108864)
+    , mCdrRotate(3600)
+    , mCdrSync(1000)
+    , mMetricsPort(0)
+    , mDaemon(0)
+    , mTakeover(0)
+    , mHandoffDrain(300)
+    , mBenchUas(100)
+    , mBenchRate(50)
+    , mBenchDuration(10)
     , mVersion(version ? version : "")
 {
 }
 
+static const char* sStackModeMap[] = {
+    "single",
+    "split",
+    "transport"
+};
+
+bool CmdRunner::toStackMode(const resip::Data& name, StackMode& mode)
+{
+    for (int i = StackSingle; i <= StackTransport; ++i)
+    {
+        if (name == sStackModeMap[i])
+        {
+            mode = (StackMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* CmdRunner::getStackModeName(StackMode mode)
+{
+    return sStackModeMap[mode];
+}
+
 bool CmdRunner::processOneOption(poptContext ctx, int ret)
 {
     switch (ret)
@@ -205,10 +306,10 @@ bool CmdReg::processOneOption(poptContext ctx, int ret)
     switch (ret)
     {
     case 'h':
-        poptPrintHelp(ctx, stderr, 0);
+        poptPrintHelp(ctx, CmdOutput::file(stderr), 0);
         return false;
     case 'u':
-        poptPrintUsage(ctx, stderr, 0);
+        poptPrintUsage(ctx, CmdOutput::file(stderr), 0);
         return false;
     default:
         break;
@@ -218,6 +319,7 @@ bool CmdReg::processOneOption(poptContext ctx, int ret)
 
 //////////////////////////////////////////////////////////////////////////
 CmdCall::CmdCall(int argc, const char** argv, SimpleSBC* sbc) : Cmd(argc, argv, Call, sbc), mStart(false), mEnd(false), mReinvite(false)
+    , mCount(0), mRate(10), mHold(0), mTargets("all")
 {
 }
 
@@ -252,10 +354,10 @@ bool CmdCall::processOneOption(poptContext ctx, int ret)
         mReinvite = true;
         break;
     case 'h':
-        poptPrintHelp(ctx, stderr, 0);
+        poptPrintHelp(ctx, CmdOutput::file(stderr), 0);
         return false;
     case 'u':
-        poptPrintUsage(ctx, stderr, 0);
+        poptPrintUsage(ctx, CmdOutput::file(stderr), 0);
         return false;
     default:
         break;
@@ -295,6 +397,21 @@ bool CmdCall::processNonOptionArgs(poptContext ctx)
 
 bool CmdCall::exec()
 {
+    if (mCount)
+    {
+        if (mStart || mEnd || mReinvite || !mTarget.empty())
+        {
+            setLastErr("Targets are given by --targets", "-n|--count");
+            return false;
+        }
+        if (mCount < 0 || mRate <= 0 || mHold < 0)
+        {
+            setLastErr("Must be positive", "-n|--count, --rate, --hold");
+            return false;
+        }
+        return mSbc->makeNewCalls((unsigned)mCount, (unsigned)mRate, (unsigned)mHold, mTargets, mFile);
+    }
+
     if (mEnd)
     {
         if (mIds.empty())
@@ -357,6 +474,14 @@ bool CmdShow::processNonOptionArgs(poptContext ctx)
     {
         mSbc->showAllCall();
     }
+    else if (strcmp(arg, "stats") == 0)
+    {
+        mSbc->showStats();
+    }
+    else if (strcmp(arg, "mem") == 0)
+    {
+        mSbc->showMem();
+    }
     else
     {
         setLastErr("Unknown command", arg);
@@ -382,9 +507,9 @@ bool CmdHelp::processNonOptionArgs(poptContext ctx)
     if (!arg)
     {
         if (mUsage)
-            poptPrintUsage(ctx, stderr, 0);
+            poptPrintUsage(ctx, CmdOutput::file(stderr), 0);
         else
-            poptPrintHelp(ctx, stderr, 0);
+            poptPrintHelp(ctx, CmdOutput::file(stderr), 0);
         return false;
     }
 
@@ -431,7 +556,7 @@ unique_ptr<Cmd> CmdFactory::instanceCmd(const string& cmd, SimpleSBC* sbc)
     int ret = poptParseArgvString(cmd.c_str(), &argc, &argv);
     if (ret)
     {
-        cerr << poptStrerror(ret) << endl;
+        CmdOutput::err() << poptStrerror(ret) << endl;
         free(argv);
         return NULL;
     }
@@ -456,7 +581,7 @@ unique_ptr<Cmd> CmdFactory::instanceCmd(const string& cmd, SimpleSBC* sbc)
         inst = unique_ptr<Cmd>(new CmdHelp(argc, argv, sbc));
         break;
     default:
-        cerr << "Unknown command: " << argv[0] << ", Type 'help' for detail command" << endl;
+        CmdOutput::err() << "Unknown command: " << argv[0] << ", Type 'help' for detail command" << endl;
         break;
     }
 
@@ -3,11 +3,15 @@
 #define CMD_OPTION__H
 
 #include "popt.h"
+#include "rate_limiter.h"
 #include "resip/stack/Uri.hxx"
 #include "rutil/Data.hxx"
+#include <cstdio>
+#include <iosfwd>
 #include <string>
 #include <list>
 #include <memory>
+#include <vector>
 
 class poptString
 {
@@ -34,6 +38,56 @@ private:
     char* mStr;
 };
 
+// strings of a repeatable option, POPT_ARG_ARGV
+class poptArgv
+{
+public:
+    poptArgv() : mArgv(0) {}
+    ~poptArgv() {
+        for (char** i = mArgv; i && *i; ++i)
+        {
+            free(*i);
+        }
+        free(mArgv);
+    }
+    char*** operator&() { return &mArgv; }
+    const char* const* begin() const { return mArgv; }
+    const char* const* end() const {
+        char** i = mArgv;
+        while (i && *i) ++i;
+        return i;
+    }
+private:
+    poptArgv(const poptArgv& rhs) = delete;
+    poptArgv operator=(const poptArgv& rhs) = delete;
+    char** mArgv;
+};
+
+// Where the commands write: the console, unless the thread running the command is
+// redirected to the control connection the command came from
+class CmdOutput
+{
+public:
+    /// redirect this thread until destroyed, null restores the console
+    CmdOutput(std::ostream* strm, FILE* file);
+    ~CmdOutput();
+
+    static std::ostream& out();
+    static std::ostream& err();
+    /// for popt, which prints help and usage to a FILE*
+    static FILE* file(FILE* console);
+
+    static std::ostream* redirected() { return sStrm; }
+    static FILE* redirectedFile() { return sFile; }
+
+private:
+    std::ostream* mPrevStrm;
+    FILE* mPrevFile;
+
+    static thread_local std::ostream* sStrm;
+    static thread_local FILE* sFile;
+};
+
 class SimpleSBC;
 class Cmd
 {
@@ -86,20 +140,86 @@ public:
         poptString logType;
         poptString logLevel;
         poptString logFile;
-        poptString sipAddress;
+        poptArgv sipAddresses;
+        poptArgv rateLimits;
+        poptString stackMode;
+        poptString bench;
+        poptString regStore;
+        poptString control;
+        poptString tlsCert;
+        poptString tlsKey;
+        poptString tlsDomain;
+        poptString cdr;
+        poptString handoff;
 
         struct poptOption tableFileLog[] = {
             { "log-level",        'l', POPT_ARG_STRING, &logLevel,           0, "specify the log level, default is `info`",                 "debug|info|warning|alert" },
             { "log-file",         'f', POPT_ARG_STRING, &logFile,            0, "specify the log file name, default is `sbc.log`",          "sbc.log" },
             { "log-max-size",     's', POPT_ARG_LONG,   &mLogFileSize,       0, "specify the log file max size, default is 5242880(5M)",    "5242880" },
             { "keep-all-log",     'k', POPT_ARG_NONE,   &mKeepAllLogFiles,   0, "keep all the log file, default is no",                     0 },
+            { "log-sync",        '\0', POPT_ARG_NONE,   &mLogSync,           0, "write the log file from the logging threads instead of a background thread, default is no", 0 },
+            { "log-sample",      '\0', POPT_ARG_DOUBLE, &mLogSample,         0, "ratio of calls whose complete SIP messages are logged, default is `1`", "0.01" },
             POPT_TABLEEND
         };
 
         struct poptOption tableSipAddr[] = {
-            { "addr",        'a', POPT_ARG_STRING,  &sipAddress,    0, "Local IP Address to bind SIP transports to, sbc will bind to all adapters if not specified",    0 },
+            { "addr",        'a', POPT_ARG_ARGV,    &sipAddresses,  0, "Local IP Address to bind SIP transports to, repeat it for every interface, sbc will bind to all adapters if not specified",    0 },
+            { "ipv6",       '\0', POPT_ARG_NONE,    &mIpv6,         0, "Also bind the SIP transports to all the IPv6 adapters when --addr is not specified, and accept requests for the IPv6 interface addresses, default is no", 0 },
             { "udp-port",    'u', POPT_ARG_INT,     &mSipUdpPort,   0, "Local port to listen on for SIP messages over UDP - 0 to disable, default is `55555`",          "55555" },
             { "tcp-port",    't', POPT_ARG_INT,     &mSipTcpPort,   0, "Local port to listen on for SIP messages over TCP - 0 to disable, default is `55555`",          "55555" },
+            { "reg-store",   'r', POPT_ARG_STRING,  &regStore,      0, "Path prefix of the files persisting registrations across restarts, registrations are kept in memory only if not specified", "./sbc_regs" },
+            POPT_TABLEEND
+        };
+
+        struct poptOption tableTls[] = {
+            { "tls-port",            '\0', POPT_ARG_INT,    &mSipTlsPort,        0, "Local port to listen on for SIP messages over TLS - 0 to disable, default is `0`",             "5061" },
+            { "wss-port",            '\0', POPT_ARG_INT,    &mSipWssPort,        0, "Local port to listen on for SIP messages over secure WebSocket - 0 to disable, default is `0`", "8443" },
+            { "tls-cert",            '\0', POPT_ARG_STRING, &tlsCert,            0, "PEM certificate of the TLS and WSS transports",                                          "./sbc.crt" },
+            { "tls-key",             '\0', POPT_ARG_STRING, &tlsKey,             0, "PEM private key of the certificate",                                                      "./sbc.key" },
+            { "tls-domain",          '\0', POPT_ARG_STRING, &tlsDomain,          0, "Domain name the certificate is issued for",                                              "sbc.example.com" },
+            { "tls-session-cache",   '\0', POPT_ARG_INT,    &mTlsSessionCache,   0, "Number of TLS sessions kept for resumption, shared by all the TLS and WSS transports - 0 to disable, default is `20000`", "20000" },
+            { "tls-session-timeout", '\0', POPT_ARG_INT,    &mTlsSessionTimeout, 0, "Seconds a TLS session or ticket can be resumed, default is `3600`",                      "3600" },
+            POPT_TABLEEND
+        };
+
+        struct poptOption tableThreading[] = {
+            { "dum-workers", 'w', POPT_ARG_INT,     &mDumWorkers,   0, "Number of DialogUsageManager instances, each one runs on its own thread, default is `1`",        "1" },
+            { "stack-mode",  'm', POPT_ARG_STRING,  &stackMode,     0, "Threading of sip stack: `single` runs everything on one thread, `split` moves transaction processing and dns to their own threads, "
+                                                                       "`transport` additionally gives every transport its own receive/send thread, default is `split`",    "single|split|transport" },
+            { "udp-sockets", '\0', POPT_ARG_INT,    &mUdpSockets,   0, "Number of UDP sockets sharing --udp-port through SO_REUSEPORT, each one received by its own thread, default is `1`", "1" },
+            POPT_TABLEEND
+        };
+
+        struct poptOption tableOverload[] = {
+            { "overload-queue",   '\0', POPT_ARG_INT,   &mOverloadQueue,   0, "Messages waiting in a stack or DUM fifo at which new INVITE and REGISTER are rejected with 503 - 0 to ignore, default is `0`", "2000" },
+            { "overload-wait",    '\0', POPT_ARG_INT,   &mOverloadWait,    0, "Expected wait in ms of a stack or DUM fifo at which new INVITE and REGISTER are rejected - 0 to ignore, default is `0`", "500" },
+            { "overload-latency", '\0', POPT_ARG_INT,   &mOverloadLatency, 0, "Mean DUM handler latency in us at which new INVITE and REGISTER are rejected - 0 to ignore, default is `0`", "2000" },
+            { "retry-after",      '\0', POPT_ARG_INT,   &mRetryAfter,      0, "Seconds of the Retry-After of the 503, spread up to twice as much, default is `10`", "10" },
+            { "rate-limit",       '\0', POPT_ARG_ARGV,  &rateLimits,       0, "Requests per second and burst a source address may send out of dialog for a method, "
+                                                                                 "more are rejected with 503, repeat it for every method, up to 4, not limited if not specified", "REGISTER=5/20" },
+            { "rate-limit-sources", '\0', POPT_ARG_INT, &mRateLimitSources, 0, "Source addresses tracked by --rate-limit, the least recently seen are forgotten first, default is `65536`", "65536" },
+            POPT_TABLEEND
+        };
+
+        struct poptOption tableCdr[] = {
+            { "cdr",          '\0', POPT_ARG_STRING, &cdr,          0, "Path prefix of the CSV files of call detail records, one record per call, no record is written if not specified", "./sbc_cdr" },
+            { "cdr-max-size", '\0', POPT_ARG_LONG,   &mCdrMaxSize,  0, "Bytes at which a CDR file is closed and the next one started - 0 for no limit, default is `67108864`", "67108864" },
+            { "cdr-rotate",   '\0', POPT_ARG_INT,    &mCdrRotate,   0, "Seconds after which a CDR file is closed and the next one started - 0 for no limit, default is `3600`", "3600" },
+            { "cdr-sync",     '\0', POPT_ARG_INT,    &mCdrSync,     0, "Most ms the records written stay unsynced to disk, one fsync covers all of them, default is `1000`", "1000" },
+            POPT_TABLEEND
+        };
+
+        struct poptOption tableHandoff[] = {
+            { "handoff",       '\0', POPT_ARG_STRING, &handoff,       0, "Unix domain socket a new process takes this one over through, needs --daemon, disabled if not specified", "./sbc.handoff" },
+            { "takeover",      '\0', POPT_ARG_NONE,   &mTakeover,     0, "take over the registrations and ports of the process running with the same --handoff, it then drains its calls and exits", 0 },
+            { "handoff-drain", '\0', POPT_ARG_INT,    &mHandoffDrain, 0, "Most seconds a process taken over waits for its calls to end before it exits, default is `300`", "300" },
+            POPT_TABLEEND
+        };
+
+        struct poptOption tableBench[] = {
+            { "bench-uas",      '\0', POPT_ARG_INT,   &mBenchUas,       0, "Number of simulated user agents, default is `100`",                     "100" },
+            { "bench-rate",     '\0', POPT_ARG_INT,   &mBenchRate,      0, "Target requests per second of every phase, default is `50`",            "50" },
+            { "bench-duration", '\0', POPT_ARG_INT,   &mBenchDuration,  0, "Seconds of INVITE->BYE cycles at the target rate, default is `10`",      "10" },
             POPT_TABLEEND
         };
 
@@ -107,6 +227,16 @@ public:
             { "log-type",         'o', POPT_ARG_STRING,         &logType,           0,  "where to send logging messages, default is `file`",    "cout|file" },
             { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableFileLog,       0,  "options for '--log-type=file'",                        0 },
             { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableSipAddr,       0,  "options for sipstack configuration",                   0 },
+            { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableTls,           0,  "options for TLS and WSS transports, built with USE_SSL only", 0 },
+            { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableThreading,     0,  "options for threading model",                          0 },
+            { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableOverload,      0,  "options for overload control and rate limiting, overload control is disabled when all the marks are 0", 0 },
+            { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableCdr,           0,  "options for call detail records",                      0 },
+            { "metrics-port",    '\0', POPT_ARG_INT,            &mMetricsPort,      0,  "Local port serving prometheus text metrics on 127.0.0.1 - 0 to disable, default is `0`", "9100" },
+            { "control",          'c', POPT_ARG_STRING,         &control,           0,  "Unix domain socket taking the console commands, one per line or as {\"cmd\": \"...\"}, disabled if not specified", "./sbc.sock" },
+            { "daemon",           'd', POPT_ARG_NONE,           &mDaemon,           0,  "run in the background without console, commands are taken by --control, `./sbc.sock` if not specified", 0 },
+            { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableHandoff,       0,  "options for upgrading a running process without downtime", 0 },
+            { "bench",            'b', POPT_ARG_STRING,         &bench,             0,  "run the specified benchmark instead of the sbc and exit, `sip` runs the sbc against simulated user agents", "registry|decorator|udp|tls|mem|store|sip" },
+            { NULL,              '\0', POPT_ARG_INCLUDE_TABLE,  tableBench,         0,  "options for '--bench=sip'",                            0 },
             {"version",           'v', POPT_ARG_NONE,           0,                'v',  "show version",                                         0 },
             { "help",             'h', POPT_ARG_NONE,           NULL,             'h',  "Show this help message",                               NULL },
             { "usage",           '\0', POPT_ARG_NONE,           NULL,             'u',  "Display brief usage message",                          NULL },
@@ -121,18 +251,126 @@ public:
         if (logType) { mLogType = logType; }
         if (logLevel) { mLogLevel = logLevel; }
         if (logFile) { mLogFile = logFile; }
-        if (sipAddress) { mSipAddress = sipAddress; }
+        for (const char* addr : sipAddresses) { mSipAddresses.push_back(addr); }
+        if (bench) { mBench = bench; }
+        if (regStore) { mRegStore = regStore; }
+        if (control) { mControlPath = control; }
+        if (tlsCert) { mTlsCert = tlsCert; }
+        if (tlsKey) { mTlsKey = tlsKey; }
+        if (tlsDomain) { mTlsDomain = tlsDomain; }
+        if (cdr) { mCdrPath = cdr; }
+        if (handoff) { mHandoffPath = handoff; }
+        if (stackMode && !toStackMode(stackMode, mStackMode))
+        {
+            setLastErr("Unknown stack mode", stackMode);
+            return false;
+        }
+        if (mUdpSockets < 1)
+        {
+            setLastErr("--udp-sockets must be at least 1");
+            return false;
+        }
+        for (const char* text : rateLimits)
+        {
+            RateLimiter::Limit limit;
+            if (!RateLimiter::parse(text, limit))
+            {
+                setLastErr("Invalid rate limit, expected METHOD=RATE[/BURST]", text);
+                return false;
+            }
+            mRateLimits.push_back(limit);
+        }
+        if (mRateLimits.size() > RateLimiter::sMaxLimits || mRateLimitSources < 1)
+        {
+            setLastErr("--rate-limit can be given for 4 methods at most, --rate-limit-sources must be at least 1");
+            return false;
+        }
+        if (mOverloadQueue < 0 || mOverloadWait < 0 || mOverloadLatency < 0 || mRetryAfter < 1 || mRetryAfter > 3600)
+        {
+            setLastErr("--overload-* must not be negative, --retry-after must be within 1..3600");
+            return false;
+        }
+        if (mCdrMaxSize < 0 || mCdrRotate < 0 || mCdrSync < 0)
+        {
+            setLastErr("--cdr-* must not be negative");
+            return false;
+        }
+        if (mTakeover && mHandoffPath.empty())
+        {
+            setLastErr("--takeover needs --handoff");
+            return false;
+        }
+        if (mHandoffDrain < 0)
+        {
+            setLastErr("--handoff-drain must not be negative");
+            return false;
+        }
+        if ((mSipTlsPort || mSipWssPort) && (mTlsCert.empty() || mTlsKey.empty()))
+        {
+            setLastErr("--tls-port and --wss-port need --tls-cert and --tls-key");
+            return false;
+        }
+#if !defined(USE_SSL)
+        if (mSipTlsPort || mSipWssPort)
+        {
+            setLastErr("TLS and WSS need a build with USE_SSL");
+            return false;
+        }
+#endif
 
         return true;
     }
+    enum StackMode
+    {
+        StackSingle,
+        StackSplit,
+        StackTransport,
+    };
+    static bool toStackMode(const resip::Data& name, StackMode& mode);
+    static const char* getStackModeName(StackMode mode);
+
     resip::Data mLogType;
     resip::Data mLogLevel;
     resip::Data mLogFile;
     long mLogFileSize;
     int mKeepAllLogFiles;
-    resip::Data mSipAddress;
+    int mLogSync;
+    double mLogSample;
+    std::vector<resip::Data> mSipAddresses;
+    int mIpv6;
     int mSipUdpPort;
     int mSipTcpPort;
+    int mSipTlsPort;
+    int mSipWssPort;
+    resip::Data mTlsCert;
+    resip::Data mTlsKey;
+    resip::Data mTlsDomain;
+    int mTlsSessionCache;
+    int mTlsSessionTimeout;
+    int mDumWorkers;
+    StackMode mStackMode;
+    int mUdpSockets;
+    int mOverloadQueue;
+    int mOverloadWait;
+    int mOverloadLatency;
+    int mRetryAfter;
+    std::vector<RateLimiter::Limit> mRateLimits;
+    int mRateLimitSources;
+    resip::Data mCdrPath;
+    long mCdrMaxSize;
+    int mCdrRotate;
+    int mCdrSync;
+    int mMetricsPort;
+    resip::Data mControlPath;
+    int mDaemon;
+    resip::Data mHandoffPath;
+    int mTakeover;
+    int mHandoffDrain;
+    resip::Data mRegStore;
+    resip::Data mBench;
+    int mBenchUas;
+    int mBenchRate;
+    int mBenchDuration;
 protected:
     bool processOneOption(poptContext ctx, int ret);
     resip::Data mVersion;
@@ -189,12 +427,13 @@ protected:
 class CmdCall : public Cmd
 {
 public:
-    CmdCall(bool showUsage = false) : Cmd(Call, showUsage), mStart(false), mEnd(false), mReinvite(false) {}
+    CmdCall(bool showUsage = false) : Cmd(Call, showUsage), mStart(false), mEnd(false), mReinvite(false), mCount(0), mRate(10), mHold(0) {}
     CmdCall(int argc, const char** argv, SimpleSBC* sbc);
     bool run()
     {
         poptString target;
         poptString file;
+        poptString targets;
         int id= 0;
         int finish = 0;
         const struct poptOption table[] = {
@@ -202,6 +441,10 @@ public:
             { "file",   'f', POPT_ARG_STRING,   (void*)&file,   0,  "specify an sdp text file path, use auto-generated sdp content if not specified", "./sdp.txt" },
             { "end",    'e', POPT_ARG_NONE,     0,             'e', "End specifed call, the numbers after behind args which list in `show call`", 0} ,
             { "re-invite", 'r', POPT_ARG_NONE,  0,             'r', "Re-invite an existed call, the reg id after behind args which list in `show call`", 0 },
+            { "count",  'n', POPT_ARG_INT,      &mCount,        0,  "Start that many calls paced at --rate over --targets, then show answered/failed counts and setup times", "1000" },
+            { "rate",  '\0', POPT_ARG_INT,      &mRate,         0,  "Calls per second started by --count, default is `10`", "10" },
+            { "targets",'\0', POPT_ARG_STRING,  (void*)&targets, 0, "Registrations called by --count: all of them, a range of the ids listed in `show reg`, or a file of one aor per line, default is `all`", "all|<id>-<id>|<file>" },
+            { "hold",  '\0', POPT_ARG_INT,      &mHold,         0,  "Seconds a call started by --count lasts once answered, default is `0`", "0" },
             //getHelpTable(),
             { "help",             'h', POPT_ARG_NONE,           NULL,             'h',  "Show this help message",                               NULL },
             { "usage",            'u', POPT_ARG_NONE,           NULL,             'u',  "Display brief usage message",                          NULL },
@@ -214,11 +457,12 @@ public:
         }
 
         if (file) mFile = file;
+        if (targets) mTargets = targets;
 
         return exec();
     }
 protected:
-    const char* getReplaceHelpText() { return "[-e] [<num1> <num2>...] | [[-f ./sdp.txt] [-i|-r <num>]|[<SIP URI>]]"; }
+    const char* getReplaceHelpText() { return "[-e] [<num1> <num2>...] | [[-f ./sdp.txt] [-i|-r <num>]|[<SIP URI>]] | [-f ./sdp.txt] -n <count> [--rate <r>] [--targets <t>] [--hold <s>]"; }
     bool processOneOption(poptContext ctx, int ret);
     bool processNonOptionArgs(poptContext ctx);
     bool exec();
@@ -229,6 +473,10 @@ private:
     bool mEnd;
     bool mReinvite;
     std::list<UInt64> mIds;
+    int mCount;
+    int mRate;
+    int mHold;
+    resip::Data mTargets;
 };
 
 class CmdShow : public Cmd
@@ -246,7 +494,7 @@ public:
         return parseAndExec(table);
     }
 protected:
-    const char* getReplaceHelpText() { return "[OPTIONS]... [reg|call]"; }
+    const char* getReplaceHelpText() { return "[OPTIONS]... [reg|call|stats|mem]"; }
     bool processNonOptionArgs(poptContext ctx);
 };
 
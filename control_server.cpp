@@ -0,0 +1,423 @@
+#include "control_server.h"
+#include "cmd_option.h"
+#include "simple_sbc.h"
+#include "ss_subsystem.h"
+
+#include "rutil/Logger.hxx"
+using namespace resip;
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <streambuf>
+using namespace std;
+
+#if !defined(WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+#if !defined(WIN32)
+
+namespace
+{
+    const int sPollMs = 500;
+
+    bool sendAll(int fd, const char* data, size_t len)
+    {
+        while (len)
+        {
+            ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // streams the output of a command to the connection as it is written
+    class SocketBuf : public std::streambuf
+    {
+    public:
+        explicit SocketBuf(int fd) : mFd(fd) { setp(mBuf, mBuf + sizeof(mBuf)); }
+        ~SocketBuf() { sync(); }
+
+    protected:
+        virtual int overflow(int c)
+        {
+            if (sync() != 0)
+            {
+                return traits_type::eof();
+            }
+            if (c != traits_type::eof())
+            {
+                *pptr() = (char)c;
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        virtual int sync()
+        {
+            bool ok = sendAll(mFd, pbase(), pptr() - pbase());
+            setp(mBuf, mBuf + sizeof(mBuf));
+            return ok ? 0 : -1;
+        }
+
+    private:
+        int mFd;
+        char mBuf[4096];
+    };
+
+    bool jsonString(const std::string& json, const char* key, std::string& value)
+    {
+        std::string quoted = std::string("\"") + key + "\"";
+        size_t pos = json.find(quoted);
+        if (pos == std::string::npos)
+        {
+            return false;
+        }
+        pos = json.find_first_not_of(" \t", pos + quoted.size());
+        if (pos == std::string::npos || json[pos] != ':')
+        {
+            return false;
+        }
+        pos = json.find_first_not_of(" \t", pos + 1);
+        if (pos == std::string::npos || json[pos] != '"')
+        {
+            return false;
+        }
+
+        value.clear();
+        for (++pos; pos < json.size(); ++pos)
+        {
+            char c = json[pos];
+            if (c == '"')
+            {
+                return true;
+            }
+            if (c == '\\' && ++pos < json.size())
+            {
+                switch (json[pos])
+                {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                default: c = json[pos]; break;     // \" \\ \/
+                }
+            }
+            value += c;
+        }
+        return false;
+    }
+
+    void jsonEscape(std::ostream& strm, const std::string& text)
+    {
+        strm << '"';
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '"': strm << "\\\""; break;
+            case '\\': strm << "\\\\"; break;
+            case '\n': strm << "\\n"; break;
+            case '\r': strm << "\\r"; break;
+            case '\t': strm << "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20)
+                {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)c);
+                    strm << buf;
+                }
+                else
+                {
+                    strm << c;
+                }
+                break;
+            }
+        }
+        strm << '"';
+    }
+}
+
+ControlServer::ControlServer(SimpleSBC& sbc, const resip::Data& path)
+    : mSbc(sbc)
+    , mPath(path)
+    , mFd(-1)
+{
+}
+
+ControlServer::~ControlServer()
+{
+    if (mFd >= 0)
+    {
+        ::close(mFd);
+        ::unlink(mPath.c_str());
+    }
+}
+
+bool ControlServer::listen()
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (mPath.size() >= sizeof(addr.sun_path))
+    {
+        ErrLog(<< "control: socket path too long, " << mPath);
+        return false;
+    }
+    memcpy(addr.sun_path, mPath.data(), mPath.size());
+
+    mFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mFd < 0)
+    {
+        ErrLog(<< "control: failed to create socket, " << errno);
+        return false;
+    }
+
+    // left behind by a previous run that did not shut down
+    ::unlink(mPath.c_str());
+    if (::bind(mFd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(mFd, 16) != 0)
+    {
+        ErrLog(<< "control: failed to listen on " << mPath << ", " << errno);
+        ::close(mFd);
+        mFd = -1;
+        return false;
+    }
+    ::chmod(mPath.c_str(), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+    InfoLog(<< "control: accepting commands on " << mPath);
+    return true;
+}
+
+void ControlServer::thread()
+{
+    while (!isShutdown())
+    {
+        for (auto i = mSessions.begin(); i != mSessions.end();)
+        {
+            if ((*i)->mDone)
+            {
+                (*i)->mThread.join();
+                i = mSessions.erase(i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        pollfd pfd = { mFd, POLLIN, 0 };
+        if (::poll(&pfd, 1, sPollMs) <= 0)
+        {
+            continue;
+        }
+        int fd = ::accept(mFd, 0, 0);
+        if (fd < 0)
+        {
+            continue;
+        }
+
+        std::unique_ptr<Session> session(new Session);
+        Session* s = session.get();
+        s->mThread = std::thread([this, s, fd]()
+        {
+            serve(fd);
+            ::close(fd);
+            s->mDone = true;
+        });
+        mSessions.push_back(std::move(session));
+    }
+
+    // the sessions notice the shutdown within a poll period, or once their command ends
+    for (auto& s : mSessions)
+    {
+        s->mThread.join();
+    }
+    mSessions.clear();
+}
+
+void ControlServer::serve(int fd)
+{
+    std::string pending;
+    char buf[4096];
+    while (!isShutdown())
+    {
+        pollfd pfd = { fd, POLLIN, 0 };
+        int ret = ::poll(&pfd, 1, sPollMs);
+        if (ret == 0)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            return;
+        }
+
+        ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        pending.append(buf, n);
+
+        size_t eol;
+        while ((eol = pending.find('\n')) != std::string::npos)
+        {
+            std::string line = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            if (!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.erase(line.size() - 1);
+            }
+            if (line.empty())
+            {
+                continue;
+            }
+            if (!execute(fd, line))
+            {
+                return;
+            }
+        }
+    }
+}
+
+bool ControlServer::execute(int fd, const std::string& line)
+{
+    std::string error;
+    bool exit = false;
+    bool ok;
+
+    // popt prints help and usage to a FILE*, collected and sent after the command
+    char* printed = 0;
+    size_t printedLen = 0;
+    FILE* file = open_memstream(&printed, &printedLen);
+
+    if (line[0] == '{')
+    {
+        std::string cmd;
+        ostringstream output;
+        if (!jsonString(line, "cmd", cmd))
+        {
+            ok = false;
+            error = "missing \"cmd\"";
+        }
+        else
+        {
+            ok = run(cmd, output, file, error, exit);
+        }
+        if (file)
+        {
+            fclose(file);
+            output.write(printed, printedLen);
+        }
+
+        ostringstream reply;
+        reply << "{\"ok\": " << (ok ? "true" : "false") << ", \"output\": ";
+        jsonEscape(reply, output.str());
+        if (!ok)
+        {
+            reply << ", \"error\": ";
+            jsonEscape(reply, error);
+        }
+        reply << "}\n";
+        const std::string& text = reply.str();
+        ok = sendAll(fd, text.data(), text.size());
+    }
+    else
+    {
+        SocketBuf sbuf(fd);
+        ostream output(&sbuf);
+        bool executed = run(line, output, file, error, exit);
+        if (file)
+        {
+            fclose(file);
+            output.write(printed, printedLen);
+        }
+        if (executed)
+        {
+            output << "OK\n";
+        }
+        else
+        {
+            output << "ERR " << error << "\n";
+        }
+        output.flush();
+        ok = output.good();
+    }
+    free(printed);
+
+    return ok && !exit;
+}
+
+bool ControlServer::run(const std::string& line, std::ostream& strm, FILE* file, std::string& error, bool& exit)
+{
+    CmdOutput output(&strm, file);
+    unique_ptr<Cmd> cmd = CmdFactory::instanceCmd(line, &mSbc);
+    if (!cmd)
+    {
+        error = "invalid command";
+        return false;
+    }
+    if (cmd->getCommandType() == Cmd::Exit)
+    {
+        exit = true;
+        return true;
+    }
+    if (!cmd->run())
+    {
+        error = cmd->getLastErr();
+        return false;
+    }
+    return true;
+}
+
+#else
+
+ControlServer::ControlServer(SimpleSBC& sbc, const resip::Data& path)
+    : mSbc(sbc)
+    , mPath(path)
+    , mFd(-1)
+{
+}
+
+ControlServer::~ControlServer()
+{
+}
+
+bool ControlServer::listen()
+{
+    ErrLog(<< "control: unix domain sockets are not supported on this platform");
+    return false;
+}
+
+void ControlServer::thread()
+{
+}
+
+void ControlServer::serve(int fd)
+{
+}
+
+bool ControlServer::execute(int fd, const std::string& line)
+{
+    return false;
+}
+
+bool ControlServer::run(const std::string& line, std::ostream& strm, FILE* file, std::string& error, bool& exit)
+{
+    return false;
+}
+
+#endif
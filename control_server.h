@@ -0,0 +1,55 @@
+#if !defined(CONTROL_SERVER__H)
+#define CONTROL_SERVER__H
+
+#include "rutil/Data.hxx"
+#include "rutil/ThreadIf.hxx"
+
+#include <atomic>
+#include <cstdio>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+
+
+class SimpleSBC;
+
+// Local control channel on a Unix domain socket, for scripts and for running headless.
+// Every connection has its own thread and takes the console commands, one per line:
+//  - plain line: the output is streamed back as the command runs, then a line `OK` or
+//    `ERR <reason>`
+//  - line starting with `{`: JSON request `{"cmd": "show reg"}`, answered by a single
+//    line `{"ok": true, "output": "..."}`, with "error" when it failed
+// `exit` closes the connection. Commands touching calls run on the DUM thread owning
+// them, see DumShard::execute, so any number of connections can issue commands at once
+// without racing or holding up the SIP processing.
+class ControlServer : public resip::ThreadIf
+{
+public:
+    ControlServer(SimpleSBC& sbc, const resip::Data& path);
+    ~ControlServer();
+
+    bool listen();
+    virtual void thread();
+
+private:
+    struct Session
+    {
+        Session() : mDone(false) {}
+        std::thread mThread;
+        std::atomic<bool> mDone;
+    };
+
+    void serve(int fd);
+    /// @return false when the connection is to be closed
+    bool execute(int fd, const std::string& line);
+    bool run(const std::string& line, std::ostream& strm, FILE* file, std::string& error, bool& exit);
+
+    SimpleSBC& mSbc;
+    const resip::Data mPath;
+    int mFd;
+    std::list<std::unique_ptr<Session> > mSessions;
+};
+
+#endif // #if !defined(CONTROL_SERVER__H)
@@ -0,0 +1,27 @@
+#if !defined(DUM_COMMAND__H)
+#define DUM_COMMAND__H
+
+#include "resip/dum/DumCommand.hxx"
+
+#include <functional>
+#include <ostream>
+
+
+// Runs a function on the thread of the DialogUsageManager it is posted to
+class DumFunctorCommand : public resip::DumCommand
+{
+public:
+    explicit DumFunctorCommand(std::function<void()> func, const char* name = "DumFunctorCommand")
+        : mFunc(std::move(func)), mName(name) {}
+
+    virtual void executeCommand() { mFunc(); }
+    virtual resip::Message* clone() const { return new DumFunctorCommand(mFunc, mName); }
+    virtual EncodeStream& encode(EncodeStream& strm) const { return strm << mName; }
+    virtual EncodeStream& encodeBrief(EncodeStream& strm) const { return strm << mName; }
+
+private:
+    std::function<void()> mFunc;
+    const char* mName;
+};
+
+#endif // #if !defined(DUM_COMMAND__H)
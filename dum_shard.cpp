@@ -0,0 +1,314 @@
+#include "dum_shard.h"
+#include "dum_command.h"
+#include "mem_stats.h"
+#include "ss_subsystem.h"
+
+#include "resip/dum/DumThread.hxx"
+#include "resip/stack/ConnectionTerminated.hxx"
+#include "resip/stack/SipStack.hxx"
+#include "rutil/Condition.hxx"
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#include <iostream>
+#include <sstream>
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+resip::Mutex DumShard::sPinnedMutex;
+HashMap<resip::Data, unsigned> DumShard::sPinned;
+std::atomic<unsigned> DumShard::sPinSlots[DumShard::sPinSlotCount];
+
+namespace
+{
+    // the shard whose execute() is running on this thread
+    thread_local DumShard* sExecuting = 0;
+    // most a command waits for its shard to pick it up
+    const UInt64 sExecuteTimeoutMs = 10000;
+}
+
+DumShard::DumShard(resip::SipStack& stack, SimpleSBC& sbc, unsigned index, unsigned count)
+    : DialogUsageManager(stack)
+    , mSbc(sbc)
+    , mIndex(index)
+    , mCount(count)
+    , mRegDb(new RegDb())
+    , mThread(0)
+    , mProfiles([&sbc](const Tuple& flow, ProfileCache::Kind kind) { return sbc.makeUserProfile(flow, kind); })
+    , mConnectionWatch(*this)
+    , mExpiryTicks(0)
+    , mAorBytes(0)
+{
+    for (auto& state : mCallStates)
+    {
+        state = 0;
+    }
+    mRegDb->setHandler(this);
+    setRegistrationPersistenceManager(mRegDb);
+    registerForConnectionTermination(&mConnectionWatch);
+    mThread = new DumThread(*this);
+}
+
+DumShard::~DumShard()
+{
+    unRegisterForConnectionTermination(&mConnectionWatch);
+    delete mThread; mThread = 0;
+    delete mRegDb; mRegDb = 0;
+    MemStats::change(MemStats::AorEntry, -(SInt64)mRegs.size(), -mAorBytes);
+}
+
+unsigned DumShard::shardOf(const resip::Data& key, unsigned count)
+{
+    if (count <= 1)
+    {
+        return 0;
+    }
+    return (unsigned)(key.hash() % count);
+}
+
+unsigned DumShard::shardOf(const resip::Uri& aor, unsigned count)
+{
+    if (count <= 1)
+    {
+        return 0;
+    }
+    return shardOf(aor.getAor(), count);
+}
+
+unsigned DumShard::shardOf(const resip::SipMessage& msg, unsigned count)
+{
+    if (count <= 1)
+    {
+        return 0;
+    }
+
+    if (msg.isRequest() && msg.method() == REGISTER && msg.exists(h_To))
+    {
+        return shardOf(msg.header(h_To).uri(), count);
+    }
+
+    if (!msg.exists(h_CallId))
+    {
+        return 0;
+    }
+
+    // a Call-ID in a slot no pinned one hashes to, nearly all of them, is routed by its
+    // hash without taking the lock
+    const Data& callId = msg.header(h_CallId).value();
+    size_t hash = callId.hash();
+    if (sPinSlots[hash % sPinSlotCount].load(std::memory_order_acquire))
+    {
+        Lock lock(sPinnedMutex);
+        auto it = sPinned.find(callId);
+        if (it != sPinned.end())
+        {
+            return it->second;
+        }
+    }
+    return (unsigned)(hash % count);
+}
+
+void DumShard::pinCallId(const resip::Data& callId, unsigned shard)
+{
+    Lock lock(sPinnedMutex);
+    if (sPinned.insert(std::make_pair(callId, shard)).second)
+    {
+        sPinSlots[callId.hash() % sPinSlotCount].fetch_add(1, std::memory_order_release);
+    }
+}
+
+void DumShard::unpinCallId(const resip::Data& callId)
+{
+    Lock lock(sPinnedMutex);
+    if (sPinned.erase(callId))
+    {
+        sPinSlots[callId.hash() % sPinSlotCount].fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+bool DumShard::isForMe(const resip::SipMessage& msg) const
+{
+    // called on the stack thread for every new request
+    if (mCount > 1 && shardOf(msg, mCount) != mIndex)
+    {
+        return false;
+    }
+    return DialogUsageManager::isForMe(msg);
+}
+
+void DumShard::ConnectionWatch::post(resip::Message* msg)
+{
+    std::unique_ptr<Message> owned(msg);
+    ConnectionTerminated* terminated = dynamic_cast<ConnectionTerminated*>(msg);
+    if (terminated)
+    {
+        mShard.mProfiles.remove(terminated->getFlow());
+    }
+}
+
+void DumShard::startExpiry()
+{
+    scheduleExpiry();
+}
+
+void DumShard::scheduleExpiry()
+{
+    // runs on the shard thread, the stack only holds the timer
+    getSipStack().postMS(DumFunctorCommand([this]()
+    {
+        UInt64 now = Timer::getTimeSecs();
+        mRegDb->expire(now);
+        if (++mExpiryTicks % 60 == 0)
+        {
+            mProfiles.sweep(now, 300);
+        }
+        scheduleExpiry();
+    }, "RegExpiry"), 1000, this);
+}
+
+void DumShard::getAors(std::vector<resip::Uri>& aors) const
+{
+    mRegs.forEach([&aors](UInt64 id, const AorContact& reg)
+    {
+        aors.push_back(reg.mAor);
+    });
+}
+
+bool DumShard::execute(std::function<bool()> func)
+{
+    if (sExecuting == this)
+    {
+        return func();
+    }
+
+    // shared with the posted command, which outlives the caller when it gives up
+    struct State
+    {
+        State() : mStarted(false), mDone(false), mAbandoned(false), mResult(false) {}
+        Mutex mMutex;
+        Condition mFinished;
+        bool mStarted;
+        bool mDone;
+        bool mAbandoned;
+        bool mResult;
+        ostringstream mOutput;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+    post(new DumFunctorCommand([this, state, func]()
+    {
+        {
+            Lock lock(state->mMutex);
+            if (state->mAbandoned)
+            {
+                return;
+            }
+            state->mStarted = true;
+        }
+        bool result;
+        {
+            // never write to a control connection from here, a client that stops
+            // reading would hold up the SIP processing of the shard
+            CmdOutput output(&state->mOutput, 0);
+            sExecuting = this;
+            result = func();
+            sExecuting = 0;
+        }
+        Lock lock(state->mMutex);
+        state->mResult = result;
+        state->mDone = true;
+        state->mFinished.signal();
+    }, "Execute"));
+
+    {
+        Lock lock(state->mMutex);
+        UInt64 deadline = Timer::getTimeMs() + sExecuteTimeoutMs;
+        while (!state->mDone)
+        {
+            UInt64 now = Timer::getTimeMs();
+            if (!state->mStarted && now >= deadline)
+            {
+                // the shard is stopped or far behind, `func` refers to the caller's
+                // stack and must not run anymore
+                state->mAbandoned = true;
+                break;
+            }
+            // once started `func` is waited for whatever it takes
+            state->mFinished.wait(state->mMutex, state->mStarted ? 100 : (unsigned)(deadline - now));
+        }
+    }
+    if (!state->mDone)
+    {
+        CmdOutput::err() << "shard " << mIndex << " did not run the command within " << sExecuteTimeoutMs / 1000 << "s" << endl;
+        return false;
+    }
+    CmdOutput::out() << state->mOutput.str();
+    return state->mResult;
+}
+
+void DumShard::showAllReg(std::ostream& strm) const
+{
+    UInt64 now = ResipClock::getTimeSecs();
+    mRegs.forEach([&strm, now](UInt64 id, const AorContact& reg)
+    {
+        RegView::Contacts cl = reg.contacts();
+        strm << id << " --> Aor:" << reg.mAor << endl;
+        for (auto& j : *cl)
+        {
+            UInt64 expire = 0;
+            if (j.mRegExpires > now)
+            {
+                expire = j.mRegExpires - now;
+            }
+            strm << "      --Contact:" << j.mContact << endl
+                 << "      --Expires In:" << expire << endl;
+        }
+    });
+}
+
+void DumShard::showAllCall(std::ostream& strm) const
+{
+    UInt64 now = Timer::getTimeMs();
+    mCalls.forEach([&strm, now](UInt64 id, const std::shared_ptr<const SSDialogSet::View>& call)
+    {
+        strm << id << " --> " << call->mPeer << " " << SSDialogSet::getStateName(call->mState)
+             << " " << (now - call->mEntered) / 1000 << "s" << endl;
+    });
+}
+
+void DumShard::moveCallState(SSDialogSet::CallState from, SSDialogSet::CallState to)
+{
+    // written by the shard thread only, no need for a locked increment
+    if (from != SSDialogSet::MaxState)
+    {
+        mCallStates[from].store(mCallStates[from].load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+    if (to != SSDialogSet::MaxState)
+    {
+        mCallStates[to].store(mCallStates[to].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+void DumShard::onAorModified(const resip::Uri& aor, const std::shared_ptr<RegView>& view)
+{
+    // the aor is kept by the entry and as the key of its id
+    SInt64 bytes = (SInt64)(sizeof(AorContact) + sizeof(RegView) + 2 * MemStats::sizeOf(aor) - sizeof(Uri) + 2 * MemStats::sNodeBytes);
+    if (!view)
+    {
+        if (mRegs.erase(aor))
+        {
+            MemStats::change(MemStats::AorEntry, -1, -bytes);
+            mAorBytes -= bytes;
+        }
+    }
+    else
+    {
+        mRegs.put(aor, AorContact(aor, view), SimpleSBC::sRID);
+        MemStats::change(MemStats::AorEntry, 1, bytes);
+        mAorBytes += bytes;
+    }
+}
@@ -0,0 +1,118 @@
+#if !defined(DUM_SHARD__H)
+#define DUM_SHARD__H
+
+#include "resip/dum/DialogUsageManager.hxx"
+#include "rutil/Mutex.hxx"
+
+#include "simple_sbc.h"
+#include "registry.h"
+#include "reg_db.h"
+
+
+namespace resip
+{
+    class ThreadIf;
+}
+
+// One instance of the sharded dialog layer.
+// Every shard is registered to the same SipStack as a TransactionUser, a new request
+// is claimed by exactly one of them in isForMe(): REGISTER by hashing the AOR, all the
+// others by hashing the Call-ID. Responses find their shard through the transaction.
+// A shard owns the registrations and calls that hash to it, only its DumThread writes
+// them while other threads may read them concurrently.
+class DumShard
+    : public resip::DialogUsageManager
+    , public RegDbHandler
+{
+public:
+    using AorContact = SimpleSBC::AorContact;
+
+    DumShard(resip::SipStack& stack, SimpleSBC& sbc, unsigned index, unsigned count);
+    ~DumShard();
+
+    unsigned getIndex() const { return mIndex; }
+    RegDb* getRegDb() const { return mRegDb; }
+    ProfileCache& getProfiles() { return mProfiles; }
+    const ProfileCache& getProfiles() const { return mProfiles; }
+    resip::ThreadIf* getThread() const { return mThread; }
+
+    static unsigned shardOf(const resip::Data& key, unsigned count);
+    static unsigned shardOf(const resip::Uri& aor, unsigned count);
+    static unsigned shardOf(const resip::SipMessage& msg, unsigned count);
+
+    // Calls originated locally use a Call-ID generated by this shard, pin it so the
+    // in-dialog requests sent back by the peer are not re-hashed to another shard. Only
+    // the Call-IDs hashing to another shard need it
+    static void pinCallId(const resip::Data& callId, unsigned shard);
+    static void unpinCallId(const resip::Data& callId);
+
+    virtual bool isForMe(const resip::SipMessage& msg) const;
+
+    /// start removing the expired registrations every second, the stack must be running
+    void startExpiry();
+
+    /// run `func` on the shard thread and wait for its result. What it writes to
+    /// CmdOutput is buffered and written to the output of the caller once it is done.
+    /// False if the shard did not start it within 10s, it is then never run
+    bool execute(std::function<bool()> func);
+
+    // registrations and calls owned by this shard, written on the shard thread only
+    bool findReg(UInt64 id, AorContact& reg) const { return mRegs.find(id, reg); }
+    bool findReg(const resip::Uri& aor, AorContact& reg) const { return mRegs.find(aor, reg); }
+    /// shard thread only, other threads see the calls through their views
+    SSDialogSet* findCall(UInt64 id) const { return mCalls.find(id); }
+    bool hasCall(UInt64 id) const { return mCalls.contains(id); }
+    void addCall(UInt64 id, SSDialogSet* call) { mCalls.add(id, call, call->makeView()); }
+    void publishCall(SSDialogSet* call) { mCalls.publish(call, [call]() { return call->makeView(); }); }
+    void eraseCall(SSDialogSet* call) { mCalls.erase(call); }
+    size_t getCallCount() const { return mCalls.size(); }
+    size_t getRegCount() const { return mRegs.size(); }
+    /// calls of this shard in `state`, kept up to date by the calls themselves
+    unsigned getCallCount(SSDialogSet::CallState state) const { return mCallStates[state].load(std::memory_order_relaxed); }
+    /// MaxState as `from` for a new call, as `to` for a deleted one
+    void moveCallState(SSDialogSet::CallState from, SSDialogSet::CallState to);
+    void getAors(std::vector<resip::Uri>& aors) const;
+
+    /// shard thread only, see execute
+    void showAllReg(std::ostream& strm) const;
+    void showAllCall(std::ostream& strm) const;
+
+protected:
+    // RegDbHandler ////////////////////////////////////////////////////////////////////////
+    void onAorModified(const resip::Uri& aor, const std::shared_ptr<RegView>& view);
+
+private:
+    // told by the DUM, on the shard thread, of every connection that closes
+    class ConnectionWatch : public resip::Postable
+    {
+    public:
+        explicit ConnectionWatch(DumShard& shard) : mShard(shard) {}
+        virtual void post(resip::Message* msg);
+    private:
+        DumShard& mShard;
+    };
+
+    void scheduleExpiry();
+
+    SimpleSBC& mSbc;
+    unsigned mIndex;
+    unsigned mCount;
+    RegDb*                      mRegDb;
+    resip::ThreadIf*            mThread;
+    ProfileCache                mProfiles;
+    ConnectionWatch             mConnectionWatch;
+    unsigned                    mExpiryTicks;
+    SInt64                      mAorBytes;      // estimate of mRegs, see MemStats
+    RegRegistry<resip::Uri, AorContact> mRegs;
+    CallRegistry<SSDialogSet, SSDialogSet::View> mCalls;
+    std::atomic<unsigned>       mCallStates[SSDialogSet::MaxState];
+
+    static resip::Mutex sPinnedMutex;
+    static HashMap<resip::Data, unsigned> sPinned;
+    // number of pinned Call-IDs by hash slot, read without the lock
+    static const size_t sPinSlotCount = 1 << 16;
+    static std::atomic<unsigned> sPinSlots[sPinSlotCount];
+};
+
+
+#endif // #if !defined(DUM_SHARD__H)
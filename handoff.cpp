@@ -0,0 +1,649 @@
+#include "handoff.h"
+#include "dum_shard.h"
+#include "reg_db.h"
+#include "reg_store.h"
+#include "simple_sbc.h"
+#include "ss_subsystem.h"
+
+#include "resip/stack/InternalTransport.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+using namespace std;
+
+#if !defined(WIN32)
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+#if !defined(WIN32)
+
+namespace
+{
+    const char sMagic[4] = { 'S', 'S', 'H', 'O' };
+    const UInt32 sVersion = 2;
+    const int sPollMs = 500;
+    // the old process compacts its store before it sends, the new one loads its own
+    // store and restores everything before it is ready
+    const int sTimeoutMs = 120000;
+    const size_t sSendChunk = 1 << 20;
+
+    bool sendAll(int fd, const char* data, size_t len)
+    {
+        while (len)
+        {
+            ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    bool recvAll(int fd, char* data, size_t len)
+    {
+        while (len)
+        {
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (::poll(&pfd, 1, sTimeoutMs) <= 0)
+            {
+                return false;
+            }
+            ssize_t n = ::recv(fd, data, len, 0);
+            if (n <= 0)
+            {
+                return false;
+            }
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // the requests and answers are single short lines
+    bool recvLine(int fd, std::string& line)
+    {
+        line.clear();
+        char c = 0;
+        while (recvAll(fd, &c, 1))
+        {
+            if (c == '\n')
+            {
+                return true;
+            }
+            if (line.size() >= 64)
+            {
+                return false;
+            }
+            line += c;
+        }
+        return false;
+    }
+
+    bool sendLine(int fd, const char* line)
+    {
+        return sendAll(fd, line, strlen(line)) && sendAll(fd, "\n", 1);
+    }
+
+    // sent with every listening socket, the address is the one it is bound to
+    struct SocketRecord
+    {
+        UInt8 mType;
+        UInt8 mV6;
+        UInt16 mPort;
+        char mAddress[48];
+    };
+
+    bool sendSocket(int fd, const SocketRecord& record, int socket)
+    {
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+        iovec iov = { const_cast<SocketRecord*>(&record), sizeof(record) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &socket, sizeof(int));
+
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        return n > 0 && sendAll(fd, reinterpret_cast<const char*>(&record) + n, sizeof(record) - n);
+    }
+
+    // the descriptor comes with the first byte of its record, a read never spans two
+    bool recvSocket(int fd, SocketRecord& record, int& socket)
+    {
+        socket = -1;
+        pollfd pfd = { fd, POLLIN, 0 };
+        if (::poll(&pfd, 1, sTimeoutMs) <= 0)
+        {
+            return false;
+        }
+        char control[CMSG_SPACE(sizeof(int))];
+        iovec iov = { &record, sizeof(record) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0)
+        {
+            return false;
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                memcpy(&socket, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+        return socket >= 0 && recvAll(fd, reinterpret_cast<char*>(&record) + n, sizeof(record) - n);
+    }
+
+    bool makeAddress(const Data& path, sockaddr_un& addr)
+    {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+        {
+            ErrLog(<< "handoff: socket path too long, " << path);
+            return false;
+        }
+        memcpy(addr.sun_path, path.data(), path.size());
+        return true;
+    }
+}
+
+HandoffServer::HandoffServer(SimpleSBC& sbc, const resip::Data& path)
+    : mSbc(sbc)
+    , mPath(path)
+    , mFd(-1)
+{
+}
+
+HandoffServer::~HandoffServer()
+{
+    if (mFd >= 0)
+    {
+        ::close(mFd);
+    }
+}
+
+bool HandoffServer::listen()
+{
+    sockaddr_un addr;
+    if (!makeAddress(mPath, addr))
+    {
+        return false;
+    }
+
+    mFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mFd < 0)
+    {
+        ErrLog(<< "handoff: failed to create socket, " << errno);
+        return false;
+    }
+
+    // the process this one took over, or a previous run that did not shut down
+    ::unlink(mPath.c_str());
+    if (::bind(mFd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(mFd, 1) != 0)
+    {
+        ErrLog(<< "handoff: failed to listen on " << mPath << ", " << errno);
+        ::close(mFd);
+        mFd = -1;
+        return false;
+    }
+    ::chmod(mPath.c_str(), S_IRUSR | S_IWUSR);
+
+    InfoLog(<< "handoff: a new process can take over through " << mPath);
+    return true;
+}
+
+void HandoffServer::thread()
+{
+    while (!isShutdown())
+    {
+        pollfd pfd = { mFd, POLLIN, 0 };
+        if (::poll(&pfd, 1, sPollMs) <= 0)
+        {
+            continue;
+        }
+        int fd = ::accept(mFd, 0, 0);
+        if (fd < 0)
+        {
+            continue;
+        }
+        bool released = serve(fd);
+        ::close(fd);
+        if (released)
+        {
+            // the path belongs to the new process now
+            ::close(mFd);
+            mFd = -1;
+            return;
+        }
+    }
+}
+
+bool HandoffServer::serve(int fd)
+{
+    std::string line;
+    if (!recvLine(fd, line) || line != "takeover")
+    {
+        WarningLog(<< "handoff: unexpected request, " << line);
+        return false;
+    }
+
+    UInt64 start = Timer::getTimeMs();
+    InfoLog(<< "handoff: a new process is taking over");
+    // the files are the new process' from now on, it reads them once they are flushed
+    mSbc.stopPersisting();
+
+    std::string out(sMagic, sizeof(sMagic));
+    out.append(reinterpret_cast<const char*>(&sVersion), sizeof(sVersion));
+    size_t aors = 0;
+    bool ok = true;
+    for (unsigned s = 0; ok && s < mSbc.getShardCount(); ++s)
+    {
+        // the aors are copied first so the database lock is never held while sending
+        RegDb* db = mSbc.getShard(s).getRegDb();
+        RegistrationPersistenceManager::UriList list;
+        db->getAors(list);
+        for (auto& aor : list)
+        {
+            RegView::Contacts contacts = db->snapshot(aor);
+            if (!contacts || contacts->empty())
+            {
+                continue;
+            }
+            RegStore::encodeRecord(out, aor, *contacts);
+            ++aors;
+            if (out.size() >= sSendChunk)
+            {
+                ok = sendAll(fd, out.data(), out.size());
+                out.clear();
+                if (!ok)
+                {
+                    break;
+                }
+            }
+        }
+    }
+    UInt32 last = 0;
+    out.append(reinterpret_cast<const char*>(&last), sizeof(last));
+    ok = ok && sendAll(fd, out.data(), out.size());
+    if (ok)
+    {
+        InfoLog(<< "handoff: sent " << aors << " aors in " << Timer::getTimeMs() - start << " ms");
+    }
+
+    // both processes hold the listening sockets from here on, this one receives on them
+    // until it releases them
+    std::vector<InternalTransport*> transports;
+    for (auto t : mSbc.mTransports)
+    {
+        InternalTransport* transport = dynamic_cast<InternalTransport*>(t);
+        if (transport)
+        {
+            transports.push_back(transport);
+        }
+    }
+    UInt32 count = (UInt32)transports.size();
+    ok = ok && sendAll(fd, reinterpret_cast<const char*>(&count), sizeof(count));
+    for (size_t i = 0; ok && i < transports.size(); ++i)
+    {
+        const Tuple& tuple = transports[i]->getTuple();
+        SocketRecord record;
+        memset(&record, 0, sizeof(record));
+        record.mType = (UInt8)tuple.getType();
+        record.mV6 = tuple.ipVersion() == V6;
+        record.mPort = (UInt16)tuple.getPort();
+        Data address = Tuple::inet_ntop(tuple);
+        memcpy(record.mAddress, address.data(), std::min((size_t)address.size(), sizeof(record.mAddress) - 1));
+        ok = sendSocket(fd, record, transports[i]->getSocketDescriptor());
+    }
+    if (ok)
+    {
+        InfoLog(<< "handoff: sent " << count << " listening sockets");
+    }
+
+    if (!ok || !recvLine(fd, line) || line != "ready")
+    {
+        ErrLog(<< "handoff: the new process went away, this one keeps running");
+        // whatever the new process wrote, the files are this one's again
+        mSbc.resumePersisting();
+        return false;
+    }
+    mSbc.release();
+    sendLine(fd, "released");
+    InfoLog(<< "handoff: taken over in " << Timer::getTimeMs() - start << " ms, draining the calls");
+    return true;
+}
+
+HandoffClient::HandoffClient(const resip::Data& path)
+    : mPath(path)
+    , mFd(-1)
+{
+}
+
+HandoffClient::~HandoffClient()
+{
+    if (mFd >= 0)
+    {
+        ::close(mFd);
+    }
+    for (auto& l : mListeners)
+    {
+        ::close(l.mFd);
+    }
+}
+
+bool HandoffClient::connect()
+{
+    sockaddr_un addr;
+    if (!makeAddress(mPath, addr))
+    {
+        return false;
+    }
+    mFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (mFd < 0 || ::connect(mFd, (sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        ErrLog(<< "handoff: no process to take over on " << mPath << ", " << errno);
+        return false;
+    }
+
+    UInt64 start = Timer::getTimeMs();
+    char header[sizeof(sMagic) + sizeof(sVersion)];
+    UInt32 version = 0;
+    if (!sendLine(mFd, "takeover") || !recvAll(mFd, header, sizeof(header)))
+    {
+        ErrLog(<< "handoff: the process on " << mPath << " did not answer");
+        return false;
+    }
+    memcpy(&version, header + sizeof(sMagic), sizeof(version));
+    if (memcmp(header, sMagic, sizeof(sMagic)) != 0 || version != sVersion)
+    {
+        ErrLog(<< "handoff: the process on " << mPath << " speaks another version");
+        return false;
+    }
+
+    // the records are kept whole, length included, to be decoded like the files
+    mTable.clear();
+    for (;;)
+    {
+        UInt32 len = 0;
+        if (!recvAll(mFd, reinterpret_cast<char*>(&len), sizeof(len)))
+        {
+            ErrLog(<< "handoff: registrations truncated");
+            return false;
+        }
+        if (!len)
+        {
+            break;
+        }
+        size_t pos = mTable.size();
+        mTable.resize(pos + sizeof(len) + len);
+        memcpy(&mTable[pos], &len, sizeof(len));
+        if (!recvAll(mFd, &mTable[pos + sizeof(len)], len))
+        {
+            ErrLog(<< "handoff: registrations truncated");
+            return false;
+        }
+    }
+    InfoLog(<< "handoff: received " << mTable.size() << " bytes of registrations in " << Timer::getTimeMs() - start << " ms");
+
+    UInt32 count = 0;
+    if (!recvAll(mFd, reinterpret_cast<char*>(&count), sizeof(count)))
+    {
+        ErrLog(<< "handoff: listening sockets missing");
+        return false;
+    }
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        SocketRecord record;
+        Listener listener;
+        if (!recvSocket(mFd, record, listener.mFd))
+        {
+            ErrLog(<< "handoff: listening sockets truncated");
+            if (listener.mFd >= 0)
+            {
+                ::close(listener.mFd);
+            }
+            return false;
+        }
+        record.mAddress[sizeof(record.mAddress) - 1] = 0;
+        listener.mType = (TransportType)record.mType;
+        listener.mV6 = record.mV6 != 0;
+        listener.mPort = record.mPort;
+        listener.mAddress = record.mAddress;
+        mListeners.push_back(listener);
+    }
+    InfoLog(<< "handoff: received " << mListeners.size() << " listening sockets");
+    return true;
+}
+
+int HandoffClient::takeSocket(const resip::Tuple& local)
+{
+    Data address = Tuple::inet_ntop(local);
+    for (auto i = mListeners.begin(); i != mListeners.end(); ++i)
+    {
+        // several UDP sockets of a port are taken in the order they were sent
+        if (i->mType == local.getType() && i->mV6 == (local.ipVersion() == V6) &&
+            i->mPort == local.getPort() && i->mAddress == address)
+        {
+            int fd = i->mFd;
+            mListeners.erase(i);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+size_t HandoffClient::restore(RestoreFunc func)
+{
+    size_t aors = 0;
+    const char* pos = mTable.data();
+    const char* end = pos + mTable.size();
+    while (pos < end)
+    {
+        Uri aor;
+        ContactList contacts;
+        try
+        {
+            if (!RegStore::decodeRecord(pos, end, aor, contacts))
+            {
+                WarningLog(<< "handoff: corrupted registration record");
+                break;
+            }
+            func(aor, contacts);
+            ++aors;
+        }
+        catch (BaseException& e)
+        {
+            WarningLog(<< "handoff: unparsable registration record, " << e);
+        }
+    }
+    std::string().swap(mTable);
+    InfoLog(<< "handoff: restored " << aors << " aors");
+    return aors;
+}
+
+bool HandoffClient::release()
+{
+    std::string line;
+    if (!sendLine(mFd, "ready") || !recvLine(mFd, line) || line != "released")
+    {
+        ErrLog(<< "handoff: the old process did not release its ports, both keep running");
+        return false;
+    }
+    ::close(mFd);
+    mFd = -1;
+    // transports this process was not configured with, their ports close with the old one
+    for (auto& l : mListeners)
+    {
+        InfoLog(<< "handoff: " << toData(l.mType) << " port " << l.mPort << " on " << l.mAddress << " is not taken over");
+        ::close(l.mFd);
+    }
+    mListeners.clear();
+    return true;
+}
+
+bool swapSocket(int fd, int with)
+{
+#if defined(__linux__)
+    std::vector<std::pair<int, epoll_event> > watches;
+    // an epoll registration names the socket, not the descriptor: it would go on watching
+    // the one replaced. The registrations of `fd` are read from the epoll instances of this
+    // process and moved over, events and data of the stack untouched
+    DIR* dir = ::opendir("/proc/self/fd");
+    while (dir)
+    {
+        dirent* entry = ::readdir(dir);
+        if (!entry)
+        {
+            break;
+        }
+        int epfd = atoi(entry->d_name);
+        char link[64];
+        ssize_t len = ::readlink((std::string("/proc/self/fd/") + entry->d_name).c_str(), link, sizeof(link) - 1);
+        if (len <= 0 || std::string(link, len) != "anon_inode:[eventpoll]")
+        {
+            continue;
+        }
+        std::ifstream info((std::string("/proc/self/fdinfo/") + entry->d_name).c_str());
+        std::string line;
+        while (std::getline(info, line))
+        {
+            int target = -1;
+            unsigned int events = 0;
+            unsigned long long data = 0;
+            if (sscanf(line.c_str(), "tfd: %d events: %x data: %llx", &target, &events, &data) == 3 && target == fd)
+            {
+                epoll_event event;
+                event.events = events;
+                event.data.u64 = data;
+                watches.push_back(std::make_pair(epfd, event));
+            }
+        }
+    }
+    if (dir)
+    {
+        ::closedir(dir);
+    }
+    for (auto& w : watches)
+    {
+        ::epoll_ctl(w.first, EPOLL_CTL_DEL, fd, 0);
+    }
+#endif
+    if (::dup2(with, fd) < 0)
+    {
+        ErrLog(<< "handoff: failed to install a socket as fd " << fd << ", " << errno);
+        return false;
+    }
+    bool ok = true;
+#if defined(__linux__)
+    for (auto& w : watches)
+    {
+        if (::epoll_ctl(w.first, EPOLL_CTL_ADD, fd, &w.second) != 0)
+        {
+            ErrLog(<< "handoff: failed to poll the socket installed as fd " << fd << ", " << errno);
+            ok = false;
+        }
+    }
+#endif
+    return ok;
+}
+
+#else
+
+HandoffServer::HandoffServer(SimpleSBC& sbc, const resip::Data& path)
+    : mSbc(sbc)
+    , mPath(path)
+    , mFd(-1)
+{
+}
+
+HandoffServer::~HandoffServer()
+{
+}
+
+bool HandoffServer::listen()
+{
+    ErrLog(<< "handoff: unix domain sockets are not supported on this platform");
+    return false;
+}
+
+void HandoffServer::thread()
+{
+}
+
+bool HandoffServer::serve(int fd)
+{
+    return false;
+}
+
+HandoffClient::HandoffClient(const resip::Data& path)
+    : mPath(path)
+    , mFd(-1)
+{
+}
+
+HandoffClient::~HandoffClient()
+{
+}
+
+bool HandoffClient::connect()
+{
+    ErrLog(<< "handoff: unix domain sockets are not supported on this platform");
+    return false;
+}
+
+size_t HandoffClient::restore(RestoreFunc func)
+{
+    return 0;
+}
+
+int HandoffClient::takeSocket(const resip::Tuple& local)
+{
+    return -1;
+}
+
+bool HandoffClient::release()
+{
+    return false;
+}
+
+bool swapSocket(int fd, int with)
+{
+    return false;
+}
+
+#endif
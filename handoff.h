@@ -0,0 +1,91 @@
+#if !defined(HANDOFF__H)
+#define HANDOFF__H
+
+#include "resip/dum/ContactInstanceRecord.hxx"
+#include "resip/stack/Tuple.hxx"
+#include "resip/stack/Uri.hxx"
+#include "rutil/Data.hxx"
+#include "rutil/ThreadIf.hxx"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+
+class SimpleSBC;
+
+// Hot upgrade: a new process takes a running one over through the Unix domain socket
+// of --handoff, started with the same options and --takeover.
+//  1. the new process asks `takeover`, the old one stops persisting its registrations
+//     and sends all of them, records of the RegStore format ended by an empty one, then
+//     the listening sockets of its transports over SCM_RIGHTS
+//  2. the new process restores the registrations, installs every socket received under
+//     its transport of the same type, family and address, and starts, then tells `ready`
+//  3. the old process swaps its listening sockets for idle ones, closes its metrics port
+//     and answers `released`, from then on only the new process receives on the sockets,
+//     the datagrams and connections queued on them included
+// The old process keeps its calls and the connections it accepted until they end or
+// --handoff-drain passes, then it exits. The in-dialog requests of its UDP calls reach
+// the new process, which does not know them.
+class HandoffServer : public resip::ThreadIf
+{
+public:
+    HandoffServer(SimpleSBC& sbc, const resip::Data& path);
+    ~HandoffServer();
+
+    bool listen();
+    virtual void thread();
+
+private:
+    /// @return true once this process was taken over
+    bool serve(int fd);
+
+    SimpleSBC& mSbc;
+    const resip::Data mPath;
+    int mFd;
+};
+
+// The new process side of a handoff, used once by the startup
+class HandoffClient
+{
+public:
+    HandoffClient(const resip::Data& path);
+    ~HandoffClient();
+
+    /// ask the process listening on the path to hand over, and receive its registrations
+    bool connect();
+
+    typedef std::function<void(const resip::Uri&, const resip::ContactList&)> RestoreFunc;
+    /// calls `func` for every aor received
+    /// @return number of aors
+    size_t restore(RestoreFunc func);
+
+    /// the listening socket of the old process matching `local`, the caller owns it
+    /// @return -1 if the old process had none
+    int takeSocket(const resip::Tuple& local);
+
+    /// the transports of this process are receiving, the old process is to release its ports
+    bool release();
+
+private:
+    struct Listener
+    {
+        resip::TransportType mType;
+        bool mV6;
+        int mPort;
+        resip::Data mAddress;
+        int mFd;
+    };
+
+    const resip::Data mPath;
+    int mFd;
+    std::string mTable;     // records as received
+    std::vector<Listener> mListeners;   // sockets received and not taken yet
+};
+
+/// install `with` as `fd` and carry the epoll registrations of `fd` over to it, the
+/// stack goes on polling, modifying and removing it as the socket it created
+/// `with` is left open
+bool swapSocket(int fd, int with);
+
+#endif // #if !defined(HANDOFF__H)
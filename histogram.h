@@ -0,0 +1,131 @@
+#if !defined(HISTOGRAM__H)
+#define HISTOGRAM__H
+
+#include "rutil/compat.hxx"
+
+#include <cstring>
+
+
+// Log-linear latency histogram, every power of two range is split in 16 buckets so a
+// percentile is reported with at most 1/16 relative error. Values are unit-less, the
+// callers use microseconds. Not thread safe, keep one per thread and merge() them.
+class LatencyHistogram
+{
+public:
+    static const unsigned sSubBuckets = 16;
+    static const unsigned sSubBits = 4;
+    static const unsigned sBuckets = sSubBuckets + (64 - sSubBits) * sSubBuckets;
+
+    LatencyHistogram() { reset(); }
+
+    void reset()
+    {
+        memset(mCounts, 0, sizeof(mCounts));
+        mCount = mSum = mMax = 0;
+    }
+
+    void record(UInt64 value)
+    {
+        ++mCounts[bucketOf(value)];
+        ++mCount;
+        mSum += value;
+        if (value > mMax)
+        {
+            mMax = value;
+        }
+    }
+
+    void merge(const LatencyHistogram& rhs)
+    {
+        for (unsigned i = 0; i < sBuckets; ++i)
+        {
+            mCounts[i] += rhs.mCounts[i];
+        }
+        mCount += rhs.mCount;
+        mSum += rhs.mSum;
+        if (rhs.mMax > mMax)
+        {
+            mMax = rhs.mMax;
+        }
+    }
+
+    /// merge samples counted elsewhere, e.g. in relaxed atomics by the thread recording them
+    void merge(const UInt64* counts, UInt64 sum, UInt64 max)
+    {
+        for (unsigned i = 0; i < sBuckets; ++i)
+        {
+            mCounts[i] += counts[i];
+            mCount += counts[i];
+        }
+        mSum += sum;
+        if (max > mMax)
+        {
+            mMax = max;
+        }
+    }
+
+    UInt64 count() const { return mCount; }
+    UInt64 sum() const { return mSum; }
+    UInt64 max() const { return mMax; }
+    UInt64 mean() const { return mCount ? mSum / mCount : 0; }
+    UInt64 bucketCount(unsigned bucket) const { return mCounts[bucket]; }
+
+    /// value under which `p` (0..1) of the samples fall, as the upper bound of its bucket
+    UInt64 percentile(double p) const
+    {
+        if (!mCount)
+        {
+            return 0;
+        }
+        UInt64 rank = (UInt64)(p * mCount + 0.5);
+        if (rank == 0)
+        {
+            rank = 1;
+        }
+        UInt64 seen = 0;
+        for (unsigned i = 0; i < sBuckets; ++i)
+        {
+            seen += mCounts[i];
+            if (seen >= rank)
+            {
+                UInt64 upper = upperBound(i);
+                return upper < mMax ? upper : mMax;
+            }
+        }
+        return mMax;
+    }
+
+    static unsigned bucketOf(UInt64 value)
+    {
+        if (value < sSubBuckets)
+        {
+            return (unsigned)value;
+        }
+        unsigned msb = sSubBits;
+        while (msb < 63 && (value >> (msb + 1)))
+        {
+            ++msb;
+        }
+        unsigned shift = msb - sSubBits;
+        return sSubBuckets + shift * sSubBuckets + (unsigned)((value >> shift) & (sSubBuckets - 1));
+    }
+
+    static UInt64 upperBound(unsigned bucket)
+    {
+        if (bucket < sSubBuckets)
+        {
+            return bucket;
+        }
+        unsigned shift = (bucket - sSubBuckets) / sSubBuckets;
+        UInt64 sub = (bucket - sSubBuckets) % sSubBuckets;
+        return ((sSubBuckets + sub) << shift) + (((UInt64)1 << shift) - 1);
+    }
+
+private:
+    UInt64 mCounts[sBuckets];
+    UInt64 mCount;
+    UInt64 mSum;
+    UInt64 mMax;
+};
+
+#endif // #if !defined(HISTOGRAM__H)
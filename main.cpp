@@ -1,12 +1,18 @@
 
 #include "simple_sbc.h"
 #include "cmd_option.h"
+#include "ss_bench.h"
+#include "sip_bench.h"
 #include "rutil/ThreadIf.hxx"
 using namespace resip;
 
 #include <iostream>
 using namespace std;
 
+#if !defined(WIN32)
+#include <unistd.h>
+#endif
+
 class CommandInterface : public resip::ThreadIf
 {
 public:
@@ -57,6 +63,43 @@ int main(int argc, char* argv[])
         return 0;
     }
 
+    bool sipBench = runnerCmd->mBench == "sip";
+    if (!runnerCmd->mBench.empty() && !sipBench)
+    {
+        return SSBench::run(runnerCmd->mBench, cout) ? 0 : -1;
+    }
+
+    bool daemonize = runnerCmd->mDaemon != 0;
+    if (!runnerCmd->mHandoffPath.empty() && !daemonize)
+    {
+        // a process taken over exits on its own, the console would hold it
+        cerr << "--handoff needs --daemon" << endl;
+        return -1;
+    }
+    if (daemonize)
+    {
+        if (runnerCmd->mLogType != "file")
+        {
+            cerr << "--daemon needs --log-type=file" << endl;
+            return -1;
+        }
+        if (runnerCmd->mControlPath.empty())
+        {
+            runnerCmd->mControlPath = "./sbc.sock";
+        }
+#if !defined(WIN32)
+        // before any thread is started, the relative paths stay relative to the current dir
+        if (daemon(1, 0) != 0)
+        {
+            cerr << "Failed to run in the background" << endl;
+            return -1;
+        }
+#else
+        cerr << "--daemon is not supported on this platform" << endl;
+        return -1;
+#endif
+    }
+
     initNetwork();
 
     SimpleSBC sbc;
@@ -66,6 +109,23 @@ int main(int argc, char* argv[])
         exit(-1);
     }
 
+    if (sipBench)
+    {
+        SipBench bench(sbc.getConfig());
+        bool ok = bench.run(cout);
+        sbc.writeAllocStats(cout);
+        sbc.shutdown();
+        return ok ? 0 : -1;
+    }
+
+    if (daemonize)
+    {
+        // stopped by a signal
+        sbc.mainLoop();
+        sbc.shutdown();
+        return 0;
+    }
+
     CommandInterface intf(&sbc);
     intf.run();
 
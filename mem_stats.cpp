@@ -0,0 +1,165 @@
+#include "mem_stats.h"
+
+#include "rutil/Lock.hxx"
+using namespace resip;
+
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+using namespace std;
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+#define SS_HAVE_MALLINFO2
+#endif
+#endif
+#if !defined(WIN32)
+#include <unistd.h>
+#endif
+
+
+resip::Mutex MemStats::sBlocksMutex;
+std::vector<MemStats::ThreadBlock*> MemStats::sBlocks;
+
+static const char* sKindNames[] = {
+    "aor_entry",
+    "bindings",
+    "call_leg",
+    "call_profile",
+    "dum_session",
+};
+
+MemStats::ThreadBlock::ThreadBlock()
+{
+    for (unsigned k = 0; k < MaxKind; ++k)
+    {
+        mObjects[k].store(0, std::memory_order_relaxed);
+        mBytes[k].store(0, std::memory_order_relaxed);
+    }
+}
+
+MemStats::ThreadBlock& MemStats::local()
+{
+    static thread_local ThreadBlock* block = 0;
+    if (!block)
+    {
+        block = new ThreadBlock;
+        Lock lock(sBlocksMutex);
+        sBlocks.push_back(block);
+    }
+    return *block;
+}
+
+const char* MemStats::getName(Kind kind)
+{
+    return kind < MaxKind ? sKindNames[kind] : "unknown";
+}
+
+void MemStats::change(Kind kind, SInt64 objects, SInt64 bytes)
+{
+    ThreadBlock& b = local();
+    add(b.mObjects[kind], objects);
+    add(b.mBytes[kind], bytes);
+}
+
+void MemStats::total(Kind kind, SInt64& objects, SInt64& bytes)
+{
+    objects = 0;
+    bytes = 0;
+    Lock lock(sBlocksMutex);
+    for (auto b : sBlocks)
+    {
+        objects += b->mObjects[kind].load(std::memory_order_relaxed);
+        bytes += b->mBytes[kind].load(std::memory_order_relaxed);
+    }
+}
+
+size_t MemStats::sizeOf(const resip::Uri& uri)
+{
+    return sizeof(Uri) + heapOf(uri.user()) + heapOf(uri.host()) + heapOf(uri.password());
+}
+
+size_t MemStats::sizeOf(const resip::ContactInstanceRecord& rec)
+{
+    size_t bytes = sizeof(ContactInstanceRecord) - sizeof(Uri) + sizeOf(rec.mContact.uri())
+        + heapOf(rec.mContact.displayName()) + heapOf(rec.mInstance) + heapOf(rec.mUserAgent);
+    for (NameAddrs::const_iterator i = rec.mSipPath.begin(); i != rec.mSipPath.end(); ++i)
+    {
+        bytes += sNodeBytes + sizeof(NameAddr) - sizeof(Uri) + sizeOf(i->uri());
+    }
+    return bytes;
+}
+
+UInt64 MemStats::getHeapBytes()
+{
+#if defined(SS_HAVE_MALLINFO2)
+    struct mallinfo2 info = mallinfo2();
+    return (UInt64)info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+    // wraps past 4GB
+    struct mallinfo info = mallinfo();
+    return (UInt64)(unsigned)info.uordblks + (unsigned)info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+UInt64 MemStats::getRssBytes()
+{
+#if defined(__linux__)
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file)
+    {
+        return 0;
+    }
+    unsigned long long size = 0;
+    unsigned long long resident = 0;
+    int fields = fscanf(file, "%llu %llu", &size, &resident);
+    fclose(file);
+    return fields == 2 ? (UInt64)resident * (UInt64)sysconf(_SC_PAGESIZE) : 0;
+#else
+    return 0;
+#endif
+}
+
+void MemStats::write(std::ostream& strm)
+{
+    SInt64 objects[MaxKind];
+    SInt64 bytes[MaxKind];
+    SInt64 tracked = 0;
+    strm << left << setw(16) << "kind" << right << setw(12) << "objects" << setw(16) << "bytes" << setw(14) << "bytes/object" << endl;
+    for (unsigned k = 0; k < MaxKind; ++k)
+    {
+        total((Kind)k, objects[k], bytes[k]);
+        tracked += bytes[k];
+        strm << left << setw(16) << sKindNames[k] << right << setw(12) << objects[k] << setw(16) << bytes[k]
+             << setw(14) << (objects[k] > 0 ? bytes[k] / objects[k] : 0) << endl;
+    }
+    strm << left << setw(28) << "tracked" << right << setw(16) << tracked << endl;
+    strm << left << setw(28) << "resident" << right << setw(16) << getRssBytes() << endl;
+
+    // what sizing a host needs, the profiles are per flow and not per call
+    if (objects[AorEntry] > 0)
+    {
+        strm << "per registration: " << (bytes[AorEntry] + bytes[Bindings]) / objects[AorEntry] << " bytes" << endl;
+    }
+    if (objects[CallLeg] > 0)
+    {
+        strm << "per call leg: " << (bytes[CallLeg] + bytes[DumSession]) / objects[CallLeg] << " bytes" << endl;
+    }
+}
+
+void MemStats::addGauges(std::vector<Metrics::Gauge>& gauges)
+{
+    for (unsigned k = 0; k < MaxKind; ++k)
+    {
+        SInt64 objects = 0;
+        SInt64 bytes = 0;
+        total((Kind)k, objects, bytes);
+        Data labels = Data("kind=\"") + sKindNames[k] + "\"";
+        gauges.push_back(Metrics::Gauge("sbc_mem_objects", labels, objects > 0 ? (UInt64)objects : 0));
+        gauges.push_back(Metrics::Gauge("sbc_mem_bytes", labels, bytes > 0 ? (UInt64)bytes : 0));
+    }
+    gauges.push_back(Metrics::Gauge("sbc_mem_resident_bytes", Data::Empty, getRssBytes()));
+}
@@ -0,0 +1,79 @@
+#if !defined(MEM_STATS__H)
+#define MEM_STATS__H
+
+#include "metrics.h"
+
+#include "resip/dum/ContactInstanceRecord.hxx"
+#include "resip/stack/Uri.hxx"
+#include "rutil/Data.hxx"
+#include "rutil/Mutex.hxx"
+
+#include <atomic>
+#include <iosfwd>
+#include <vector>
+
+
+// Live objects and bytes of the state kept per registration and per call, for `show mem`
+// and the metrics.
+// The owner of the objects of a kind reports them as they are made and released. The
+// bytes are estimates: the size of the objects plus the strings they hold, without the
+// allocator overhead and the uri parameters, cheap enough to be computed on every
+// modification. `--bench mem` measures the real heap cost to compare with.
+// Counters follow Metrics, every thread changes its own block only and reading sums
+// the blocks, an object released on another thread than the one that made it simply
+// makes the counters of the two blocks cancel out.
+class MemStats
+{
+public:
+    enum Kind
+    {
+        AorEntry,       // AorContact of the shard registry, its RegView and its aor
+        Bindings,       // published contact list of an aor and its RegDb record
+        CallLeg,        // SSDialogSet
+        CallProfile,    // UserProfile of the calls sent to a flow, see ProfileCache
+        DumSession,     // DialogSet, Dialog, InviteSession and INVITE kept by DUM for a call leg
+        MaxKind,
+    };
+
+    static const char* getName(Kind kind);
+
+    /// `objects` and `bytes` more of `kind`, negative when released
+    static void change(Kind kind, SInt64 objects, SInt64 bytes);
+    static void total(Kind kind, SInt64& objects, SInt64& bytes);
+
+    /// estimated bytes of `uri` and of a binding, including the object itself
+    static size_t sizeOf(const resip::Uri& uri);
+    static size_t sizeOf(const resip::ContactInstanceRecord& rec);
+    /// allocator bookkeeping of a node of a std::list, std::map or hash table
+    static const size_t sNodeBytes = 4 * sizeof(void*);
+
+    /// bytes in use on the heap of the main thread arena, 0 if the allocator can't tell
+    static UInt64 getHeapBytes();
+    /// resident set size of the process, 0 if unknown
+    static UInt64 getRssBytes();
+
+    /// `show mem`
+    static void write(std::ostream& strm);
+    static void addGauges(std::vector<Metrics::Gauge>& gauges);
+
+private:
+    struct ThreadBlock
+    {
+        ThreadBlock();
+        std::atomic<SInt64> mObjects[MaxKind];
+        std::atomic<SInt64> mBytes[MaxKind];
+    };
+
+    static ThreadBlock& local();
+    static void add(std::atomic<SInt64>& counter, SInt64 value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+    static size_t heapOf(const resip::Data& data) { return data.size(); }
+
+    // blocks outlive their thread so nothing counted is ever lost
+    static resip::Mutex sBlocksMutex;
+    static std::vector<ThreadBlock*> sBlocks;
+};
+
+#endif // #if !defined(MEM_STATS__H)
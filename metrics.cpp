@@ -0,0 +1,445 @@
+#include "metrics.h"
+#include "ss_subsystem.h"
+
+#include "resip/stack/SipMessage.hxx"
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Socket.hxx"
+using namespace resip;
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+resip::Mutex Metrics::sBlocksMutex;
+std::vector<Metrics::ThreadBlock*> Metrics::sBlocks;
+
+static const char* sHandlerNames[] = {
+    "onAdd",
+    "onRefresh",
+    "onRemove",
+    "onRemoveAll",
+    "onQuery",
+    "onNewSession",
+    "onFailure",
+    "onEarlyMedia",
+    "onProvisional",
+    "onConnected",
+    "onTerminated",
+    "onAnswer",
+    "onOffer",
+    "onOfferRequired",
+    "onOfferRejected",
+    "onRemoteSdpChanged",
+    "onOfferRequestRejected",
+    "onTrying",
+};
+
+static const char* sDirectionNames[] = { "in", "out" };
+// a scraper that stays silent or stops reading is dropped, the thread serves one at a time
+static const long sClientTimeoutMs = 2000;
+static const double sQuantiles[] = { 0.5, 0.99, 0.999 };
+
+Metrics::ThreadBlock::ThreadBlock()
+{
+    for (unsigned d = 0; d < MaxDirection; ++d)
+    {
+        for (unsigned m = 0; m < MAX_METHODS; ++m)
+        {
+            mRequests[d][m].store(0, std::memory_order_relaxed);
+        }
+        for (unsigned c = 0; c < sResponseClasses; ++c)
+        {
+            mResponses[d][c].store(0, std::memory_order_relaxed);
+        }
+    }
+    for (unsigned h = 0; h < MaxHandler; ++h)
+    {
+        for (unsigned i = 0; i < LatencyHistogram::sBuckets; ++i)
+        {
+            mHandlers[h].mCounts[i].store(0, std::memory_order_relaxed);
+        }
+        mHandlers[h].mCount.store(0, std::memory_order_relaxed);
+        mHandlers[h].mSum.store(0, std::memory_order_relaxed);
+        mHandlers[h].mMax.store(0, std::memory_order_relaxed);
+    }
+}
+
+Metrics::ThreadBlock& Metrics::local()
+{
+    static thread_local ThreadBlock* block = 0;
+    if (!block)
+    {
+        block = new ThreadBlock;
+        Lock lock(sBlocksMutex);
+        sBlocks.push_back(block);
+    }
+    return *block;
+}
+
+void Metrics::countMessage(Direction dir, const resip::SipMessage& msg)
+{
+    ThreadBlock& b = local();
+    if (msg.isRequest())
+    {
+        MethodTypes method = msg.method();
+        bump(b.mRequests[dir][method < MAX_METHODS ? method : UNKNOWN]);
+    }
+    else if (msg.isResponse())
+    {
+        unsigned cls = (unsigned)msg.header(h_StatusLine).statusCode() / 100;
+        bump(b.mResponses[dir][cls < sResponseClasses ? cls : 0]);
+    }
+}
+
+void Metrics::recordHandler(Handler handler, UInt64 micros)
+{
+    // called around every DUM handler, never takes a lock
+    HandlerBlock& h = local().mHandlers[handler];
+    bump(h.mCounts[LatencyHistogram::bucketOf(micros)]);
+    bump(h.mCount);
+    bump(h.mSum, micros);
+    if (micros > h.mMax.load(std::memory_order_relaxed))
+    {
+        h.mMax.store(micros, std::memory_order_relaxed);
+    }
+}
+
+std::unique_ptr<Metrics::Snapshot> Metrics::snapshot()
+{
+    std::unique_ptr<Snapshot> s(new Snapshot);
+    memset(s->mRequests, 0, sizeof(s->mRequests));
+    memset(s->mResponses, 0, sizeof(s->mResponses));
+
+    Lock lock(sBlocksMutex);
+    for (auto b : sBlocks)
+    {
+        for (unsigned d = 0; d < MaxDirection; ++d)
+        {
+            for (unsigned m = 0; m < MAX_METHODS; ++m)
+            {
+                s->mRequests[d][m] += b->mRequests[d][m].load(std::memory_order_relaxed);
+            }
+            for (unsigned c = 0; c < sResponseClasses; ++c)
+            {
+                s->mResponses[d][c] += b->mResponses[d][c].load(std::memory_order_relaxed);
+            }
+        }
+        for (unsigned h = 0; h < MaxHandler; ++h)
+        {
+            const HandlerBlock& hb = b->mHandlers[h];
+            UInt64 counts[LatencyHistogram::sBuckets];
+            for (unsigned i = 0; i < LatencyHistogram::sBuckets; ++i)
+            {
+                counts[i] = hb.mCounts[i].load(std::memory_order_relaxed);
+            }
+            s->mHandlers[h].merge(counts, hb.mSum.load(std::memory_order_relaxed), hb.mMax.load(std::memory_order_relaxed));
+        }
+    }
+    return s;
+}
+
+void Metrics::handlerTotals(UInt64& count, UInt64& sum)
+{
+    count = 0;
+    sum = 0;
+    Lock lock(sBlocksMutex);
+    for (auto b : sBlocks)
+    {
+        for (unsigned h = 0; h < MaxHandler; ++h)
+        {
+            count += b->mHandlers[h].mCount.load(std::memory_order_relaxed);
+            sum += b->mHandlers[h].mSum.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+const char* Metrics::getHandlerName(Handler handler)
+{
+    return handler < MaxHandler ? sHandlerNames[handler] : "unknown";
+}
+
+void Metrics::encodeText(std::ostream& strm, const std::vector<Gauge>& gauges)
+{
+    std::unique_ptr<Snapshot> s = snapshot();
+
+    strm << "Requests:" << endl;
+    for (unsigned m = 0; m < MAX_METHODS; ++m)
+    {
+        if (s->mRequests[Inbound][m] || s->mRequests[Outbound][m])
+        {
+            strm << "  " << setw(12) << left << getMethodName((MethodTypes)m) << right
+                 << " in:" << setw(10) << s->mRequests[Inbound][m]
+                 << " out:" << setw(10) << s->mRequests[Outbound][m] << endl;
+        }
+    }
+    strm << "Responses:" << endl;
+    for (unsigned c = 1; c < sResponseClasses; ++c)
+    {
+        strm << "  " << c << "xx          "
+             << " in:" << setw(10) << s->mResponses[Inbound][c]
+             << " out:" << setw(10) << s->mResponses[Outbound][c] << endl;
+    }
+    strm << "Gauges:" << endl;
+    for (auto& g : gauges)
+    {
+        strm << "  " << g.mName;
+        if (!g.mLabels.empty())
+        {
+            strm << "{" << g.mLabels << "}";
+        }
+        strm << " " << g.mValue << endl;
+    }
+    strm << "Handler latency (us):" << endl;
+    strm << "  " << setw(24) << left << "handler" << right << setw(10) << "count"
+         << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "p999" << setw(10) << "max" << endl;
+    for (unsigned h = 0; h < MaxHandler; ++h)
+    {
+        const LatencyHistogram& l = s->mHandlers[h];
+        if (!l.count())
+        {
+            continue;
+        }
+        strm << "  " << setw(24) << left << sHandlerNames[h] << right << setw(10) << l.count()
+             << setw(10) << l.percentile(0.5) << setw(10) << l.percentile(0.99)
+             << setw(10) << l.percentile(0.999) << setw(10) << l.max() << endl;
+    }
+}
+
+void Metrics::encodePrometheus(std::ostream& strm, const std::vector<Gauge>& gauges)
+{
+    std::unique_ptr<Snapshot> s = snapshot();
+
+    strm << "# TYPE sbc_sip_requests_total counter\n";
+    for (unsigned d = 0; d < MaxDirection; ++d)
+    {
+        for (unsigned m = 0; m < MAX_METHODS; ++m)
+        {
+            if (s->mRequests[d][m])
+            {
+                strm << "sbc_sip_requests_total{direction=\"" << sDirectionNames[d]
+                     << "\",method=\"" << getMethodName((MethodTypes)m) << "\"} " << s->mRequests[d][m] << "\n";
+            }
+        }
+    }
+    strm << "# TYPE sbc_sip_responses_total counter\n";
+    for (unsigned d = 0; d < MaxDirection; ++d)
+    {
+        for (unsigned c = 1; c < sResponseClasses; ++c)
+        {
+            strm << "sbc_sip_responses_total{direction=\"" << sDirectionNames[d]
+                 << "\",class=\"" << c << "xx\"} " << s->mResponses[d][c] << "\n";
+        }
+    }
+
+    const char* last = 0;
+    for (auto& g : gauges)
+    {
+        if (!last || strcmp(last, g.mName) != 0)
+        {
+            strm << "# TYPE " << g.mName << (g.mCounter ? " counter\n" : " gauge\n");
+            last = g.mName;
+        }
+        strm << g.mName;
+        if (!g.mLabels.empty())
+        {
+            strm << "{" << g.mLabels << "}";
+        }
+        strm << " " << g.mValue << "\n";
+    }
+
+    strm << "# TYPE sbc_handler_latency_microseconds summary\n";
+    for (unsigned h = 0; h < MaxHandler; ++h)
+    {
+        const LatencyHistogram& l = s->mHandlers[h];
+        for (double q : sQuantiles)
+        {
+            strm << "sbc_handler_latency_microseconds{handler=\"" << sHandlerNames[h]
+                 << "\",quantile=\"" << q << "\"} " << l.percentile(q) << "\n";
+        }
+        strm << "sbc_handler_latency_microseconds_sum{handler=\"" << sHandlerNames[h] << "\"} " << l.sum() << "\n";
+        strm << "sbc_handler_latency_microseconds_count{handler=\"" << sHandlerNames[h] << "\"} " << l.count() << "\n";
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+void FifoWatcher::registerFifo(resip::FifoStatsInterface* fifo)
+{
+    Lock lock(mMutex);
+    mFifos.push_back(fifo);
+}
+
+void FifoWatcher::unregisterFifo(resip::FifoStatsInterface* fifo)
+{
+    Lock lock(mMutex);
+    for (auto i = mFifos.begin(); i != mFifos.end(); ++i)
+    {
+        if (*i == fifo)
+        {
+            mFifos.erase(i);
+            break;
+        }
+    }
+}
+
+EncodeStream& FifoWatcher::encodeFifoStats(EncodeStream& strm) const
+{
+    Lock lock(mMutex);
+    for (auto fifo : mFifos)
+    {
+        strm << fifo->getDescription() << ": " << fifo->getCountDepth() << " messages, "
+             << fifo->getTimeDepth() << " sec" << endl;
+    }
+    return strm;
+}
+
+void FifoWatcher::addGauges(std::vector<Metrics::Gauge>& gauges) const
+{
+    Lock lock(mMutex);
+    for (auto fifo : mFifos)
+    {
+        gauges.push_back(Metrics::Gauge("sbc_fifo_depth", "fifo=\"" + fifo->getDescription() + "\"", fifo->getCountDepth()));
+    }
+    for (auto fifo : mFifos)
+    {
+        gauges.push_back(Metrics::Gauge("sbc_fifo_wait_seconds", "fifo=\"" + fifo->getDescription() + "\"", fifo->getTimeDepth()));
+    }
+}
+
+void FifoWatcher::getLoad(const resip::FifoStatsInterface* ignore, UInt32& depth, UInt32& waitMs) const
+{
+    depth = 0;
+    waitMs = 0;
+    Lock lock(mMutex);
+    for (auto fifo : mFifos)
+    {
+        if (fifo != ignore)
+        {
+            depth = std::max(depth, (UInt32)fifo->getCountDepth());
+            waitMs = std::max(waitMs, fifo->expectedWaitTimeMilliSec());
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+MetricsServer::MetricsServer(int port, std::function<void(std::ostream&)> writer)
+    : mPort(port)
+    , mWriter(std::move(writer))
+    , mFd(INVALID_SOCKET)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+    if (mFd != INVALID_SOCKET)
+    {
+        closeSocket(mFd);
+    }
+}
+
+bool MetricsServer::listen()
+{
+    mFd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (mFd == INVALID_SOCKET)
+    {
+        ErrLog(<< "metrics: failed to create socket, " << getErrno());
+        return false;
+    }
+
+    int on = 1;
+    ::setsockopt(mFd, SOL_SOCKET, SO_REUSEADDR, (const char*)&on, sizeof(on));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((u_short)mPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::bind(mFd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(mFd, 8) != 0)
+    {
+        ErrLog(<< "metrics: failed to listen on 127.0.0.1:" << mPort << ", " << getErrno());
+        closeSocket(mFd);
+        mFd = INVALID_SOCKET;
+        return false;
+    }
+
+    InfoLog(<< "metrics: serving prometheus text on http://127.0.0.1:" << mPort << "/metrics");
+    return true;
+}
+
+void MetricsServer::thread()
+{
+    while (!isShutdown())
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(mFd, &fds);
+        timeval tv = { 0, 500000 };
+        if (::select((int)mFd + 1, &fds, 0, 0, &tv) <= 0)
+        {
+            continue;
+        }
+
+        Socket fd = ::accept(mFd, 0, 0);
+        if (fd == INVALID_SOCKET)
+        {
+            continue;
+        }
+        serve(fd);
+        closeSocket(fd);
+    }
+}
+
+static bool waitSocket(resip::Socket fd, bool write)
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    timeval tv = { sClientTimeoutMs / 1000, (sClientTimeoutMs % 1000) * 1000 };
+    return ::select((int)fd + 1, write ? 0 : &fds, write ? &fds : 0, 0, &tv) > 0;
+}
+
+void MetricsServer::serve(resip::Socket fd)
+{
+    // the request itself does not matter, every path returns the metrics
+    // non blocking, a send waits for room no longer than a receive waits for the request
+    makeSocketNonBlocking(fd);
+    char buf[1024];
+    if (!waitSocket(fd, false) || ::recv(fd, buf, sizeof(buf), 0) <= 0)
+    {
+        return;
+    }
+
+    ostringstream body;
+    mWriter(body);
+    const string& text = body.str();
+
+    ostringstream resp;
+    resp << "HTTP/1.0 200 OK\r\n"
+         << "Content-Type: text/plain; version=0.0.4\r\n"
+         << "Content-Length: " << text.size() << "\r\n"
+         << "Connection: close\r\n\r\n"
+         << text;
+    const string& out = resp.str();
+
+    size_t sent = 0;
+    while (sent < out.size())
+    {
+        if (!waitSocket(fd, true))
+        {
+            break;
+        }
+        int n = ::send(fd, out.data() + sent, (int)(out.size() - sent), 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        sent += n;
+    }
+}
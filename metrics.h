@@ -0,0 +1,190 @@
+#if !defined(METRICS__H)
+#define METRICS__H
+
+#include "histogram.h"
+
+#include "resip/stack/MethodTypes.hxx"
+#include "resip/stack/Transport.hxx"
+#include "rutil/CongestionManager.hxx"
+#include "rutil/Data.hxx"
+#include "rutil/Mutex.hxx"
+#include "rutil/ThreadIf.hxx"
+#include "rutil/Timer.hxx"
+
+#include <atomic>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+
+namespace resip
+{
+    class SipMessage;
+}
+
+// Process wide counters and handler latency histograms.
+// Every thread writes its own block only: counters and histogram buckets are bumped with
+// a plain relaxed load/store (single writer, no locked instruction, no lock). Reading
+// merges all blocks.
+class Metrics
+{
+public:
+    enum Direction
+    {
+        Inbound,
+        Outbound,
+        MaxDirection,
+    };
+
+    enum Handler
+    {
+        OnAdd,
+        OnRefresh,
+        OnRemove,
+        OnRemoveAll,
+        OnQuery,
+        OnNewSession,
+        OnFailure,
+        OnEarlyMedia,
+        OnProvisional,
+        OnConnected,
+        OnTerminated,
+        OnAnswer,
+        OnOffer,
+        OnOfferRequired,
+        OnOfferRejected,
+        OnRemoteSdpChanged,
+        OnOfferRequestRejected,
+        OnTrying,
+        MaxHandler,
+    };
+
+    // response classes 1xx..6xx, anything else lands in 0
+    static const unsigned sResponseClasses = 7;
+
+    struct Gauge
+    {
+        Gauge(const char* name, const resip::Data& labels, UInt64 value, bool counter = false)
+            : mName(name), mLabels(labels), mValue(value), mCounter(counter) {}
+        const char* mName;
+        resip::Data mLabels;    // prometheus label set without braces, e.g. `shard="0"`
+        UInt64 mValue;
+        bool mCounter;          // only ever grows, exposed as a prometheus counter
+    };
+
+    struct Snapshot
+    {
+        UInt64 mRequests[MaxDirection][resip::MAX_METHODS];
+        UInt64 mResponses[MaxDirection][sResponseClasses];
+        LatencyHistogram mHandlers[MaxHandler];
+    };
+
+    static void countMessage(Direction dir, const resip::SipMessage& msg);
+    static void recordHandler(Handler handler, UInt64 micros);
+
+    static std::unique_ptr<Snapshot> snapshot();
+    /// number and sum of the handler latencies so far, much cheaper than snapshot()
+    static void handlerTotals(UInt64& count, UInt64& sum);
+    static const char* getHandlerName(Handler handler);
+
+    /// human readable, used by `show stats`
+    static void encodeText(std::ostream& strm, const std::vector<Gauge>& gauges);
+    /// prometheus text exposition format 0.0.4
+    static void encodePrometheus(std::ostream& strm, const std::vector<Gauge>& gauges);
+
+private:
+    // the LatencyHistogram of a handler, written by its thread only
+    struct HandlerBlock
+    {
+        std::atomic<UInt64> mCounts[LatencyHistogram::sBuckets];
+        std::atomic<UInt64> mCount;
+        std::atomic<UInt64> mSum;
+        std::atomic<UInt64> mMax;
+    };
+
+    struct ThreadBlock
+    {
+        ThreadBlock();
+        std::atomic<UInt64> mRequests[MaxDirection][resip::MAX_METHODS];
+        std::atomic<UInt64> mResponses[MaxDirection][sResponseClasses];
+        HandlerBlock mHandlers[MaxHandler];
+    };
+
+    static ThreadBlock& local();
+    static void bump(std::atomic<UInt64>& counter, UInt64 n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // blocks outlive their thread so nothing counted is ever lost
+    static resip::Mutex sBlocksMutex;
+    static std::vector<ThreadBlock*> sBlocks;
+};
+
+// Times the enclosing scope into the latency histogram of a handler
+class MetricsTimer
+{
+public:
+    explicit MetricsTimer(Metrics::Handler handler)
+        : mHandler(handler), mStart(resip::Timer::getTimeMicroSec()) {}
+    ~MetricsTimer() { Metrics::recordHandler(mHandler, resip::Timer::getTimeMicroSec() - mStart); }
+private:
+    Metrics::Handler mHandler;
+    UInt64 mStart;
+};
+
+// Counts every message the transports receive or send, called on the transport threads
+class MetricsMessageLogger : public resip::Transport::SipMessageLoggingHandler
+{
+public:
+    virtual void outboundMessage(const resip::Tuple& source, const resip::Tuple& destination, const resip::SipMessage& msg)
+    {
+        Metrics::countMessage(Metrics::Outbound, msg);
+    }
+    virtual void inboundMessage(const resip::Tuple& source, const resip::Tuple& destination, const resip::SipMessage& msg)
+    {
+        Metrics::countMessage(Metrics::Inbound, msg);
+    }
+};
+
+// Congestion manager which never rejects anything, it only keeps hold of the fifos the
+// stack and the TUs register so their depth can be reported
+class FifoWatcher : public resip::CongestionManager
+{
+public:
+    virtual RejectionBehavior getRejectionBehavior(const resip::FifoStatsInterface* fifo) const { return NORMAL; }
+    virtual void logCurrentState() const {}
+    virtual void registerFifo(resip::FifoStatsInterface* fifo);
+    virtual void unregisterFifo(resip::FifoStatsInterface* fifo);
+    virtual UInt16 getCongestionPercent(const resip::FifoStatsInterface* fifo) const { return 0; }
+    virtual EncodeStream& encodeFifoStats(EncodeStream& strm) const;
+
+    void addGauges(std::vector<Metrics::Gauge>& gauges) const;
+    /// largest depth and expected wait of the fifos but `ignore`
+    void getLoad(const resip::FifoStatsInterface* ignore, UInt32& depth, UInt32& waitMs) const;
+
+private:
+    mutable resip::Mutex mMutex;
+    std::vector<resip::FifoStatsInterface*> mFifos;
+};
+
+// Serves the prometheus text on 127.0.0.1:<port>, one short lived HTTP/1.0 exchange per scrape
+class MetricsServer : public resip::ThreadIf
+{
+public:
+    MetricsServer(int port, std::function<void(std::ostream&)> writer);
+    ~MetricsServer();
+
+    bool listen();
+    virtual void thread();
+
+private:
+    void serve(resip::Socket fd);
+
+    int mPort;
+    std::function<void(std::ostream&)> mWriter;
+    resip::Socket mFd;
+};
+
+#endif // #if !defined(METRICS__H)
@@ -0,0 +1,130 @@
+#if !defined(OBJECT_POOL__H)
+#define OBJECT_POOL__H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+
+// Free list of raw storage for objects of type T, meant to back the class specific
+// operator new/delete of objects created and destroyed at call rate.
+// Every thread keeps its own list so allocate/deallocate never lock, a block released
+// on another thread than the one which allocated it simply moves to that thread's list.
+template <typename T>
+class ObjectPool
+{
+public:
+    struct Stats
+    {
+        std::atomic<unsigned long> mHeapAllocs;
+        std::atomic<unsigned long> mReuses;
+        std::atomic<long> mInUse;
+    };
+
+    static void* allocate(std::size_t size)
+    {
+        if (size != sizeof(T))
+        {
+            // a derived class with a different size, not poolable
+            return ::operator new(size);
+        }
+
+        Stats& s = stats();
+        ++s.mInUse;
+        FreeList& l = freeList();
+        if (l.mHead)
+        {
+            Node* n = l.mHead;
+            l.mHead = n->mNext;
+            --l.mCount;
+            s.mReuses.fetch_add(1, std::memory_order_relaxed);
+            return n;
+        }
+        s.mHeapAllocs.fetch_add(1, std::memory_order_relaxed);
+        return ::operator new(sizeof(Node));
+    }
+
+    static void deallocate(void* p, std::size_t size)
+    {
+        if (!p)
+        {
+            return;
+        }
+        if (size != sizeof(T))
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        --stats().mInUse;
+        FreeList& l = freeList();
+        if (l.mCount >= sMaxFreePerThread)
+        {
+            ::operator delete(p);
+            return;
+        }
+        Node* n = static_cast<Node*>(p);
+        n->mNext = l.mHead;
+        l.mHead = n;
+        ++l.mCount;
+    }
+
+    /// fill the calling thread's free list ahead of a load peak
+    static void reserve(std::size_t count)
+    {
+        FreeList& l = freeList();
+        while (l.mCount < count && l.mCount < sMaxFreePerThread)
+        {
+            Node* n = static_cast<Node*>(::operator new(sizeof(Node)));
+            stats().mHeapAllocs.fetch_add(1, std::memory_order_relaxed);
+            n->mNext = l.mHead;
+            l.mHead = n;
+            ++l.mCount;
+        }
+    }
+
+    static Stats& stats()
+    {
+        static Stats s = {};
+        return s;
+    }
+
+private:
+    union Node
+    {
+        Node* mNext;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type mStorage;
+    };
+
+    struct FreeList
+    {
+        FreeList() : mHead(0), mCount(0) {}
+        ~FreeList()
+        {
+            while (mHead)
+            {
+                Node* n = mHead;
+                mHead = n->mNext;
+                ::operator delete(n);
+            }
+        }
+        Node* mHead;
+        std::size_t mCount;
+    };
+
+    static FreeList& freeList()
+    {
+        static thread_local FreeList l;
+        return l;
+    }
+
+    static const std::size_t sMaxFreePerThread = 65536;
+};
+
+// Class specific allocation functions routing T through ObjectPool<T>
+#define SS_DECLARE_POOLED(T) \
+    static void* operator new(std::size_t size) { return ObjectPool<T>::allocate(size); } \
+    static void operator delete(void* p, std::size_t size) { ObjectPool<T>::deallocate(p, size); }
+
+#endif // #if !defined(OBJECT_POOL__H)
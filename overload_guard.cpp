@@ -0,0 +1,173 @@
+#include "overload_guard.h"
+#include "ss_subsystem.h"
+
+#include "resip/stack/Helper.hxx"
+#include "resip/stack/SipMessage.hxx"
+#include "resip/stack/SipStack.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Random.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#include <memory>
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+namespace
+{
+    const UInt64 sSamplePeriodMs = 100;
+    const UInt64 sCalmMs = 1000;
+    const char* sShedNames[] = { "INVITE", "REGISTER" };
+
+    bool above(UInt64 value, UInt32 mark)
+    {
+        return mark && value >= mark;
+    }
+
+    bool belowLow(UInt64 value, UInt32 mark)
+    {
+        return !mark || value < mark / 2;
+    }
+}
+
+OverloadGuard::OverloadGuard(resip::SipStack& stack, const FifoWatcher& fifos, const Limits& limits, std::unique_ptr<RateLimiter> limiter)
+    : mStack(stack)
+    , mFifos(fifos)
+    , mLimits(limits)
+    , mLimiter(std::move(limiter))
+    , mHandlerCount(0)
+    , mHandlerSum(0)
+    , mCalmSince(0)
+    , mOverloaded(false)
+    , mEpisodes(0)
+{
+    for (auto& shed : mShed)
+    {
+        shed = 0;
+    }
+    Metrics::handlerTotals(mHandlerCount, mHandlerSum);
+}
+
+const resip::Data& OverloadGuard::name() const
+{
+    static const Data sName("OverloadGuard");
+    return sName;
+}
+
+bool OverloadGuard::isForMe(const resip::SipMessage& msg) const
+{
+    // called on the stack thread for every new request, before the shards, so the
+    // limiter and the counters have a single writer
+    if (msg.exists(h_To) && msg.header(h_To).exists(p_tag))
+    {
+        return false;
+    }
+    MethodTypes method = msg.method();
+    if (mLimiter && !mLimiter->admit(msg.getSource(), method, Timer::getTimeMs()))
+    {
+        return true;
+    }
+    if (!isOverloaded() || (method != INVITE && method != REGISTER))
+    {
+        return false;
+    }
+    bump(mShed[method == INVITE ? ShedInvite : ShedRegister]);
+    return true;
+}
+
+void OverloadGuard::thread()
+{
+    UInt64 next = Timer::getTimeMs();
+    while (!isShutdown())
+    {
+        UInt64 now = Timer::getTimeMs();
+        if (now >= next)
+        {
+            sample(now);
+            next = now + sSamplePeriodMs;
+        }
+
+        unique_ptr<Message> msg(mFifo.getNext((int)(next - now)));
+        SipMessage* request = dynamic_cast<SipMessage*>(msg.get());
+        if (request && request->isRequest())
+        {
+            reject(*request);
+        }
+    }
+}
+
+void OverloadGuard::sample(UInt64 now)
+{
+    UInt32 depth = 0;
+    UInt32 waitMs = 0;
+    mFifos.getLoad(&mFifo, depth, waitMs);
+
+    UInt64 count = 0;
+    UInt64 sum = 0;
+    Metrics::handlerTotals(count, sum);
+    UInt64 latencyUs = count > mHandlerCount ? (sum - mHandlerSum) / (count - mHandlerCount) : 0;
+    mHandlerCount = count;
+    mHandlerSum = sum;
+
+    if (!isOverloaded())
+    {
+        if (above(depth, mLimits.mQueue) || above(waitMs, mLimits.mWaitMs) || above(latencyUs, mLimits.mLatencyUs))
+        {
+            mOverloaded.store(true, std::memory_order_relaxed);
+            bump(mEpisodes);
+            mCalmSince = 0;
+            WarningLog(<< "overload: shedding new INVITE and REGISTER, fifo depth " << depth
+                       << ", fifo wait " << waitMs << "ms, handler latency " << latencyUs << "us");
+        }
+        return;
+    }
+
+    if (!belowLow(depth, mLimits.mQueue) || !belowLow(waitMs, mLimits.mWaitMs) || !belowLow(latencyUs, mLimits.mLatencyUs))
+    {
+        mCalmSince = 0;
+        return;
+    }
+    if (!mCalmSince)
+    {
+        mCalmSince = now;
+    }
+    else if (now - mCalmSince >= sCalmMs)
+    {
+        mOverloaded.store(false, std::memory_order_relaxed);
+        WarningLog(<< "overload: admitting new requests again, shed " << mShed[ShedInvite].load(std::memory_order_relaxed)
+                   << " INVITE and " << mShed[ShedRegister].load(std::memory_order_relaxed) << " REGISTER so far");
+    }
+}
+
+void OverloadGuard::reject(const resip::SipMessage& request)
+{
+    // the clients told to come back at the same time would overload us again at once
+    SipMessage response;
+    Helper::makeResponse(response, request, 503);
+    response.header(h_RetryAfter).value() = mLimits.mRetryAfter + Random::getRandom() % (mLimits.mRetryAfter + 1);
+    mStack.send(response, this);
+}
+
+void OverloadGuard::addGauges(std::vector<Metrics::Gauge>& gauges) const
+{
+    gauges.push_back(Metrics::Gauge("sbc_overload", Data::Empty, isOverloaded() ? 1 : 0));
+    gauges.push_back(Metrics::Gauge("sbc_overload_episodes_total", Data::Empty, mEpisodes.load(std::memory_order_relaxed), true));
+    for (unsigned i = 0; i < MaxShed; ++i)
+    {
+        gauges.push_back(Metrics::Gauge("sbc_overload_shed_total", Data("method=\"") + sShedNames[i] + "\"",
+            mShed[i].load(std::memory_order_relaxed), true));
+    }
+    if (mLimiter)
+    {
+        for (unsigned i = 0; i < mLimiter->getLimitCount(); ++i)
+        {
+            gauges.push_back(Metrics::Gauge("sbc_rate_limited_total",
+                Data("method=\"") + getMethodName(mLimiter->getLimit(i).mMethod) + "\"", mLimiter->getDropped(i), true));
+        }
+        gauges.push_back(Metrics::Gauge("sbc_rate_limit_sources", Data::Empty, mLimiter->getSourceCount()));
+        gauges.push_back(Metrics::Gauge("sbc_rate_limit_evictions_total", Data::Empty, mLimiter->getEvicted(), true));
+    }
+}
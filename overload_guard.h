@@ -0,0 +1,88 @@
+#if !defined(OVERLOAD_GUARD__H)
+#define OVERLOAD_GUARD__H
+
+#include "metrics.h"
+#include "rate_limiter.h"
+
+#include "resip/stack/TransactionUser.hxx"
+#include "rutil/ThreadIf.hxx"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+namespace resip
+{
+    class SipStack;
+}
+
+// Sheds new work with a 503 while the sbc is overloaded, or when its source sends
+// more than the rate limit of its method.
+// Registered to the stack as a TransactionUser ahead of the shards, so isForMe() sees
+// every new request first: it claims the out-of-dialog requests to shed, which are
+// answered with 503 and a Retry-After on its own thread, without any dialog,
+// registration or profile being made for them. Requests within a dialog (BYE, ACK,
+// re-INVITE, ...) always go to the shards, they finish work already admitted.
+// Overload sheds INVITE and REGISTER only, the rate limits apply to the methods they
+// are configured for, see RateLimiter.
+// Its thread samples the load every period:
+//  - the deepest and the slowest of the stack and DUM fifos, see FifoWatcher
+//  - the mean latency of the DUM handlers over the period, see Metrics
+// Overload starts once any of them reaches its high mark, and ends once all of them
+// stay below half of it for a second, so the state does not flap with every sample.
+class OverloadGuard
+    : public resip::TransactionUser
+    , public resip::ThreadIf
+{
+public:
+    struct Limits
+    {
+        Limits() : mQueue(0), mWaitMs(0), mLatencyUs(0), mRetryAfter(10) {}
+        UInt32 mQueue;          // messages waiting in a fifo, 0 to ignore
+        UInt32 mWaitMs;         // expected wait of a fifo, 0 to ignore
+        UInt32 mLatencyUs;      // mean handler latency, 0 to ignore
+        UInt32 mRetryAfter;     // seconds, the 503 spread retries up to twice as late
+    };
+
+    /// `limiter` may be null, all the limits of `limits` may be 0
+    OverloadGuard(resip::SipStack& stack, const FifoWatcher& fifos, const Limits& limits, std::unique_ptr<RateLimiter> limiter);
+
+    virtual bool isForMe(const resip::SipMessage& msg) const;
+    virtual const resip::Data& name() const;
+    virtual void thread();
+
+    bool isOverloaded() const { return mOverloaded.load(std::memory_order_relaxed); }
+    void addGauges(std::vector<Metrics::Gauge>& gauges) const;
+
+private:
+    enum Shed
+    {
+        ShedInvite,
+        ShedRegister,
+        MaxShed,
+    };
+
+    void sample(UInt64 now);
+    void reject(const resip::SipMessage& request);
+    static void bump(std::atomic<UInt64>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    resip::SipStack& mStack;
+    const FifoWatcher& mFifos;
+    const Limits mLimits;
+    std::unique_ptr<RateLimiter> mLimiter;     // stack thread only, see isForMe
+
+    // sampler state, guard thread only
+    UInt64 mHandlerCount;
+    UInt64 mHandlerSum;
+    UInt64 mCalmSince;      // Timer::getTimeMs() since when every signal is below its low mark, 0 if not
+
+    std::atomic<bool> mOverloaded;
+    std::atomic<UInt64> mEpisodes;
+    mutable std::atomic<UInt64> mShed[MaxShed];
+};
+
+#endif // #if !defined(OVERLOAD_GUARD__H)
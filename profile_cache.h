@@ -0,0 +1,125 @@
+#if !defined(PROFILE_CACHE__H)
+#define PROFILE_CACHE__H
+
+#include "mem_stats.h"
+
+#include "resip/dum/UserProfile.hxx"
+#include "resip/stack/Tuple.hxx"
+#include "rutil/compat.hxx"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+
+
+// Prepared UserProfiles of the calls sent to a registered flow, one per flow and kind
+// of call, so originating a call does not build a profile. The flow tuple carries the
+// transport, a TCP and a UDP flow from the same address get their own profile, and
+// the key adds the flow key Tuple::operator< ignores, two connections from the same
+// address and port get their own profile too.
+// The entries of a connection are removed when it closes, see remove(). sweep() drops
+// the ones idle for a while and no longer held by any dialog, the UDP flows which never
+// close and the connections restored from the RegStore that never came back.
+// Belongs to a shard, used on its thread only, the counters may be read anywhere.
+class ProfileCache
+{
+public:
+    enum Kind
+    {
+        Local,      // call originated by a command, anonymous From
+        Bridged,    // outbound leg of the B2BUA, the From of the inbound INVITE is set per call
+        MaxKind,
+    };
+
+    typedef std::function<std::shared_ptr<resip::UserProfile>(const resip::Tuple&, Kind)> Factory;
+
+    explicit ProfileCache(Factory factory) : mFactory(std::move(factory)), mHits(0), mMisses(0) {}
+    ~ProfileCache()
+    {
+        SInt64 count = (SInt64)(mProfiles[Local].size() + mProfiles[Bridged].size());
+        MemStats::change(MemStats::CallProfile, -count, -count * (SInt64)entryBytes());
+    }
+
+    /// null if no profile can be made for the transport of `flow`
+    std::shared_ptr<resip::UserProfile> get(const resip::Tuple& flow, Kind kind, UInt64 now)
+    {
+        auto it = mProfiles[kind].find(keyOf(flow));
+        if (it != mProfiles[kind].end())
+        {
+            mHits.fetch_add(1, std::memory_order_relaxed);
+            it->second.mLastUsed = now;
+            return it->second.mProfile;
+        }
+
+        mMisses.fetch_add(1, std::memory_order_relaxed);
+        Entry e;
+        e.mProfile = mFactory(flow, kind);
+        e.mLastUsed = now;
+        if (e.mProfile)
+        {
+            mProfiles[kind].insert(std::make_pair(keyOf(flow), e));
+            MemStats::change(MemStats::CallProfile, 1, (SInt64)entryBytes());
+        }
+        return e.mProfile;
+    }
+
+    /// drop the profiles of a connection that closed, the dialogs holding one keep it
+    void remove(const resip::Tuple& flow)
+    {
+        for (auto& profiles : mProfiles)
+        {
+            if (profiles.erase(keyOf(flow)))
+            {
+                MemStats::change(MemStats::CallProfile, -1, -(SInt64)entryBytes());
+            }
+        }
+    }
+
+    /// drop the profiles unused for `idleSecs` that no dialog holds anymore
+    void sweep(UInt64 now, UInt64 idleSecs)
+    {
+        for (auto& profiles : mProfiles)
+        {
+            for (auto it = profiles.begin(); it != profiles.end();)
+            {
+                if (it->second.mLastUsed + idleSecs <= now && it->second.mProfile.use_count() == 1)
+                {
+                    it = profiles.erase(it);
+                    MemStats::change(MemStats::CallProfile, -1, -(SInt64)entryBytes());
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    UInt64 getHits() const { return mHits.load(std::memory_order_relaxed); }
+    UInt64 getMisses() const { return mMisses.load(std::memory_order_relaxed); }
+
+private:
+    typedef std::pair<resip::Tuple, UInt64> Key;
+
+    struct Entry
+    {
+        std::shared_ptr<resip::UserProfile> mProfile;
+        UInt64 mLastUsed;
+    };
+
+    static Key keyOf(const resip::Tuple& flow) { return Key(flow, (UInt64)flow.mFlowKey); }
+
+    /// the map node and the profile made by make_shared, see MemStats
+    static size_t entryBytes()
+    {
+        return MemStats::sNodeBytes + sizeof(std::pair<const Key, Entry>) + sizeof(resip::UserProfile) + 2 * sizeof(void*);
+    }
+
+    Factory mFactory;
+    std::map<Key, Entry> mProfiles[MaxKind];
+    std::atomic<UInt64> mHits;
+    std::atomic<UInt64> mMisses;
+};
+
+#endif // #if !defined(PROFILE_CACHE__H)
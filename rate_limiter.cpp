@@ -0,0 +1,174 @@
+#include "rate_limiter.h"
+
+#include "resip/stack/Tuple.hxx"
+using namespace resip;
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+#if !defined(WIN32)
+#include <netinet/in.h>
+#endif
+
+
+namespace
+{
+    const UInt32 sMaxBurst = 1000000;
+
+    size_t tableSize(size_t sources)
+    {
+        // a power of two at least twice the sources, probing stays short
+        size_t size = 64;
+        while (size < sources * 2)
+        {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    size_t hashOf(const UInt64 key[2])
+    {
+        UInt64 h = key[0] * 0x9E3779B97F4A7C15ULL ^ key[1];
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return (size_t)h;
+    }
+}
+
+bool RateLimiter::parse(const resip::Data& text, Limit& limit)
+{
+    const char* eq = strchr(text.c_str(), '=');
+    if (!eq)
+    {
+        return false;
+    }
+    limit.mMethod = getMethodType(Data(text.c_str(), eq - text.c_str()));
+    if (limit.mMethod == UNKNOWN)
+    {
+        return false;
+    }
+
+    char* end = 0;
+    unsigned long rate = strtoul(eq + 1, &end, 10);
+    unsigned long burst = rate;
+    if (*end == '/')
+    {
+        burst = strtoul(end + 1, &end, 10);
+    }
+    if (*end || !rate || !burst || rate > sMaxBurst || burst > sMaxBurst)
+    {
+        return false;
+    }
+    limit.mRate = (UInt32)rate;
+    limit.mBurst = (UInt32)burst;
+    return true;
+}
+
+RateLimiter::RateLimiter(const std::vector<Limit>& limits, size_t sources)
+    : mLimitCount((unsigned)std::min(limits.size(), (size_t)sMaxLimits))
+    , mSlots(0)
+    , mMask(tableSize(sources) - 1)
+    , mEvicted(0)
+    , mUsed(0)
+{
+    for (unsigned i = 0; i < mLimitCount; ++i)
+    {
+        mLimits[i] = limits[i];
+        mDropped[i] = 0;
+    }
+    mSlots = new Slot[mMask + 1];
+    memset(mSlots, 0, sizeof(Slot) * (mMask + 1));
+}
+
+RateLimiter::~RateLimiter()
+{
+    delete[] mSlots;
+}
+
+bool RateLimiter::admit(const resip::Tuple& source, resip::MethodTypes method, UInt64 nowMs)
+{
+    unsigned index = 0;
+    while (index < mLimitCount && mLimits[index].mMethod != method)
+    {
+        ++index;
+    }
+    if (index == mLimitCount)
+    {
+        return true;
+    }
+
+    UInt64 key[2] = { 0, 0 };
+    const sockaddr& addr = source.getSockaddr();
+    if (addr.sa_family == AF_INET)
+    {
+        key[1] = 0xFFFF00000000ULL | ntohl(reinterpret_cast<const sockaddr_in&>(addr).sin_addr.s_addr);
+    }
+#if defined(USE_IPV6)
+    else if (addr.sa_family == AF_INET6)
+    {
+        memcpy(key, &reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr, sizeof(key));
+    }
+#endif
+    if (!key[0] && !key[1])
+    {
+        return true;
+    }
+
+    Slot& slot = lookup(key, nowMs);
+    UInt64 elapsed = nowMs > slot.mStamp ? nowMs - slot.mStamp : 0;
+    slot.mStamp = nowMs;
+    for (unsigned i = 0; i < mLimitCount; ++i)
+    {
+        UInt64 full = (UInt64)mLimits[i].mBurst * 1000;
+        slot.mTokens[i] = (UInt32)std::min(full, slot.mTokens[i] + elapsed * mLimits[i].mRate);
+    }
+
+    if (slot.mTokens[index] < 1000)
+    {
+        mDropped[index].store(mDropped[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return false;
+    }
+    slot.mTokens[index] -= 1000;
+    return true;
+}
+
+RateLimiter::Slot& RateLimiter::lookup(const UInt64 key[2], UInt64 nowMs)
+{
+    size_t start = hashOf(key);
+    Slot* oldest = 0;
+    for (unsigned i = 0; i < sProbe; ++i)
+    {
+        Slot& slot = mSlots[(start + i) & mMask];
+        if (slot.mKey[0] == key[0] && slot.mKey[1] == key[1])
+        {
+            return slot;
+        }
+        if (!slot.mKey[0] && !slot.mKey[1])
+        {
+            mUsed.store(mUsed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            oldest = &slot;
+            break;
+        }
+        if (!oldest || slot.mStamp < oldest->mStamp)
+        {
+            oldest = &slot;
+        }
+    }
+
+    if (oldest->mKey[0] || oldest->mKey[1])
+    {
+        mEvicted.store(mEvicted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    // a new source starts with full buckets
+    oldest->mKey[0] = key[0];
+    oldest->mKey[1] = key[1];
+    oldest->mStamp = nowMs;
+    for (unsigned i = 0; i < mLimitCount; ++i)
+    {
+        oldest->mTokens[i] = mLimits[i].mBurst * 1000;
+    }
+    return *oldest;
+}
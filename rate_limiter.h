@@ -0,0 +1,71 @@
+#if !defined(RATE_LIMITER__H)
+#define RATE_LIMITER__H
+
+#include "resip/stack/MethodTypes.hxx"
+#include "rutil/Data.hxx"
+#include "rutil/compat.hxx"
+
+#include <atomic>
+#include <vector>
+
+
+namespace resip
+{
+    class Tuple;
+}
+
+// Token buckets of every source address, one per limited method.
+// The sources live in a fixed open addressing table, linear probing over a short
+// window: a new source takes a free slot in the window or else the one touched the
+// longest time ago, whose buckets were refilled anyway. Nothing is ever erased, so
+// no tombstones and a flood of spoofed sources costs a bounded amount of memory.
+// Tokens are counted in thousandths, a bucket refills by `rate` of them every ms.
+// Only one thread may call admit(), the counters may be read anywhere.
+class RateLimiter
+{
+public:
+    struct Limit
+    {
+        resip::MethodTypes mMethod;
+        UInt32 mRate;       // requests per second
+        UInt32 mBurst;      // requests accepted at once after being idle
+    };
+    static const unsigned sMaxLimits = 4;
+
+    /// parse `METHOD=RATE[/BURST]`, BURST defaults to RATE
+    static bool parse(const resip::Data& text, Limit& limit);
+
+    RateLimiter(const std::vector<Limit>& limits, size_t sources);
+    ~RateLimiter();
+
+    /// false if a request of `method` from `source` exceeds its limit, counted then
+    bool admit(const resip::Tuple& source, resip::MethodTypes method, UInt64 nowMs);
+
+    size_t getLimitCount() const { return mLimitCount; }
+    const Limit& getLimit(unsigned index) const { return mLimits[index]; }
+    UInt64 getDropped(unsigned index) const { return mDropped[index].load(std::memory_order_relaxed); }
+    UInt64 getEvicted() const { return mEvicted.load(std::memory_order_relaxed); }
+    size_t getSourceCount() const { return mUsed.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot
+    {
+        UInt64 mKey[2];     // IPv6 address, or IPv4 in the low bits, all zero when free
+        UInt64 mStamp;      // ms of the last refill
+        UInt32 mTokens[sMaxLimits];
+    };
+
+    static const unsigned sProbe = 8;
+
+    Slot& lookup(const UInt64 key[2], UInt64 nowMs);
+
+    Limit mLimits[sMaxLimits];
+    unsigned mLimitCount;
+    Slot* mSlots;
+    size_t mMask;
+    std::atomic<UInt64> mDropped[sMaxLimits];
+    std::atomic<UInt64> mEvicted;
+    std::atomic<size_t> mUsed;
+};
+
+#endif // #if !defined(RATE_LIMITER__H)
@@ -0,0 +1,411 @@
+#include "reg_db.h"
+#include "mem_stats.h"
+#include "reg_store.h"
+#include "ss_subsystem.h"
+
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+namespace
+{
+    // `stored == rec` already matched the contact uri, instance and reg-id
+    bool sameBinding(const ContactInstanceRecord& stored, const ContactInstanceRecord& rec)
+    {
+        if (!(stored.mReceivedFrom == rec.mReceivedFrom)
+            || stored.mReceivedFrom.mFlowKey != rec.mReceivedFrom.mFlowKey
+            || !(stored.mPublicAddress == rec.mPublicAddress)
+            || stored.mUseFlowRouting != rec.mUseFlowRouting
+            || stored.mUserAgent != rec.mUserAgent
+            || stored.mSipPath.size() != rec.mSipPath.size())
+        {
+            return false;
+        }
+        NameAddrs::const_iterator i = stored.mSipPath.begin();
+        for (auto& path : rec.mSipPath)
+        {
+            if (!(i->uri() == path.uri()))
+            {
+                return false;
+            }
+            ++i;
+        }
+        return true;
+    }
+}
+
+RegDb::RegDb()
+    : mExpiries(Timer::getTimeSecs())
+    , mHandler(0)
+    , mStore(0)
+    , mRefreshes(0)
+    , mUpdates(0)
+{
+}
+
+RegDb::~RegDb()
+{
+    for (const auto& i : mDatabase)
+    {
+        if (i.second.mView)
+        {
+            MemStats::change(MemStats::Bindings, -1, -i.second.mBytes);
+        }
+    }
+}
+
+size_t RegDb::sizeOf(const resip::Uri& aor, const resip::ContactList& contacts)
+{
+    // the map node, the aor scheduled in mExpiries and the published list with its
+    // shared_ptr control block, the view is counted with the AorContact
+    size_t bytes = MemStats::sNodeBytes + sizeof(Database::value_type) + 2 * MemStats::sizeOf(aor) - sizeof(Uri)
+        + sizeof(ContactList) + 4 * sizeof(void*);
+    for (const auto& c : contacts)
+    {
+        bytes += MemStats::sNodeBytes + MemStats::sizeOf(c);
+    }
+    return bytes;
+}
+
+const RegView::Contacts& RegView::none()
+{
+    static const Contacts sNone(std::make_shared<const ContactList>());
+    return sNone;
+}
+
+size_t RegDb::restore(const resip::Uri& aor, const resip::ContactList& contacts)
+{
+    UInt64 now = Timer::getTimeSecs();
+    ContactList live;
+    for (auto& rec : contacts)
+    {
+        if (rec.mRegExpires > now)
+        {
+            live.push_back(rec);
+        }
+    }
+    size_t count = live.size();
+    if (!count)
+    {
+        return 0;
+    }
+
+    Lock lock(mDatabaseMutex);
+    publish(mDatabase.insert(std::make_pair(aor, Record())).first, std::move(live), false);
+    return count;
+}
+
+RegView::Contacts RegDb::snapshot(const resip::Uri& aor) const
+{
+    Lock lock(mDatabaseMutex);
+    Database::const_iterator i = mDatabase.find(aor);
+    if (i == mDatabase.end())
+    {
+        return RegView::Contacts();
+    }
+    return i->second.mView->load();
+}
+
+void RegDb::forEach(std::function<void(const resip::Uri&, const resip::ContactList&)> func) const
+{
+    Lock lock(mDatabaseMutex);
+    for (auto& i : mDatabase)
+    {
+        func(i.first, *i.second.mView->load());
+    }
+}
+
+size_t RegDb::size() const
+{
+    Lock lock(mDatabaseMutex);
+    return mDatabase.size();
+}
+
+size_t RegDb::expire(UInt64 now)
+{
+    size_t removed = 0;
+    Lock lock(mDatabaseMutex);
+    mExpiries.advance(now, [this, now, &removed](const Uri& aor, UInt64 when)
+    {
+        Database::iterator i = mDatabase.find(aor);
+        if (i == mDatabase.end() || i->second.mWakeup != when)
+        {
+            // gone, or rescheduled earlier since
+            return;
+        }
+        i->second.mWakeup = 0;
+
+        RegView::Contacts current = i->second.mView->load();
+        ContactList live;
+        for (auto& rec : *current)
+        {
+            if (rec.mRegExpires > now)
+            {
+                live.push_back(rec);
+            }
+        }
+        if (live.size() == current->size())
+        {
+            schedule(aor, i->second);
+            return;
+        }
+        removed += current->size() - live.size();
+        publish(i, std::move(live));
+    });
+    if (removed)
+    {
+        DebugLog(<< "Expired " << removed << " contacts");
+    }
+    return removed;
+}
+
+void RegDb::schedule(const resip::Uri& aor, Record& rec)
+{
+    UInt64 earliest = 0;
+    RegView::Contacts contacts = rec.mView->load();
+    for (auto& c : *contacts)
+    {
+        if (!earliest || c.mRegExpires < earliest)
+        {
+            earliest = c.mRegExpires;
+        }
+    }
+    // a later wakeup finds nothing expired and schedules again, only an earlier
+    // expiry needs another entry
+    if (earliest && (!rec.mWakeup || earliest < rec.mWakeup))
+    {
+        rec.mWakeup = earliest;
+        mExpiries.schedule(earliest, aor);
+    }
+}
+
+void RegDb::publish(Database::iterator i, resip::ContactList&& contacts, bool persist)
+{
+    const Uri& aor = i->first;
+    Record& rec = i->second;
+    if (persist && mStore)
+    {
+        mStore->markDirty(*this, aor);
+    }
+
+    if (contacts.empty())
+    {
+        // whoever still holds the view sees the aor gone
+        if (rec.mView)
+        {
+            rec.mView->publish(RegView::none());
+            MemStats::change(MemStats::Bindings, -1, -rec.mBytes);
+        }
+        if (mHandler)
+        {
+            mHandler->onAorModified(aor, std::shared_ptr<RegView>());
+        }
+        mDatabase.erase(i);
+        return;
+    }
+
+    bool added = !rec.mView;
+    if (added)
+    {
+        rec.mView = std::make_shared<RegView>();
+    }
+    SInt64 bytes = (SInt64)sizeOf(aor, contacts);
+    MemStats::change(MemStats::Bindings, added ? 1 : 0, bytes - rec.mBytes);
+    rec.mBytes = bytes;
+    rec.mView->publish(std::make_shared<const ContactList>(std::move(contacts)));
+    schedule(aor, rec);
+    if (added && mHandler)
+    {
+        mHandler->onAorModified(aor, rec.mView);
+    }
+}
+
+void RegDb::addAor(const resip::Uri& aor, const resip::ContactList& contacts)
+{
+    Lock lock(mDatabaseMutex);
+    publish(mDatabase.insert(std::make_pair(aor, Record())).first, ContactList(contacts));
+}
+
+void RegDb::removeAor(const resip::Uri& aor)
+{
+    Lock lock(mDatabaseMutex);
+    Database::iterator i = mDatabase.find(aor);
+    if (i != mDatabase.end())
+    {
+        publish(i, ContactList());
+    }
+}
+
+bool RegDb::aorIsRegistered(const resip::Uri& aor)
+{
+    RegView::Contacts contacts = snapshot(aor);
+    if (!contacts)
+    {
+        return false;
+    }
+    UInt64 now = Timer::getTimeSecs();
+    for (auto& rec : *contacts)
+    {
+        if (rec.mRegExpires > now)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void RegDb::lockRecord(const resip::Uri& aor)
+{
+    Lock lock(mLockedRecordsMutex);
+    while (mLockedRecords.count(aor))
+    {
+        mRecordUnlocked.wait(mLockedRecordsMutex);
+    }
+    mLockedRecords.insert(aor);
+}
+
+void RegDb::unlockRecord(const resip::Uri& aor)
+{
+    Lock lock(mLockedRecordsMutex);
+    mLockedRecords.erase(aor);
+    mRecordUnlocked.broadcast();
+}
+
+void RegDb::getAors(UriList& container)
+{
+    container.clear();
+    Lock lock(mDatabaseMutex);
+    for (auto& i : mDatabase)
+    {
+        container.push_back(i.first);
+    }
+}
+
+RegistrationPersistenceManager::update_status_t RegDb::updateContact(const resip::Uri& aor, const resip::ContactInstanceRecord& rec)
+{
+    Lock lock(mDatabaseMutex);
+    Database::iterator i = mDatabase.insert(std::make_pair(aor, Record())).first;
+    if (i->second.mView && refresh(i, rec))
+    {
+        return CONTACT_UPDATED;
+    }
+    bump(mUpdates);
+
+    ContactList contacts;
+    if (i->second.mView)
+    {
+        contacts = *i->second.mView->load();
+    }
+    update_status_t status = CONTACT_CREATED;
+    ContactList::iterator j = contacts.begin();
+    for (; j != contacts.end(); ++j)
+    {
+        if (*j == rec)
+        {
+            break;
+        }
+    }
+    if (j != contacts.end())
+    {
+        *j = rec;
+        status = CONTACT_UPDATED;
+    }
+    else
+    {
+        contacts.push_back(rec);
+    }
+
+    publish(i, std::move(contacts));
+    return status;
+}
+
+bool RegDb::refresh(Database::iterator i, const resip::ContactInstanceRecord& rec)
+{
+    RegView::Contacts current = i->second.mView->load();
+    ContactList::const_iterator stored = current->begin();
+    for (; stored != current->end(); ++stored)
+    {
+        if (*stored == rec)
+        {
+            break;
+        }
+    }
+    if (stored == current->end() || !sameBinding(*stored, rec))
+    {
+        return false;
+    }
+
+    // the published list is copied with the new expiry, no aor comes or goes so the
+    // handler is not told
+    std::shared_ptr<ContactList> contacts = std::make_shared<ContactList>(*current);
+    for (auto& c : *contacts)
+    {
+        if (c == rec)
+        {
+            c.mRegExpires = rec.mRegExpires;
+            c.mLastUpdated = rec.mLastUpdated;
+            break;
+        }
+    }
+    i->second.mView->publish(std::move(contacts));
+    schedule(i->first, i->second);
+    if (mStore)
+    {
+        mStore->markDirty(*this, i->first);
+    }
+    bump(mRefreshes);
+    return true;
+}
+
+void RegDb::removeContact(const resip::Uri& aor, const resip::ContactInstanceRecord& rec)
+{
+    Lock lock(mDatabaseMutex);
+    Database::iterator i = mDatabase.find(aor);
+    if (i == mDatabase.end())
+    {
+        return;
+    }
+
+    ContactList contacts(*i->second.mView->load());
+    for (ContactList::iterator j = contacts.begin(); j != contacts.end(); ++j)
+    {
+        if (*j == rec)
+        {
+            contacts.erase(j);
+            break;
+        }
+    }
+    publish(i, std::move(contacts));
+}
+
+void RegDb::getContacts(const resip::Uri& aor, resip::ContactList& container)
+{
+    container.clear();
+    Lock lock(mDatabaseMutex);
+    Database::iterator i = mDatabase.find(aor);
+    if (i == mDatabase.end())
+    {
+        return;
+    }
+
+    UInt64 now = Timer::getTimeSecs();
+    RegView::Contacts current = i->second.mView->load();
+    for (auto& rec : *current)
+    {
+        if (rec.mRegExpires > now)
+        {
+            container.push_back(rec);
+        }
+    }
+    if (container.size() != current->size())
+    {
+        publish(i, ContactList(container));
+    }
+}
@@ -0,0 +1,145 @@
+#if !defined(REG_DB__H)
+#define REG_DB__H
+
+#include "resip/dum/RegistrationPersistenceManager.hxx"
+#include "resip/dum/ContactInstanceRecord.hxx"
+#include "resip/stack/Uri.hxx"
+#include "rutil/Condition.hxx"
+#include "rutil/Mutex.hxx"
+
+#include "timing_wheel.h"
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+
+
+class RegStore;
+
+// The bindings of one aor as last published by its RegDb, shared with the readers
+// (routing, `show reg`, the metrics) through the AorContact of the shard registry.
+// A published list is never modified, a writer publishes a modified copy instead: a
+// reader loads a snapshot once and keeps a consistent list for as long as it holds
+// it, without taking any lock of the database, and the old list is freed when its
+// last reader drops it.
+class RegView
+{
+public:
+    typedef std::shared_ptr<const resip::ContactList> Contacts;
+
+    RegView() : mContacts(none()) {}
+
+    Contacts load() const { return std::atomic_load(&mContacts); }
+    void publish(Contacts contacts) { std::atomic_store(&mContacts, std::move(contacts)); }
+
+    /// the empty list, shared
+    static const Contacts& none();
+
+private:
+    Contacts mContacts;
+};
+
+class RegDbHandler
+{
+public:
+    virtual ~RegDbHandler() {}
+    /// `aor` got its first binding, or lost its last one when `view` is null. The
+    /// changes in between are published to `view` only
+    virtual void onAorModified(const resip::Uri& aor, const std::shared_ptr<RegView>& view) = 0;
+};
+
+// Registration database of one shard.
+// Keeps every binding in memory the way InMemorySyncRegDb does, and when attached to
+// a RegStore, every modified aor is handed to it to be persisted write-behind so a
+// restart reloads the bindings instead of waiting for every endpoint to register again.
+// Expired bindings are removed by expire(), driven by the shard every second, so the
+// handler sees them go without anything having to look them up.
+// Every modification publishes a new snapshot to the RegView of the aor, the handler
+// is only told when an aor comes or goes, so the registry of the shard is not touched
+// by refreshes or changes of bindings.
+// Most REGISTERs are periodic refreshes changing nothing but the expiry: a contact
+// bound to the same flow, path and user agent is taken on a fast path comparing it with
+// the stored one and publishing the new expiry only.
+class RegDb : public resip::RegistrationPersistenceManager
+{
+public:
+    RegDb();
+    virtual ~RegDb();
+
+    void setHandler(RegDbHandler* handler) { mHandler = handler; }
+    void setStore(RegStore* store) { mStore = store; }
+
+    /// insert bindings reloaded from the store, the expired ones are dropped and the
+    /// store is not told about them again
+    /// @return number of contacts restored
+    size_t restore(const resip::Uri& aor, const resip::ContactList& contacts);
+
+    /// current contacts of `aor`, expired ones included, null if the aor is unknown
+    RegView::Contacts snapshot(const resip::Uri& aor) const;
+    void forEach(std::function<void(const resip::Uri&, const resip::ContactList&)> func) const;
+    size_t size() const;
+
+    /// updateContact() calls taking the refresh fast path
+    UInt64 getRefreshes() const { return mRefreshes.load(std::memory_order_relaxed); }
+    /// updateContact() calls adding or changing a binding
+    UInt64 getUpdates() const { return mUpdates.load(std::memory_order_relaxed); }
+
+    /// remove the bindings expired at `now`, every aor modified is published
+    /// @return number of contacts removed
+    size_t expire(UInt64 now);
+
+    // RegistrationPersistenceManager ////////////////////////////////////////////////////////////////////////
+    virtual void addAor(const resip::Uri& aor, const resip::ContactList& contacts);
+    virtual void removeAor(const resip::Uri& aor);
+    virtual bool aorIsRegistered(const resip::Uri& aor);
+
+    virtual void lockRecord(const resip::Uri& aor);
+    virtual void unlockRecord(const resip::Uri& aor);
+
+    virtual void getAors(UriList& container);
+
+    virtual update_status_t updateContact(const resip::Uri& aor, const resip::ContactInstanceRecord& rec);
+    virtual void removeContact(const resip::Uri& aor, const resip::ContactInstanceRecord& rec);
+    virtual void getContacts(const resip::Uri& aor, resip::ContactList& container);
+
+private:
+    struct Record
+    {
+        Record() : mWakeup(0), mBytes(0) {}
+        std::shared_ptr<RegView> mView;     // null until the first publish
+        UInt64 mWakeup;             // the tick the aor is scheduled at in mExpiries, 0 if none
+        SInt64 mBytes;              // estimate of the record and its bindings, see MemStats
+    };
+    typedef std::map<resip::Uri, Record> Database;
+
+    /// estimated bytes of the record of `aor` holding `contacts`
+    static size_t sizeOf(const resip::Uri& aor, const resip::ContactList& contacts);
+
+    /// make `contacts` the bindings of the aor of `i`, an empty list removes it and
+    /// invalidates `i`. The store is told unless restoring
+    void publish(Database::iterator i, resip::ContactList&& contacts, bool persist = true);
+    void schedule(const resip::Uri& aor, Record& rec);
+    /// publish the new expiry of an unchanged binding, false if it is new or changed
+    bool refresh(Database::iterator i, const resip::ContactInstanceRecord& rec);
+    static void bump(std::atomic<UInt64>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    Database mDatabase;
+    mutable resip::Mutex mDatabaseMutex;
+    TimingWheel<resip::Uri> mExpiries;
+
+    std::set<resip::Uri> mLockedRecords;
+    resip::Mutex mLockedRecordsMutex;
+    resip::Condition mRecordUnlocked;
+
+    RegDbHandler* mHandler;
+    RegStore* mStore;
+    std::atomic<UInt64> mRefreshes;
+    std::atomic<UInt64> mUpdates;
+};
+
+#endif // #if !defined(REG_DB__H)
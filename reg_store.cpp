@@ -0,0 +1,619 @@
+#include "reg_store.h"
+#include "reg_db.h"
+#include "ss_subsystem.h"
+
+#include "rutil/HashMap.hxx"
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#if defined(WIN32)
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+namespace
+{
+    const char sMagic[4] = { 'S', 'S', 'R', 'G' };
+    const UInt32 sVersion = 1;
+    const size_t sHeaderSize = sizeof(sMagic) + sizeof(UInt32);
+    const unsigned sFlushIntervalMs = 100;
+    // compact once the log holds more records than the snapshot, but not for small ones
+    const size_t sCompactMinRecords = 100000;
+    const size_t sWriteChunk = 1 << 20;
+    const unsigned sMaxLoadThreads = 8;
+    const size_t sMinRecordsPerLoadThread = 10000;
+
+    // Read only view of a whole file, mapped so a large snapshot is paged in by the
+    // kernel instead of being copied through read()
+    class MappedFile
+    {
+    public:
+        MappedFile(const Data& path) : mBegin(0), mEnd(0)
+        {
+#if defined(WIN32)
+            std::ifstream in(path.c_str(), std::ios::binary);
+            if (in)
+            {
+                mContent.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                mBegin = mContent.data();
+                mEnd = mBegin + mContent.size();
+            }
+#else
+            mMap = 0;
+            mSize = 0;
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                return;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                void* p = ::mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED)
+                {
+                    ::madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+                    mMap = p;
+                    mSize = (size_t)st.st_size;
+                    mBegin = static_cast<const char*>(p);
+                    mEnd = mBegin + mSize;
+                }
+            }
+            ::close(fd);
+#endif
+        }
+
+        ~MappedFile()
+        {
+#if !defined(WIN32)
+            if (mMap)
+            {
+                ::munmap(mMap, mSize);
+            }
+#endif
+        }
+
+        const char* begin() const { return mBegin; }
+        const char* end() const { return mEnd; }
+
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* mBegin;
+        const char* mEnd;
+#if defined(WIN32)
+        std::string mContent;
+#else
+        void* mMap;
+        size_t mSize;
+#endif
+    };
+
+    // host byte order, the files are not meant to move between machines
+    template <typename T>
+    void put(std::string& out, T value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void putData(std::string& out, const Data& value)
+    {
+        put<UInt32>(out, (UInt32)value.size());
+        out.append(value.data(), value.size());
+    }
+
+    void putTuple(std::string& out, const Tuple& tuple)
+    {
+        put<UInt8>(out, (UInt8)tuple.getType());
+        put<UInt8>(out, tuple.ipVersion() == V6 ? 1 : 0);
+        put<UInt16>(out, (UInt16)tuple.getPort());
+        putData(out, Tuple::inet_ntop(tuple));
+    }
+
+    template <typename T>
+    bool get(const char*& pos, const char* end, T& value)
+    {
+        if (end - pos < (ptrdiff_t)sizeof(value))
+        {
+            return false;
+        }
+        memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+    // `value` shares the buffer, copy it before the file is unmapped
+    bool getData(const char*& pos, const char* end, Data& value)
+    {
+        UInt32 len = 0;
+        if (!get(pos, end, len) || end - pos < (ptrdiff_t)len)
+        {
+            return false;
+        }
+        value = Data(Data::Share, pos, len);
+        pos += len;
+        return true;
+    }
+
+    bool getTuple(const char*& pos, const char* end, Tuple& tuple)
+    {
+        UInt8 type = 0;
+        UInt8 v6 = 0;
+        UInt16 port = 0;
+        Data ip;
+        if (!get(pos, end, type) || !get(pos, end, v6) || !get(pos, end, port) || !getData(pos, end, ip))
+        {
+            return false;
+        }
+        tuple = Tuple(Data(ip.data(), ip.size()), port, v6 ? V6 : V4, (TransportType)type);
+        return true;
+    }
+
+    bool checkHeader(const char*& pos, const char* end)
+    {
+        UInt32 version = 0;
+        if (end - pos < (ptrdiff_t)sHeaderSize || memcmp(pos, sMagic, sizeof(sMagic)) != 0)
+        {
+            return false;
+        }
+        pos += sizeof(sMagic);
+        return get(pos, end, version) && version == sVersion;
+    }
+
+    void writeHeader(FILE* file)
+    {
+        fwrite(sMagic, 1, sizeof(sMagic), file);
+        fwrite(&sVersion, 1, sizeof(sVersion), file);
+    }
+
+    bool fileExists(const Data& path)
+    {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (f)
+        {
+            fclose(f);
+        }
+        return f != 0;
+    }
+}
+
+RegStore::RegStore(const resip::Data& path)
+    : mSnapPath(path + ".snap")
+    , mLogPath(path + ".log")
+    , mOldLogPath(path + ".log.old")
+    , mLog(0)
+    , mLogRecords(0)
+    , mSnapRecords(0)
+    , mResumed(false)
+{
+}
+
+RegStore::~RegStore()
+{
+    if (mLog)
+    {
+        fclose(mLog);
+    }
+}
+
+size_t RegStore::load(LoadFunc func)
+{
+    UInt64 start = Timer::getTimeMs();
+
+    // the files must stay mapped while `latest` points into them
+    MappedFile snap(mSnapPath);
+    MappedFile oldLog(mOldLogPath);
+    MappedFile log(mLogPath);
+    const MappedFile* files[] = { &snap, &oldLog, &log };
+
+    // latest record of every aor, as the range of its encoded contacts
+    HashMap<Data, std::pair<const char*, const char*> > latest;
+    size_t records[3] = { 0, 0, 0 };
+    for (int f = 0; f < 3; ++f)
+    {
+        const char* pos = files[f]->begin();
+        const char* end = files[f]->end();
+        if (!pos)
+        {
+            continue;
+        }
+        if (!checkHeader(pos, end))
+        {
+            WarningLog(<< "Ignoring registration file with bad header, file index " << f << " of " << mSnapPath);
+            continue;
+        }
+        while (pos < end)
+        {
+            UInt32 len = 0;
+            const char* body = pos;
+            if (!get(body, end, len) || end - body < (ptrdiff_t)len)
+            {
+                // torn tail of a record being appended when the process died
+                WarningLog(<< "Truncated registration record, file index " << f << " of " << mSnapPath);
+                break;
+            }
+            const char* recordEnd = body + len;
+            Data aor;
+            if (!getData(body, recordEnd, aor))
+            {
+                break;
+            }
+            latest[aor] = std::make_pair(body, recordEnd);
+            ++records[f];
+            pos = recordEnd;
+        }
+    }
+
+    // parsing the uris dominates, spread it over a few threads
+    typedef std::pair<Data, std::pair<const char*, const char*> > Entry;
+    std::vector<Entry> entries(latest.begin(), latest.end());
+    unsigned workers = std::thread::hardware_concurrency();
+    workers = std::max(1u, std::min(workers, sMaxLoadThreads));
+    if (entries.size() < sMinRecordsPerLoadThread * workers)
+    {
+        workers = (unsigned)std::max<size_t>(1, entries.size() / sMinRecordsPerLoadThread);
+    }
+
+    std::atomic<size_t> aors(0);
+    auto decodeRange = [&entries, &aors, &func](size_t first, size_t last)
+    {
+        for (size_t n = first; n < last; ++n)
+        {
+            const Entry& i = entries[n];
+            const char* pos = i.second.first;
+            ContactList contacts;
+            try
+            {
+                if (!decodeContacts(pos, i.second.second, contacts))
+                {
+                    WarningLog(<< "Corrupted registration record of " << i.first);
+                    continue;
+                }
+                if (contacts.empty())
+                {
+                    continue;
+                }
+                func(Uri(Data(i.first.data(), i.first.size())), contacts);
+                ++aors;
+            }
+            catch (BaseException& e)
+            {
+                WarningLog(<< "Unparsable registration record of " << i.first << ", " << e);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    size_t slice = (entries.size() + workers - 1) / workers;
+    for (unsigned w = 1; w < workers; ++w)
+    {
+        threads.push_back(std::thread(decodeRange, std::min(entries.size(), w * slice), std::min(entries.size(), (w + 1) * slice)));
+    }
+    decodeRange(0, std::min(entries.size(), slice));
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    mSnapRecords = records[0];
+    mLogRecords = records[1] + records[2];
+    InfoLog(<< "Loaded " << aors.load() << " aors from " << records[0] << " snapshot and " << mLogRecords
+            << " log records of " << mSnapPath << " in " << Timer::getTimeMs() - start << " ms");
+    return aors.load();
+}
+
+void RegStore::markDirty(RegDb& db, const resip::Uri& aor)
+{
+    Lock lock(mDirtyMutex);
+    // stopped by a handoff while the shards go on, or by the shutdown once they are joined
+    if (isShutdown())
+    {
+        return;
+    }
+    mDirty.insert(std::make_pair(&db, aor));
+}
+
+void RegStore::shutdown()
+{
+    ThreadIf::shutdown();
+    Lock lock(mDirtyMutex);
+    mDirtyCondition.signal();
+}
+
+void RegStore::resume()
+{
+    {
+        Lock lock(mShutdownMutex);
+        mShutdown = false;
+    }
+    mResumed = true;
+    run();
+    InfoLog(<< "Persisting the registrations to " << mSnapPath << " again");
+}
+
+void RegStore::thread()
+{
+    if (fileExists(mOldLogPath))
+    {
+        // a compaction was interrupted, the database now holds the union of all the
+        // files so write it out whole before anything is appended again
+        if (writeSnapshot())
+        {
+            remove(mOldLogPath.c_str());
+            remove(mLogPath.c_str());
+            mLogRecords = 0;
+        }
+    }
+    // the log stays open after the compaction of a previous run
+    if (!mLog && !openLog())
+    {
+        return;
+    }
+    if (mResumed)
+    {
+        // the modifications made while stopped were not queued, all of them are written
+        mResumed = false;
+        compact();
+    }
+
+    while (!isShutdown())
+    {
+        {
+            Lock lock(mDirtyMutex);
+            if (mDirty.empty() && !isShutdown())
+            {
+                mDirtyCondition.wait(mDirtyMutex, sFlushIntervalMs);
+            }
+        }
+        flushDirty();
+        if (mLogRecords >= sCompactMinRecords && mLogRecords >= mSnapRecords)
+        {
+            compact();
+        }
+    }
+
+    flushDirty();
+    compact();
+}
+
+bool RegStore::openLog()
+{
+    mLog = fopen(mLogPath.c_str(), "ab");
+    if (!mLog)
+    {
+        ErrLog(<< "Failed to open registration log " << mLogPath << ", bindings will not be persisted");
+        return false;
+    }
+    if (ftell(mLog) == 0)
+    {
+        writeHeader(mLog);
+        fflush(mLog);
+    }
+    return true;
+}
+
+void RegStore::flushDirty()
+{
+    std::set<std::pair<RegDb*, Uri> > dirty;
+    {
+        Lock lock(mDirtyMutex);
+        dirty.swap(mDirty);
+    }
+    if (dirty.empty() || !mLog)
+    {
+        return;
+    }
+
+    mBuffer.clear();
+    for (auto& i : dirty)
+    {
+        // an aor gone is written with no contact
+        RegView::Contacts contacts = i.first->snapshot(i.second);
+        encodeRecord(mBuffer, i.second, contacts ? *contacts : *RegView::none());
+        ++mLogRecords;
+        if (mBuffer.size() >= sWriteChunk)
+        {
+            fwrite(mBuffer.data(), 1, mBuffer.size(), mLog);
+            mBuffer.clear();
+        }
+    }
+    fwrite(mBuffer.data(), 1, mBuffer.size(), mLog);
+    fflush(mLog);
+}
+
+bool RegStore::compact()
+{
+    UInt64 start = Timer::getTimeMs();
+
+    // new records go to a fresh log while the snapshot is written
+    if (mLog)
+    {
+        fclose(mLog);
+        mLog = 0;
+    }
+    bool rotated = rename(mLogPath.c_str(), mOldLogPath.c_str()) == 0;
+    mLogRecords = 0;
+    bool reopened = openLog();
+
+    if (!writeSnapshot())
+    {
+        return false;
+    }
+    if (rotated)
+    {
+        remove(mOldLogPath.c_str());
+    }
+    InfoLog(<< "Compacted " << mSnapRecords << " aors into " << mSnapPath << " in " << Timer::getTimeMs() - start << " ms");
+    return reopened;
+}
+
+bool RegStore::writeSnapshot()
+{
+    Data tmpPath = mSnapPath + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+    {
+        ErrLog(<< "Failed to create registration snapshot " << tmpPath);
+        return false;
+    }
+    writeHeader(file);
+
+    size_t count = 0;
+    mBuffer.clear();
+    for (auto db : mDbs)
+    {
+        // the aors are copied first so the database lock is never held during file io
+        RegistrationPersistenceManager::UriList aors;
+        db->getAors(aors);
+        for (auto& aor : aors)
+        {
+            RegView::Contacts contacts = db->snapshot(aor);
+            if (!contacts || contacts->empty())
+            {
+                continue;
+            }
+            encodeRecord(mBuffer, aor, *contacts);
+            ++count;
+            if (mBuffer.size() >= sWriteChunk)
+            {
+                fwrite(mBuffer.data(), 1, mBuffer.size(), file);
+                mBuffer.clear();
+            }
+        }
+    }
+    fwrite(mBuffer.data(), 1, mBuffer.size(), file);
+
+    bool ok = fflush(file) == 0 && !ferror(file);
+#if !defined(WIN32)
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    fclose(file);
+    if (!ok || rename(tmpPath.c_str(), mSnapPath.c_str()) != 0)
+    {
+        ErrLog(<< "Failed to write registration snapshot " << mSnapPath);
+        remove(tmpPath.c_str());
+        return false;
+    }
+    mSnapRecords = count;
+    return true;
+}
+
+void RegStore::encodeRecord(std::string& out, const resip::Uri& aor, const resip::ContactList& contacts)
+{
+    size_t lenPos = out.size();
+    put<UInt32>(out, 0);
+
+    putData(out, Data::from(aor));
+    put<UInt32>(out, (UInt32)contacts.size());
+    for (auto& rec : contacts)
+    {
+        putData(out, Data::from(rec.mContact));
+        put<UInt64>(out, (UInt64)rec.mRegExpires);
+        put<UInt64>(out, (UInt64)rec.mLastUpdated);
+        putTuple(out, rec.mReceivedFrom);
+        putTuple(out, rec.mPublicAddress);
+        put<UInt32>(out, (UInt32)rec.mSipPath.size());
+        for (auto& path : rec.mSipPath)
+        {
+            putData(out, Data::from(path));
+        }
+        putData(out, rec.mInstance);
+        put<UInt32>(out, (UInt32)rec.mRegId);
+        put<UInt8>(out, rec.mUseFlowRouting ? 1 : 0);
+        putData(out, rec.mUserAgent);
+    }
+
+    UInt32 len = (UInt32)(out.size() - lenPos - sizeof(UInt32));
+    memcpy(&out[lenPos], &len, sizeof(len));
+}
+
+bool RegStore::decodeRecord(const char*& pos, const char* end, resip::Uri& aor, resip::ContactList& contacts)
+{
+    UInt32 len = 0;
+    const char* body = pos;
+    if (!get(body, end, len) || end - body < (ptrdiff_t)len)
+    {
+        return false;
+    }
+    const char* recordEnd = body + len;
+    Data value;
+    if (!getData(body, recordEnd, value) || !decodeContacts(body, recordEnd, contacts))
+    {
+        return false;
+    }
+    pos = recordEnd;
+    aor = Uri(Data(value.data(), value.size()));
+    return true;
+}
+
+bool RegStore::decodeContacts(const char*& pos, const char* end, resip::ContactList& contacts)
+{
+    UInt32 count = 0;
+    if (!get(pos, end, count))
+    {
+        return false;
+    }
+    for (UInt32 i = 0; i < count; ++i)
+    {
+        ContactInstanceRecord rec;
+        Data contact;
+        UInt64 expires = 0;
+        UInt64 lastUpdated = 0;
+        UInt32 paths = 0;
+        UInt32 regId = 0;
+        UInt8 flowRouting = 0;
+        if (!getData(pos, end, contact)
+            || !get(pos, end, expires)
+            || !get(pos, end, lastUpdated)
+            || !getTuple(pos, end, rec.mReceivedFrom)
+            || !getTuple(pos, end, rec.mPublicAddress)
+            || !get(pos, end, paths))
+        {
+            return false;
+        }
+        rec.mContact = NameAddr(Data(contact.data(), contact.size()));
+        rec.mRegExpires = expires;
+        rec.mLastUpdated = lastUpdated;
+        for (UInt32 p = 0; p < paths; ++p)
+        {
+            Data path;
+            if (!getData(pos, end, path))
+            {
+                return false;
+            }
+            rec.mSipPath.push_back(NameAddr(Data(path.data(), path.size())));
+        }
+        Data instance;
+        Data userAgent;
+        if (!getData(pos, end, instance)
+            || !get(pos, end, regId)
+            || !get(pos, end, flowRouting)
+            || !getData(pos, end, userAgent))
+        {
+            return false;
+        }
+        rec.mInstance = Data(instance.data(), instance.size());
+        rec.mRegId = regId;
+        rec.mUseFlowRouting = flowRouting != 0;
+        rec.mUserAgent = Data(userAgent.data(), userAgent.size());
+        contacts.push_back(rec);
+    }
+    return true;
+}
@@ -0,0 +1,86 @@
+#if !defined(REG_STORE__H)
+#define REG_STORE__H
+
+#include "resip/dum/ContactInstanceRecord.hxx"
+#include "resip/stack/Uri.hxx"
+#include "rutil/Condition.hxx"
+#include "rutil/Data.hxx"
+#include "rutil/Mutex.hxx"
+#include "rutil/ThreadIf.hxx"
+
+#include <cstdio>
+#include <functional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+class RegDb;
+
+// Write-behind persistence of the RegDb of every shard.
+// Files, all prefixed by the store path:
+//  - `.snap` compacted image of the whole database
+//  - `.log`  records appended since the snapshot
+//  - `.log.old` previous log while a compaction is in progress
+// A record always carries the complete contact list of one aor (empty when removed),
+// so replaying snapshot, old log and log in that order is idempotent whatever point a
+// crash interrupted a compaction at.
+// The DUM threads only mark an aor dirty, the store thread reads the current bindings
+// back from its RegDb, so repeated refreshes of the same aor coalesce into one write.
+// Aors are not tied to a shard in the files, a restart with another number of
+// shards simply routes them again.
+class RegStore : public resip::ThreadIf
+{
+public:
+    RegStore(const resip::Data& path);
+    ~RegStore();
+
+    /// databases whose aors are written by the snapshot, all of them before load()
+    void addDb(RegDb* db) { mDbs.push_back(db); }
+
+    typedef std::function<void(const resip::Uri&, const resip::ContactList&)> LoadFunc;
+    /// calls `func` once for every aor with its latest persisted contact list, from
+    /// several threads at once when there are many
+    /// @return number of aors found
+    size_t load(LoadFunc func);
+
+    /// queue `aor` to be written, a no-op once the store is shut down
+    void markDirty(RegDb& db, const resip::Uri& aor);
+
+    virtual void thread();
+    virtual void shutdown();
+    /// run again once shut down and joined, starting with a snapshot of the databases
+    /// since nothing was queued meanwhile
+    void resume();
+
+    /// append the record of `aor` to `out`, the format of the files and of a handoff
+    static void encodeRecord(std::string& out, const resip::Uri& aor, const resip::ContactList& contacts);
+    /// read the record at `pos` and move past it, even when its aor does not parse
+    /// @return false if the record is truncated or corrupted
+    static bool decodeRecord(const char*& pos, const char* end, resip::Uri& aor, resip::ContactList& contacts);
+
+private:
+    bool openLog();
+    void flushDirty();
+    bool compact();
+    bool writeSnapshot();
+
+    static bool decodeContacts(const char*& pos, const char* end, resip::ContactList& contacts);
+
+    const resip::Data mSnapPath;
+    const resip::Data mLogPath;
+    const resip::Data mOldLogPath;
+    std::vector<RegDb*> mDbs;
+    FILE* mLog;
+    size_t mLogRecords;
+    size_t mSnapRecords;
+    std::string mBuffer;
+    bool mResumed;
+
+    resip::Mutex mDirtyMutex;
+    resip::Condition mDirtyCondition;
+    std::set<std::pair<RegDb*, resip::Uri> > mDirty;
+};
+
+#endif // #if !defined(REG_STORE__H)
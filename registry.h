@@ -0,0 +1,233 @@
+#if !defined(REGISTRY__H)
+#define REGISTRY__H
+
+#include "rutil/compat.hxx"
+#include "rutil/HashMap.hxx"
+#include "rutil/Lock.hxx"
+#include "rutil/RWMutex.hxx"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+
+// Hash table split into stripes locked independently of each other.
+// A writer only takes the write lock of the stripe its key falls into, readers take
+// read locks, so the command thread walking the table never blocks the DUM threads for
+// longer than one stripe and lookups on different stripes never contend at all.
+template <typename K, typename V>
+class ConcurrentTable
+{
+public:
+    explicit ConcurrentTable(unsigned stripes = 64) : mStripes(stripes ? stripes : 1), mSize(0) {}
+
+    /// insert or replace the value, return true if the key was not present
+    bool put(const K& key, const V& value)
+    {
+        Stripe& s = stripeOf(key);
+        resip::WriteLock lock(s.mMutex);
+        auto ret = s.mMap.insert(std::make_pair(key, value));
+        if (!ret.second)
+        {
+            ret.first->second = value;
+            return false;
+        }
+        ++mSize;
+        return true;
+    }
+
+    /// remove the key, the removed value is stored to `value` if specified
+    bool erase(const K& key, V* value = 0)
+    {
+        Stripe& s = stripeOf(key);
+        resip::WriteLock lock(s.mMutex);
+        auto it = s.mMap.find(key);
+        if (it == s.mMap.end())
+        {
+            return false;
+        }
+        if (value)
+        {
+            *value = it->second;
+        }
+        s.mMap.erase(it);
+        --mSize;
+        return true;
+    }
+
+    bool find(const K& key, V& value) const
+    {
+        const Stripe& s = stripeOf(key);
+        resip::ReadLock lock(s.mMutex);
+        auto it = s.mMap.find(key);
+        if (it == s.mMap.end())
+        {
+            return false;
+        }
+        value = it->second;
+        return true;
+    }
+
+    /// visit every entry, stripes are read locked one after another so the view is
+    /// consistent per stripe only
+    template <typename F>
+    void forEach(F f) const
+    {
+        for (const Stripe& s : mStripes)
+        {
+            resip::ReadLock lock(s.mMutex);
+            for (auto& i : s.mMap)
+            {
+                f(i.first, i.second);
+            }
+        }
+    }
+
+    size_t size() const { return mSize.load(std::memory_order_relaxed); }
+
+private:
+    struct Stripe
+    {
+        mutable resip::RWMutex mMutex;
+        HashMap<K, V> mMap;
+    };
+
+    size_t indexOf(const K& key) const
+    {
+        // the stripe map uses the same hash, mix it so both do not pick the same bits
+        size_t h = std::hash<K>()(key);
+        h ^= (h >> 17);
+        h *= 0x9E3779B1u;
+        return (h >> 7) % mStripes.size();
+    }
+    Stripe& stripeOf(const K& key) { return mStripes[indexOf(key)]; }
+    const Stripe& stripeOf(const K& key) const { return mStripes[indexOf(key)]; }
+
+    std::vector<Stripe> mStripes;
+    std::atomic<size_t> mSize;
+};
+
+// Active calls by id, written by the owning DUM thread only.
+// The calls themselves are the business of that thread: it finds them by id, and
+// removes a terminated one through the reverse index in constant time whatever the
+// number of active calls. The other threads only get the immutable views of the calls
+// the owning thread publishes as they change, so they never touch a call DUM may be
+// destroying.
+template <typename T, typename View>
+class CallRegistry
+{
+public:
+    typedef std::shared_ptr<const View> ViewPtr;
+
+    explicit CallRegistry(unsigned stripes = 64) : mViews(stripes) {}
+
+    void add(UInt64 id, T* call, ViewPtr view)
+    {
+        mCalls[id] = call;
+        mIds[call] = id;
+        mViews.put(id, std::move(view));
+    }
+
+    /// replace the view of `call` by `makeView()`, not called if it is not registered
+    template <typename F>
+    void publish(T* call, F makeView)
+    {
+        auto it = mIds.find(call);
+        if (it != mIds.end())
+        {
+            mViews.put(it->second, makeView());
+        }
+    }
+
+    bool erase(T* call)
+    {
+        auto it = mIds.find(call);
+        if (it == mIds.end())
+        {
+            return false;
+        }
+        UInt64 id = it->second;
+        mIds.erase(it);
+        mCalls.erase(id);
+        return mViews.erase(id);
+    }
+
+    /// owning thread only
+    T* find(UInt64 id) const
+    {
+        auto it = mCalls.find(id);
+        return it == mCalls.end() ? 0 : it->second;
+    }
+
+    /// any thread
+    bool contains(UInt64 id) const
+    {
+        ViewPtr view;
+        return mViews.find(id, view);
+    }
+
+    /// any thread, `f(UInt64 id, const ViewPtr& view)`
+    template <typename F>
+    void forEach(F f) const { mViews.forEach(f); }
+
+    size_t size() const { return mViews.size(); }
+
+private:
+    HashMap<UInt64, T*> mCalls;
+    HashMap<T*, UInt64> mIds;
+    ConcurrentTable<UInt64, ViewPtr> mViews;
+};
+
+// Registered AORs by id, plus the AOR to id index used to resolve a target uri.
+// Written by the owning DUM thread only.
+template <typename Aor, typename Entry>
+class RegRegistry
+{
+public:
+    explicit RegRegistry(unsigned stripes = 64) : mRegs(stripes), mAor2Id(stripes) {}
+
+    /// bind the entry to the existing id of `aor`, or to `newId` if the aor is new,
+    /// return the id in use
+    UInt64 put(const Aor& aor, const Entry& entry, std::atomic<UInt64>& newId)
+    {
+        UInt64 id = 0;
+        if (!mAor2Id.find(aor, id))
+        {
+            id = newId++;
+            mAor2Id.put(aor, id);
+        }
+        mRegs.put(id, entry);
+        return id;
+    }
+
+    bool erase(const Aor& aor)
+    {
+        UInt64 id = 0;
+        if (!mAor2Id.erase(aor, &id))
+        {
+            return false;
+        }
+        return mRegs.erase(id);
+    }
+
+    bool find(UInt64 id, Entry& entry) const { return mRegs.find(id, entry); }
+
+    bool find(const Aor& aor, Entry& entry) const
+    {
+        UInt64 id = 0;
+        return mAor2Id.find(aor, id) && mRegs.find(id, entry);
+    }
+
+    template <typename F>
+    void forEach(F f) const { mRegs.forEach(f); }
+
+    size_t size() const { return mRegs.size(); }
+
+private:
+    ConcurrentTable<UInt64, Entry> mRegs;
+    ConcurrentTable<Aor, UInt64> mAor2Id;
+};
+
+
+#endif // #if !defined(REGISTRY__H)
@@ -0,0 +1,160 @@
+#include "sdp_cache.h"
+#include "ss_subsystem.h"
+
+#include "resip/stack/HeaderFieldValue.hxx"
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+#include "rutil/ParseException.hxx"
+using namespace resip;
+
+#include <sys/stat.h>
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+static const Data sDefaultSdp("v=0\r\n"
+    "o=- 0 0 IN IP4 0.0.0.0\r\n"
+    "s=basicClient\r\n"
+    "c=IN IP4 10.18.0.200\r\n"
+    "t=0 0\r\n"
+    "m=audio 45678 RTP/AVP 0 101\r\n"
+    "a=rtpmap:0 pcmu/8000\r\n"
+    "a=rtpmap:101 telephone-event/8000\r\n"
+    "a=fmtp:101 0-15\r\n");
+
+namespace
+{
+    // the parsed fields of an SdpContents point into the text it was parsed from, the
+    // text goes with the prototype
+    struct Prototype
+    {
+        explicit Prototype(const Data& txt)
+            : mText(txt)
+            , mSdp(HeaderFieldValue(mText.data(), mText.size()), Mime("application", "sdp"))
+        {}
+        const Data mText;
+        SdpContents mSdp;
+    };
+}
+
+SdpTemplateCache& SdpTemplateCache::instance()
+{
+    static SdpTemplateCache sInstance;
+    return sInstance;
+}
+
+SdpTemplateCache::SdpTemplateCache() : mDefault(parse(sDefaultSdp))
+{
+    resip_assert(mDefault);
+}
+
+bool SdpTemplateCache::makeOffer(const resip::Data& path, resip::SdpContents& sdp)
+{
+    std::shared_ptr<const SdpContents> proto = path.empty() ? mDefault : get(path);
+    if (!proto)
+    {
+        return false;
+    }
+
+    // the prototype is fully parsed, copying it doesn't parse again
+    sdp = *proto;
+
+    // Set sessionid and version for this offer
+    UInt64 currentTime = Timer::getTimeMicroSec();
+    sdp.session().origin().getSessionId() = currentTime;
+    sdp.session().origin().getVersion() = currentTime;
+    return true;
+}
+
+void SdpTemplateCache::invalidate(const resip::Data& path)
+{
+    Lock lock(mMutex);
+    mEntries.erase(path);
+}
+
+std::shared_ptr<const resip::SdpContents> SdpTemplateCache::get(const resip::Data& path)
+{
+    UInt64 now = Timer::getTimeMs();
+    {
+        Lock lock(mMutex);
+        auto it = mEntries.find(path);
+        if (it != mEntries.end())
+        {
+            Entry& e = it->second;
+            if (now < e.mCheckedAt + sCheckIntervalMs)
+            {
+                return e.mSdp;
+            }
+
+            time_t mtime = 0;
+            off_t size = 0;
+            if (stat(path, mtime, size) && mtime == e.mMtime && size == e.mSize)
+            {
+                e.mCheckedAt = now;
+                return e.mSdp;
+            }
+            InfoLog(<< "sdp file changed, reload: " << path);
+            mEntries.erase(it);
+        }
+    }
+
+    // load outside the lock, two threads racing on a cold entry both parse it once
+    Entry e;
+    if (!stat(path, e.mMtime, e.mSize))
+    {
+        return std::shared_ptr<const SdpContents>();
+    }
+
+    try
+    {
+        e.mSdp = parse(Data::fromFile(path));
+    }
+    catch (BaseException& ex)
+    {
+        WarningLog(<< "Failed to load sdp file " << path << ": " << ex);
+    }
+    catch (...)
+    {
+        WarningLog(<< "Failed to load sdp file " << path);
+    }
+    if (!e.mSdp)
+    {
+        return e.mSdp;
+    }
+
+    e.mCheckedAt = now;
+    Lock lock(mMutex);
+    mEntries[path] = e;
+    return e.mSdp;
+}
+
+std::shared_ptr<const resip::SdpContents> SdpTemplateCache::parse(const resip::Data& txt)
+{
+    std::shared_ptr<Prototype> proto = std::make_shared<Prototype>(txt);
+    try
+    {
+        // parse now, the prototype is then only read concurrently
+        proto->mSdp.session();
+    }
+    catch (ParseException& e)
+    {
+        WarningLog(<< "Failed to parse sdp: " << e);
+        return std::shared_ptr<const SdpContents>();
+    }
+    // shares the ownership of the text
+    return std::shared_ptr<const SdpContents>(proto, &proto->mSdp);
+}
+
+bool SdpTemplateCache::stat(const resip::Data& path, time_t& mtime, off_t& size)
+{
+    struct ::stat st;
+    if (::stat(path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    mtime = st.st_mtime;
+    size = st.st_size;
+    return true;
+}
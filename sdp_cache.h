@@ -0,0 +1,51 @@
+#if !defined(SDP_CACHE__H)
+#define SDP_CACHE__H
+
+#include "resip/stack/SdpContents.hxx"
+#include "rutil/Data.hxx"
+#include "rutil/HashMap.hxx"
+#include "rutil/Mutex.hxx"
+
+#include <memory>
+#include <sys/types.h>
+
+
+// Process wide cache of parsed sdp prototypes keyed by file path, the empty path being
+// the built-in default offer. An offer is a copy of the prototype with only the origin
+// session id and version patched, so originating a call neither reads nor parses sdp.
+// The file modification time is checked at most once per sCheckIntervalMs, a changed
+// file is reloaded on the next use.
+class SdpTemplateCache
+{
+public:
+    static SdpTemplateCache& instance();
+
+    /// copy the prototype for `path` into `sdp` with a fresh origin session id and version,
+    /// return false if the file can't be read or parsed
+    bool makeOffer(const resip::Data& path, resip::SdpContents& sdp);
+    void invalidate(const resip::Data& path);
+
+    static const UInt64 sCheckIntervalMs = 1000;
+
+private:
+    SdpTemplateCache();
+
+    struct Entry
+    {
+        Entry() : mMtime(0), mSize(0), mCheckedAt(0) {}
+        std::shared_ptr<const resip::SdpContents> mSdp;
+        time_t mMtime;
+        off_t mSize;
+        UInt64 mCheckedAt;
+    };
+
+    std::shared_ptr<const resip::SdpContents> get(const resip::Data& path);
+    static std::shared_ptr<const resip::SdpContents> parse(const resip::Data& txt);
+    static bool stat(const resip::Data& path, time_t& mtime, off_t& size);
+
+    resip::Mutex mMutex;
+    HashMap<resip::Data, Entry> mEntries;
+    std::shared_ptr<const resip::SdpContents> mDefault;
+};
+
+#endif // #if !defined(SDP_CACHE__H)
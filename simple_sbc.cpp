@@ -1,27 +1,57 @@
 
 #include "simple_sbc.h"
+#include "async_logger.h"
+#include "dum_shard.h"
+#include "b2bua.h"
+#include "call_pacer.h"
+#include "cdr_writer.h"
+#include "control_server.h"
+#include "handoff.h"
+#include "mem_stats.h"
+#include "metrics.h"
+#include "overload_guard.h"
+#include "reg_store.h"
+#include "sdp_cache.h"
 #include "ss_subsystem.h"
+#include "tls_session_cache.h"
 
 #include "rutil/Data.hxx"
 #include "resip/stack/SipStack.hxx"
 #include "resip/stack/EventStackThread.hxx"
 #include "resip/stack/InteropHelper.hxx"
+#include "resip/stack/InternalTransport.hxx"
 #include "resip/stack/MessageFilterRule.hxx"
+#include "resip/stack/Transport.hxx"
 #include "resip/dum/ClientInviteSession.hxx"
+#include "resip/dum/Dialog.hxx"
+#include "resip/dum/DialogSet.hxx"
+#include "resip/dum/ServerInviteSession.hxx"
 //#include "resip/dum/InMemoryRegistrationDatabase.hxx"
-#include "resip/dum/InMemorySyncRegDb.hxx"
 #include "resip/dum/ServerRegistration.hxx"
 #include "resip/dum/DialogUsageManager.hxx"
 #include "resip/dum/MasterProfile.hxx"
-#include "resip/dum/DumThread.hxx"
 #include "resip/dum/ClientAuthManager.hxx"
 #include "resip/dum/ServerAuthManager.hxx"
 #include "resip/dum/KeepAliveManager.hxx"
 #include "rutil/Logger.hxx"
 #include "rutil/DnsUtil.hxx"
+#include "rutil/Timer.hxx"
 #include "rutil/ResipAssert.h"
+#include "rutil/Socket.hxx"
+#if defined(USE_SSL)
+#include "resip/stack/ssl/Security.hxx"
+#include "resip/stack/ssl/TlsBaseTransport.hxx"
+#endif
 using namespace resip;
 
+#if !defined(WIN32)
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 using namespace std;
 
@@ -29,8 +59,117 @@ using namespace std;
 #define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
 
 
-UInt64 SimpleSBC::sRID = 1;
-UInt64 SimpleSBC::sCID = 1;
+namespace
+{
+    struct SourceAddress
+    {
+        resip::Tuple mSource;
+        resip::Data mAddress;
+        resip::SdpContents::AddrType mType;
+    };
+
+    const SourceAddress& formatSource(const resip::Tuple& source)
+    {
+        // a handful of transports at most, a linear scan beats hashing the tuple
+        static const size_t sMaxEntries = 16;
+        static thread_local std::vector<SourceAddress> sCache;
+        static thread_local size_t sNextVictim = 0;
+
+        for (auto& e : sCache)
+        {
+            if (e.mSource == source)
+            {
+                return e;
+            }
+        }
+
+        SourceAddress entry;
+        entry.mSource = source;
+        entry.mAddress = Tuple::inet_ntop(source);
+        entry.mType = source.ipVersion() == V6 ? SdpContents::IP6 : SdpContents::IP4;
+        if (sCache.size() < sMaxEntries)
+        {
+            sCache.push_back(entry);
+            return sCache.back();
+        }
+        SourceAddress& victim = sCache[sNextVictim++ % sMaxEntries];
+        victim = entry;
+        return victim;
+    }
+
+    // reason column of the CDRs
+    const char* getCdrReason(InviteSessionHandler::TerminatedReason reason)
+    {
+        switch (reason)
+        {
+        case InviteSessionHandler::RemoteBye: return "remote_bye";
+        case InviteSessionHandler::RemoteCancel: return "remote_cancel";
+        case InviteSessionHandler::Rejected: return "rejected";
+        case InviteSessionHandler::LocalBye: return "local_bye";
+        case InviteSessionHandler::LocalCancel: return "local_cancel";
+        case InviteSessionHandler::Replaced: return "replaced";
+        case InviteSessionHandler::Referred: return "referred";
+        case InviteSessionHandler::Error: return "error";
+        case InviteSessionHandler::Timeout: return "timeout";
+        default: return "unknown";
+        }
+    }
+
+    // with --handoff every transport binds next to the one of the process it takes over,
+    // before the socket handed over replaces its own
+    bool sShareAllPorts = false;
+
+    // called by the stack on every socket it creates, before it is bound
+    void setReusePort(resip::Socket fd, int transportType, const char* file, int line)
+    {
+#if defined(SO_REUSEPORT)
+        if (transportType == UDP || sShareAllPorts)
+        {
+            int on = 1;
+            if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on)) != 0)
+            {
+                ErrLog(<< "Failed to set SO_REUSEPORT on fd " << fd << ", " << getErrno());
+            }
+        }
+#endif
+    }
+}
+
+void SdpMessageDecorator::decorateMessage(resip::SipMessage& msg,
+    const resip::Tuple& source,
+    const resip::Tuple& destination,
+    const resip::Data& sigcompId)
+{
+    if (!msg.exists(h_ContentType))
+    {
+        return;
+    }
+    const Mime& type = msg.header(h_ContentType);
+    if (!isEqualNoCase(type.subType(), "sdp") || !isEqualNoCase(type.type(), "application"))
+    {
+        return;
+    }
+    SdpContents* sdp = dynamic_cast<SdpContents*>(msg.getContents());
+    if (!sdp)
+    {
+        return;
+    }
+
+    // Fill in IP from source, leaving the body alone when it already carries it
+    const SourceAddress& addr = formatSource(source);
+    SdpContents::Session& session = sdp->session();
+    if (session.origin().getAddressType() != addr.mType || session.origin().getAddress() != addr.mAddress)
+    {
+        session.origin().setAddress(addr.mAddress, addr.mType);
+    }
+    if (session.connection().getAddressType() != addr.mType || session.connection().getAddress() != addr.mAddress)
+    {
+        session.connection().setAddress(addr.mAddress, addr.mType);
+    }
+}
+
+std::atomic<UInt64> SimpleSBC::sRID(1);
+std::atomic<UInt64> SimpleSBC::sCID(1);
 
 SimpleSBC::SimpleSBC()
     : mRunning(false)
@@ -38,16 +177,32 @@ SimpleSBC::SimpleSBC()
     , mAsyncProcessHandler(0)
     , mSipStack(0)
     , mStackThread(0)
-    , mDum(0)
-    , mDumThread(0)
     , mMasterProfile(new MasterProfile)
-    , mRegMgr(0)
+    , mB2BUA(0)
+    , mFifoWatcher(0)
+    , mOverloadGuard(0)
+    , mMetricsServer(0)
+    , mControlServer(0)
+    , mRegStore(0)
+    , mAsyncLogger(0)
+    , mCdrWriter(0)
+    , mTlsSessions(0)
+    , mHandoffServer(0)
+    , mTakeover(0)
+    , mReleased(false)
+    , mDrainUntil(0)
 {
 }
 
 SimpleSBC::~SimpleSBC()
 {
     if (mRunning) shutdown();
+    if (mAsyncLogger)
+    {
+        // resip must not call into the logger once it is gone
+        Log::initialize(Data("cout"), mConfig->mLogLevel, mConfig->getCommandName());
+        delete mAsyncLogger; mAsyncLogger = 0;
+    }
 }
 
 bool SimpleSBC::startup(std::unique_ptr<CmdRunner> cmd)
@@ -58,36 +213,113 @@ bool SimpleSBC::startup(std::unique_ptr<CmdRunner> cmd)
     mConfig = std::move(cmd);
 
     // Initialize resip logger
-    Log::initialize(mConfig->mLogType, mConfig->mLogLevel, mConfig->getCommandName(), mConfig->mLogFile.c_str());
-    Log::setMaxByteCount(mConfig->mLogFileSize);// 5242880 /*5 Mb */
-    Log::setKeepAllLogFiles(mConfig->mKeepAllLogFiles ? true : false);
+    if (mConfig->mLogType == "file" && !mConfig->mLogSync)
+    {
+        // resip still formats on the calling thread, the file is written by the logger thread
+        mAsyncLogger = new AsyncLogger(mConfig->mLogFile, mConfig->mLogFileSize, mConfig->mKeepAllLogFiles != 0);
+        Log::initialize(Data("cout"), mConfig->mLogLevel, mConfig->getCommandName(), mConfig->mLogFile.c_str(), mAsyncLogger);
+        mAsyncLogger->run();
+    }
+    else
+    {
+        Log::initialize(mConfig->mLogType, mConfig->mLogLevel, mConfig->getCommandName(), mConfig->mLogFile.c_str());
+        Log::setMaxByteCount(mConfig->mLogFileSize);// 5242880 /*5 Mb */
+        Log::setKeepAllLogFiles(mConfig->mKeepAllLogFiles ? true : false);
+    }
+    AsyncLogger::setSampleRatio(mConfig->mLogSample);
 
     InfoLog(<< "Starting SimpleSBC...");
     cout << "Starting SimpleSBC..." << endl;
 
+    if (!mConfig->mCdrPath.empty())
+    {
+        // before the shards, the call legs post their records from the start
+        mCdrWriter = new CdrWriter(mConfig->mCdrPath, mConfig->mCdrMaxSize, mConfig->mCdrRotate, mConfig->mCdrSync);
+        mCdrWriter->run();
+    }
+
+    if (mConfig->mTakeover)
+    {
+        // the registrations first, the ports are shared once everything is ready to serve them
+        mTakeover = new HandoffClient(mConfig->mHandoffPath);
+        if (!mTakeover->connect())
+        {
+            delete mTakeover; mTakeover = 0;
+            return false;
+        }
+    }
+
     if (!createSipStack())
     {
         return false;
     }
 
-    if (!createRegistrationManager())
+    if (!createDialogUsageManager())
     {
         return false;
     }
 
-    if (!createDialogUsageManager())
+    // bound last, the sockets of a process taken over are installed under the transports
+    if (!addTransports())
     {
         return false;
     }
 
-    mSipStack->run();
+    if (mConfig->mStackMode != CmdRunner::StackSingle)
+    {
+        // starts the transaction controller, transport selector and dns threads
+        mSipStack->run();
+    }
     if (mStackThread)
     {
         mStackThread->run();
     }
-    if (mDumThread)
+    for (auto shard : mShards)
     {
-        mDumThread->run();
+        shard->getThread()->run();
+        shard->startExpiry();
+    }
+    if (mOverloadGuard)
+    {
+        mOverloadGuard->run();
+    }
+    if (mRegStore)
+    {
+        mRegStore->run();
+    }
+
+    logThreadingLayout();
+
+    if (mTakeover)
+    {
+        // the old process closes its metrics port before this one listens on it
+        mTakeover->release();
+        delete mTakeover; mTakeover = 0;
+    }
+
+    if (mConfig->mMetricsPort)
+    {
+        mMetricsServer = new MetricsServer(mConfig->mMetricsPort, [this](std::ostream& strm) { writeStats(strm, true); });
+        if (mMetricsServer->listen())
+        {
+            mMetricsServer->run();
+        }
+    }
+    if (!mConfig->mControlPath.empty())
+    {
+        mControlServer = new ControlServer(*this, mConfig->mControlPath);
+        if (mControlServer->listen())
+        {
+            mControlServer->run();
+        }
+    }
+    if (!mConfig->mHandoffPath.empty())
+    {
+        mHandoffServer = new HandoffServer(*this, mConfig->mHandoffPath);
+        if (mHandoffServer->listen())
+        {
+            mHandoffServer->run();
+        }
     }
 
     mRunning = true;
@@ -96,104 +328,321 @@ bool SimpleSBC::startup(std::unique_ptr<CmdRunner> cmd)
 
 void SimpleSBC::shutdown()
 {
-    if (mRunning) return;
+    if (!mRunning) return;
 
-    if (mDumThread)
+    if (mHandoffServer)
+    {
+        // a handoff in progress completes first, it releases the metrics server
+        mHandoffServer->shutdown();
+        mHandoffServer->join();
+    }
+    if (mControlServer)
+    {
+        // waits for the commands in progress, they need the shards
+        mControlServer->shutdown();
+        mControlServer->join();
+    }
+    if (mMetricsServer)
+    {
+        mMetricsServer->shutdown();
+        mMetricsServer->join();
+    }
+    for (auto shard : mShards)
     {
-        mDumThread->shutdown();
+        shard->getThread()->shutdown();
+    }
+    if (mOverloadGuard)
+    {
+        mOverloadGuard->shutdown();
     }
     if (mStackThread)
     {
         mStackThread->shutdown();
     }
-    if (mDumThread)
+    for (auto shard : mShards)
     {
-        mDumThread->join();
+        shard->getThread()->join();
+    }
+    if (mOverloadGuard)
+    {
+        mOverloadGuard->join();
     }
     if (mStackThread)
     {
         mStackThread->join();
     }
+    if (mRegStore)
+    {
+        // flushes the last modifications and compacts for a fast next start
+        mRegStore->shutdown();
+        mRegStore->join();
+    }
 
     cleanupObjects();
+    if (mAsyncLogger)
+    {
+        // whatever is logged from now on is written synchronously
+        mAsyncLogger->stop();
+    }
     mRunning = false;
 }
 
 bool SimpleSBC::makeNewCall(const resip::Uri& aor, const Data& sdpfile)
 {
-    auto id = mAor2Id.find(aor);
-    if (id == mAor2Id.end())
+    DumShard& shard = selectShard(aor);
+    return shard.execute([&]()
     {
-        cerr << aor << " not exist in register manager anymore!, Type `show reg` for details" << endl;
-        return false;
+        AorContact reg;
+        if (!shard.findReg(aor, reg))
+        {
+            CmdOutput::err() << aor << " not exist in register manager anymore!, Type `show reg` for details" << endl;
+            return false;
+        }
+        return makeNewCall(shard, reg, sdpfile);
+    });
+}
+
+bool SimpleSBC::makeNewCall(UInt64 id, const resip::Data& sdpfile)
+{
+    for (auto shard : mShards)
+    {
+        AorContact reg;
+        if (shard->findReg(id, reg))
+        {
+            return shard->execute([&]()
+            {
+                // looked up again, the binding may have changed meanwhile
+                return shard->findReg(id, reg) && makeNewCall(*shard, reg, sdpfile);
+            });
+        }
     }
 
-    return makeNewCall(id->second, sdpfile);
+    CmdOutput::err() << id << " not exist in register manager anymore!, Type `show reg` for details" << endl;
+    return false;
 }
 
-bool SimpleSBC::makeNewCall(UInt64 id, const resip::Data& sdpfile)
+bool SimpleSBC::makeNewCalls(unsigned count, unsigned rate, unsigned holdSecs, const resip::Data& targets, const resip::Data& sdpfile)
 {
-    auto reg = mRegs.find(id);
-    if (reg == mRegs.end())
+    std::vector<Uri> aors;
+    UInt64 first = 0;
+    UInt64 last = 0;
+    Data::size_type dash = targets.find("-");
+    if (dash != Data::npos)
+    {
+        first = targets.substr(0, dash).convertUInt64();
+        last = targets.substr(dash + 1).convertUInt64();
+    }
+
+    if (targets == "all")
+    {
+        for (auto shard : mShards)
+        {
+            shard->getAors(aors);
+        }
+    }
+    else if (first && last >= first)
+    {
+        for (UInt64 id = first; id <= last; ++id)
+        {
+            for (auto shard : mShards)
+            {
+                AorContact reg;
+                if (shard->findReg(id, reg))
+                {
+                    aors.push_back(reg.mAor);
+                    break;
+                }
+            }
+        }
+    }
+    else
+    {
+        ifstream file(targets.c_str());
+        if (!file)
+        {
+            CmdOutput::err() << "failed to read targets from file:" << targets << endl;
+            return false;
+        }
+        string line;
+        while (getline(file, line))
+        {
+            Data aor(line);
+            aor.trim();
+            if (aor.empty() || aor[0] == '#')
+            {
+                continue;
+            }
+            try
+            {
+                aors.push_back(Uri(aor).getAorAsUri());
+            }
+            catch (ParseException& e)
+            {
+                CmdOutput::err() << "invalid aor " << aor << " in " << targets << endl;
+            }
+        }
+    }
+
+    if (aors.empty())
     {
-        cerr << id << " not exist in register manager anymore!, Type `show reg` for details" << endl;
+        CmdOutput::err() << "no target to call, Type `show reg` for details" << endl;
         return false;
     }
 
-    return makeNewCall(reg->second, sdpfile);
+    auto pacer = std::make_shared<CallPacer>(*this, std::move(aors), count, rate, holdSecs, sdpfile);
+    pacer->start();
+    // 32s is the INVITE transaction timeout
+    if (!pacer->wait(count / (rate ? rate : 1) + 40))
+    {
+        CmdOutput::err() << "timed out, the calls not started yet are dropped" << endl;
+    }
+    pacer->report(CmdOutput::out());
+    return true;
 }
 
 void SimpleSBC::finishCall(const std::list<UInt64>& cids)
 {
     for (auto id : cids)
     {
-        auto ret = mCalls.find(id);
-        if (ret != mCalls.end())
+        for (auto shard : mShards)
         {
-            ret->second->terminateCall();
+            if (shard->hasCall(id))
+            {
+                shard->execute([&]()
+                {
+                    SSDialogSet* call = shard->findCall(id);
+                    if (call)
+                    {
+                        call->terminateCall();
+                    }
+                    return true;
+                });
+                break;
+            }
         }
     }
 }
 
 bool SimpleSBC::makeReinvite(UInt64 id, const resip::Data& sdpfile)
 {
-    auto ret = mCalls.find(id);
-    if (ret == mCalls.end())
+    for (auto shard : mShards)
     {
-        cerr << id << " not exist in call manager anymore!, Type `show call` for details" << endl;
-        return false;
+        if (shard->hasCall(id))
+        {
+            return shard->execute([&]()
+            {
+                SSDialogSet* call = shard->findCall(id);
+                return call && call->reinvite(sdpfile);
+            });
+        }
     }
 
-    return ret->second->reinvite(sdpfile);
+    CmdOutput::err() << id << " not exist in call manager anymore!, Type `show call` for details" << endl;
+    return false;
 }
 
 void SimpleSBC::showAllReg()
 {
-    for (auto i : mRegs)
+    for (auto shard : mShards)
     {
-        const ContactList* cl = i.second.mContacts;
-        cout << i.first << " --> Aor:" << i.second.mAor << endl;
-        for (auto j : *cl)
+        // formatted on the shard thread into a buffer, sent once the thread is left
+        shard->execute([shard]()
         {
-            UInt64 expire = 0;
-            if (j.mRegExpires > ResipClock::getTimeSecs())
-            {
-                expire = j.mRegExpires - ResipClock::getTimeSecs();
-            }
-            cout << "      --Contact:" << j.mContact << endl
-                 << "      --Expires In:" << expire << endl;
-        }
+            shard->showAllReg(CmdOutput::out());
+            return true;
+        });
     }
 }
 
 void SimpleSBC::showAllCall()
 {
-    for (auto i : mCalls)
+    for (auto shard : mShards)
     {
-        cout << i.first << " --> " << *i.second << endl;
+        shard->execute([shard]()
+        {
+            shard->showAllCall(CmdOutput::out());
+            return true;
+        });
     }
 }
 
+void SimpleSBC::showStats()
+{
+    writeStats(CmdOutput::out(), false);
+}
+
+void SimpleSBC::showMem()
+{
+    MemStats::write(CmdOutput::out());
+}
+
+void SimpleSBC::writeStats(std::ostream& strm, bool prometheus) const
+{
+    std::vector<Metrics::Gauge> gauges;
+    for (auto shard : mShards)
+    {
+        gauges.push_back(Metrics::Gauge("sbc_active_calls", "shard=\"" + Data(shard->getIndex()) + "\"", shard->getCallCount()));
+    }
+    for (int state = SSDialogSet::Idle; state < SSDialogSet::MaxState; ++state)
+    {
+        UInt64 count = 0;
+        for (auto shard : mShards)
+        {
+            count += shard->getCallCount((SSDialogSet::CallState)state);
+        }
+        gauges.push_back(Metrics::Gauge("sbc_call_legs", Data("state=\"") + SSDialogSet::getStateName((SSDialogSet::CallState)state) + "\"", count));
+    }
+    for (auto shard : mShards)
+    {
+        gauges.push_back(Metrics::Gauge("sbc_registrations", "shard=\"" + Data(shard->getIndex()) + "\"", shard->getRegCount()));
+    }
+    UInt64 refreshes = 0;
+    UInt64 updates = 0;
+    for (auto shard : mShards)
+    {
+        refreshes += shard->getRegDb()->getRefreshes();
+        updates += shard->getRegDb()->getUpdates();
+    }
+    // the hit ratio of the refresh fast path is fast / (fast + full)
+    gauges.push_back(Metrics::Gauge("sbc_reg_contact_updates_total", "path=\"fast\"", refreshes, true));
+    gauges.push_back(Metrics::Gauge("sbc_reg_contact_updates_total", "path=\"full\"", updates, true));
+    if (mConfig->mSipTlsPort || mConfig->mSipWssPort)
+    {
+        gauges.push_back(Metrics::Gauge("sbc_tls_handshakes_total", "kind=\"full\"", TlsSessionCache::getFullHandshakes(), true));
+        gauges.push_back(Metrics::Gauge("sbc_tls_handshakes_total", "kind=\"resumed\"", TlsSessionCache::getResumedHandshakes(), true));
+        gauges.push_back(Metrics::Gauge("sbc_tls_sessions", Data::Empty, mTlsSessions ? mTlsSessions->size() : 0));
+    }
+    if (mFifoWatcher)
+    {
+        mFifoWatcher->addGauges(gauges);
+    }
+    if (mOverloadGuard)
+    {
+        mOverloadGuard->addGauges(gauges);
+    }
+    if (mCdrWriter)
+    {
+        gauges.push_back(Metrics::Gauge("sbc_cdr_written_total", Data::Empty, mCdrWriter->getWritten(), true));
+        gauges.push_back(Metrics::Gauge("sbc_cdr_spilled_total", Data::Empty, mCdrWriter->getSpilled(), true));
+        gauges.push_back(Metrics::Gauge("sbc_cdr_pending", Data::Empty, mCdrWriter->getPending()));
+    }
+    MemStats::addGauges(gauges);
+
+    if (prometheus)
+    {
+        Metrics::encodePrometheus(strm, gauges);
+    }
+    else
+    {
+        Metrics::encodeText(strm, gauges);
+    }
+}
+
+DumShard& SimpleSBC::selectShard(const resip::Uri& aor)
+{
+    return *mShards[DumShard::shardOf(aor, getShardCount())];
+}
+
 bool SimpleSBC::createSipStack()
 {
     resip_assert(!mFdPollGrp);
@@ -201,14 +650,24 @@ bool SimpleSBC::createSipStack()
     resip_assert(!mSipStack);
     resip_assert(!mStackThread);
 
+    sShareAllPorts = !mConfig->mHandoffPath.empty();
+
     // Create EventThreadInterruptor used to wake up the stack for reasons other than an Fd signalling
     mFdPollGrp = FdPollGrp::create();
     mAsyncProcessHandler = new EventThreadInterruptor(*mFdPollGrp);
-    mSipStack = new SipStack(0,
+    Security* security = 0;
+#if defined(USE_SSL)
+    if (mConfig->mSipTlsPort || mConfig->mSipWssPort)
+    {
+        // owned by the stack, the transports have their own context for --tls-cert
+        security = new Security();
+    }
+#endif
+    mSipStack = new SipStack(security,
                              DnsStub::EmptyNameserverList,
                              mAsyncProcessHandler,
                              false,
-                             0,
+                             mConfig->mUdpSockets > 1 || sShareAllPorts ? setReusePort : 0,
                              0,
                              mFdPollGrp,
                              false
@@ -219,40 +678,18 @@ bool SimpleSBC::createSipStack()
 
     mSipStack->statisticsManagerEnabled() = false;
 
-    return addTransports();
+    // fifo depths and per method counters for `show stats` and the metrics endpoint,
+    // both must be in place before the transports are added
+    mFifoWatcher = new FifoWatcher;
+    mSipStack->setCongestionManager(mFifoWatcher);
+    mSipStack->setTransportSipMessageLoggingHandler(std::make_shared<MetricsMessageLogger>());
+
+    return true;
 }
 
 bool SimpleSBC::createDialogUsageManager()
 {
-    resip_assert(!mDum);
-    resip_assert(!mDumThread);
-
-    mDum = new DialogUsageManager(*mSipStack);
-
-    resip::MessageFilterRuleList ruleList;
-    resip::MessageFilterRule::MethodList methodList;
-    methodList.push_back(resip::INVITE);
-    methodList.push_back(resip::ACK);
-    methodList.push_back(resip::CANCEL);
-    methodList.push_back(resip::OPTIONS);
-    methodList.push_back(resip::BYE);
-    methodList.push_back(resip::UPDATE);
-    methodList.push_back(resip::REGISTER);
-    methodList.push_back(resip::MESSAGE);
-    methodList.push_back(resip::INFO);
-    ruleList.push_back(MessageFilterRule(resip::MessageFilterRule::SchemeList(),
-        resip::MessageFilterRule::DomainIsMe,
-        methodList));
-    mDum->setMessageFilterRuleList(ruleList);
-
-    unique_ptr<AppDialogSetFactory> dsf(new SSDialogSetFactory(*this));
-    mDum->setAppDialogSetFactory(std::move(dsf));
-
-    mDum->setServerRegistrationHandler(this);
-    mDum->setInviteSessionHandler(this);
-    mDum->setDialogSetHandler(this);
-    mDum->setRegistrationPersistenceManager(mRegMgr);
-    mDum->setKeepAliveManager(std::unique_ptr<KeepAliveManager>(new KeepAliveManager));
+    resip_assert(mShards.empty());
 
     // MasterProfile settings
     mMasterProfile->addSupportedMethod(REGISTER);
@@ -262,10 +699,6 @@ bool SimpleSBC::createDialogUsageManager()
     mMasterProfile->setRportEnabled(InteropHelper::getRportEnabled());
     mMasterProfile->setOutboundDecorator(std::make_shared<SdpMessageDecorator>());
 
-    mDum->setMasterProfile(mMasterProfile);
-
-    addDomains(*mDum);
-
     // custom Profile settings
     mProxyUdp = std::make_shared<Profile>(mMasterProfile);
     mProxyUdp->setKeepAliveTimeForDatagram(30);
@@ -275,42 +708,178 @@ bool SimpleSBC::createDialogUsageManager()
     mProxyTcp->setKeepAliveTimeForStream(120);
     mProxyTcp->setUserAgent("SimpleSBC/TCP");
 
-    mDumThread = new DumThread(*mDum);
+    // bridged calls relay the sdp of the peer untouched
+    mB2BUasProfile = std::make_shared<UserProfile>(mMasterProfile);
+    mB2BUasProfile->setOutboundDecorator(std::shared_ptr<MessageDecorator>());
+    mB2BUA = new B2BUA(*this);
 
-    dynamic_cast<InMemorySyncRegDb*>(mRegMgr)->addHandler(this);
+    if (mConfig->mOverloadQueue || mConfig->mOverloadWait || mConfig->mOverloadLatency || !mConfig->mRateLimits.empty())
+    {
+        // the stack asks the transaction users in the order they registered, the guard
+        // must be first to take the requests it sheds from the shards
+        OverloadGuard::Limits limits;
+        limits.mQueue = (UInt32)mConfig->mOverloadQueue;
+        limits.mWaitMs = (UInt32)mConfig->mOverloadWait;
+        limits.mLatencyUs = (UInt32)mConfig->mOverloadLatency;
+        limits.mRetryAfter = (UInt32)mConfig->mRetryAfter;
+        std::unique_ptr<RateLimiter> limiter;
+        if (!mConfig->mRateLimits.empty())
+        {
+            limiter.reset(new RateLimiter(mConfig->mRateLimits, (size_t)mConfig->mRateLimitSources));
+        }
+        mOverloadGuard = new OverloadGuard(*mSipStack, *mFifoWatcher, limits, std::move(limiter));
+        mSipStack->registerTransactionUser(*mOverloadGuard);
+    }
 
+    unsigned count = mConfig->mDumWorkers > 0 ? (unsigned)mConfig->mDumWorkers : 1;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        DumShard* shard = new DumShard(*mSipStack, *this, i, count);
+        mShards.push_back(shard);
+        setupDialogUsageManager(*shard);
+    }
+
+    InfoLog(<< "Dialog layer is running with " << count << " DialogUsageManager instance(s)");
+
+    if (!mConfig->mRegStore.empty())
+    {
+        // warm restart, the bindings are routed to the shard owning their aor
+        mRegStore = new RegStore(mConfig->mRegStore);
+        for (auto shard : mShards)
+        {
+            mRegStore->addDb(shard->getRegDb());
+            shard->getRegDb()->setStore(mRegStore);
+        }
+        mRegStore->load([this](const Uri& aor, const ContactList& contacts)
+        {
+            selectShard(aor).getRegDb()->restore(aor, contacts);
+        });
+    }
+    if (mTakeover)
+    {
+        // newer than the files, the old process flushed them before sending
+        mTakeover->restore([this](const Uri& aor, const ContactList& contacts)
+        {
+            selectShard(aor).getRegDb()->restore(aor, contacts);
+        });
+    }
     return true;
 }
 
-bool SimpleSBC::createRegistrationManager()
+void SimpleSBC::setupDialogUsageManager(DumShard& dum)
 {
-    resip_assert(!mRegMgr);
-    mRegMgr = new InMemorySyncRegDb();
-    return true;
+    resip::MessageFilterRuleList ruleList;
+    resip::MessageFilterRule::MethodList methodList;
+    methodList.push_back(resip::INVITE);
+    methodList.push_back(resip::ACK);
+    methodList.push_back(resip::CANCEL);
+    methodList.push_back(resip::OPTIONS);
+    methodList.push_back(resip::BYE);
+    methodList.push_back(resip::UPDATE);
+    methodList.push_back(resip::REGISTER);
+    methodList.push_back(resip::MESSAGE);
+    methodList.push_back(resip::INFO);
+    ruleList.push_back(MessageFilterRule(resip::MessageFilterRule::SchemeList(),
+        resip::MessageFilterRule::DomainIsMe,
+        methodList));
+    dum.setMessageFilterRuleList(ruleList);
+
+    unique_ptr<AppDialogSetFactory> dsf(new SSDialogSetFactory(*this, dum));
+    dum.setAppDialogSetFactory(std::move(dsf));
+
+    dum.setServerRegistrationHandler(this);
+    dum.setInviteSessionHandler(this);
+    dum.setDialogSetHandler(this);
+    dum.setKeepAliveManager(std::unique_ptr<KeepAliveManager>(new KeepAliveManager));
+
+    dum.setMasterProfile(mMasterProfile);
+
+    addDomains(dum);
 }
 
 void SimpleSBC::addDomains(resip::TransactionUser& tu)
 {
+    bool v6 = mConfig->mIpv6 != 0;
+    for (auto& addr : mConfig->mSipAddresses)
+    {
+        v6 = v6 || DnsUtil::isIpV6Address(addr);
+    }
+
     std::list<std::pair<Data, Data> > interfaces = DnsUtil::getInterfaces();
     for (auto i : interfaces)
     {
-        if (DnsUtil::isIpV4Address(i.second)) tu.addDomain(i.second);
+        if (DnsUtil::isIpV4Address(i.second) || (v6 && DnsUtil::isIpV6Address(i.second))) tu.addDomain(i.second);
     }
 }
 
 bool SimpleSBC::addTransports()
 {
     resip_assert(mSipStack);
+
+    // a transport with its own thread is no longer serviced by the EventStackThread,
+    // so a burst of TCP reconnects cannot stall UDP processing
+    unsigned transportFlags = 0;
+    if (mConfig->mStackMode == CmdRunner::StackTransport)
+    {
+        transportFlags |= RESIP_TRANSPORT_FLAG_OWNTHREAD;
+    }
+    // sockets sharing the UDP port only pay off if each one is received on its own thread
+    unsigned udpFlags = mConfig->mUdpSockets > 1 ? RESIP_TRANSPORT_FLAG_OWNTHREAD : 0;
+
+    // every interface and family gets its transports, all adapters if none is given
+    std::vector<std::pair<Data, IpVersion> > interfaces;
+    for (auto& addr : mConfig->mSipAddresses)
+    {
+        interfaces.push_back(std::make_pair(addr, DnsUtil::isIpV6Address(addr) ? V6 : V4));
+    }
+    if (interfaces.empty())
+    {
+        interfaces.push_back(std::make_pair(Data::Empty, V4));
+        if (mConfig->mIpv6)
+        {
+            interfaces.push_back(std::make_pair(Data::Empty, V6));
+        }
+    }
+    if (interfaces.size() > 1)
+    {
+        // the i/o of one interface never waits behind the one of another
+        transportFlags |= RESIP_TRANSPORT_FLAG_OWNTHREAD;
+    }
+
     try
     {
-        if (mConfig->mSipUdpPort)
+        for (auto& i : interfaces)
         {
-            mSipStack->addTransport(UDP, mConfig->mSipUdpPort, V4, StunDisabled, mConfig->mSipAddress);
+            for (int s = 0; mConfig->mSipUdpPort && s < mConfig->mUdpSockets; ++s)
+            {
+                // the kernel hashes every peer address to one of the sockets, the messages of a
+                // flow arrive on the same transport and are answered through it
+                mTransports.push_back(mSipStack->addTransport(UDP, mConfig->mSipUdpPort, i.second, StunDisabled, i.first,
+                    Data::Empty, Data::Empty, SecurityTypes::SSLv23, transportFlags | udpFlags));
+            }
+            if (mConfig->mSipTcpPort)
+            {
+                mTransports.push_back(mSipStack->addTransport(TCP, mConfig->mSipTcpPort, i.second, StunDisabled, i.first,
+                    Data::Empty, Data::Empty, SecurityTypes::SSLv23, transportFlags));
+            }
+#if defined(USE_SSL)
+            if (mConfig->mSipTlsPort)
+            {
+                mTransports.push_back(mSipStack->addTransport(TLS, mConfig->mSipTlsPort, i.second, StunDisabled, i.first,
+                    mConfig->mTlsDomain, Data::Empty, SecurityTypes::SSLv23, transportFlags, mConfig->mTlsCert, mConfig->mTlsKey));
+            }
+            if (mConfig->mSipWssPort)
+            {
+                mTransports.push_back(mSipStack->addTransport(WSS, mConfig->mSipWssPort, i.second, StunDisabled, i.first,
+                    mConfig->mTlsDomain, Data::Empty, SecurityTypes::SSLv23, transportFlags, mConfig->mTlsCert, mConfig->mTlsKey));
+            }
+#endif
         }
-        if (mConfig->mSipTcpPort)
+        if (mTakeover)
         {
-            mSipStack->addTransport(TCP, mConfig->mSipTcpPort, V4, StunDisabled, mConfig->mSipAddress);
+            adoptSockets();
         }
+        setupTlsSessions();
     }
     catch (BaseException& e)
     {
@@ -321,76 +890,219 @@ bool SimpleSBC::addTransports()
     return true;
 }
 
-void SimpleSBC::onAorModified(const resip::Uri& aor, const ContactList& contacts)
+void SimpleSBC::setupTlsSessions()
 {
-    if (contacts.empty())
+#if defined(USE_SSL)
+    if (!mConfig->mSipTlsPort && !mConfig->mSipWssPort)
     {
-        auto id = mAor2Id.find(aor);
-        if (id != mAor2Id.end())
+        return;
+    }
+
+    // reconnect storms are mostly full handshakes without resumption
+    if (mConfig->mTlsSessionCache > 0)
+    {
+        mTlsSessions = new TlsSessionCache(mConfig->mTlsSessionCache, mConfig->mTlsSessionTimeout);
+    }
+    std::vector<SSL_CTX*> contexts;
+    contexts.push_back(mSipStack->getSecurity()->getTlsCtx());
+    contexts.push_back(mSipStack->getSecurity()->getSslCtx());
+    for (auto t : mTransports)
+    {
+        TlsBaseTransport* tls = dynamic_cast<TlsBaseTransport*>(t);
+        if (tls && tls->getCtx())
         {
-            mRegs.erase(id->second);
-            mAor2Id.erase(id);
+            contexts.push_back(tls->getCtx());
         }
     }
-    else
+    for (auto ctx : contexts)
     {
-        auto id = mAor2Id.find(aor);
-        if (id != mAor2Id.end())
+        if (mTlsSessions)
         {
-            mRegs.insert(std::make_pair(id->second, AorContact(aor, &contacts)));
+            mTlsSessions->attach(ctx);
         }
         else
         {
-            mAor2Id[aor] = sRID;
-            mRegs.insert(std::make_pair(sRID, AorContact(aor, &contacts)));
-            ++sRID;
+            TlsSessionCache::countHandshakes(ctx);
         }
     }
+    InfoLog(<< "TLS session resumption " << (mTlsSessions ? "shared by " : "disabled on ") << contexts.size() << " context(s)");
+#endif
+}
+
+void SimpleSBC::adoptSockets()
+{
+    // the sockets of the old process replace the ones just bound, the datagrams and
+    // connections already queued on them are received here
+    size_t adopted = 0;
+    for (auto t : mTransports)
+    {
+        InternalTransport* transport = dynamic_cast<InternalTransport*>(t);
+        int fd = transport ? mTakeover->takeSocket(t->getTuple()) : -1;
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (swapSocket(transport->getSocketDescriptor(), fd))
+        {
+            ++adopted;
+        }
+        else
+        {
+            ErrLog(<< "Failed to take over the socket of " << t->getTuple() << ", both processes receive on it");
+        }
+        closeSocket(fd);
+    }
+    InfoLog(<< "Took over " << adopted << " of " << mTransports.size() << " listening sockets");
+}
+
+void SimpleSBC::releaseTransports()
+{
+#if !defined(WIN32)
+    for (auto t : mTransports)
+    {
+        InternalTransport* transport = dynamic_cast<InternalTransport*>(t);
+        if (!transport)
+        {
+            continue;
+        }
+        // the new process receives on the sockets this one handed over, they are swapped
+        // for sockets of the same kind that never get readable: an unbound UDP socket still
+        // sends the requests of the calls draining, the peers honouring rport answer it,
+        // a stream listener on the loopback port the kernel picks accepts nothing
+        const Tuple& tuple = t->getTuple();
+        bool stream = tuple.getType() != UDP;
+        Socket fd = ::socket(tuple.ipVersion() == V6 ? AF_INET6 : AF_INET, stream ? SOCK_STREAM : SOCK_DGRAM, 0);
+        bool ok = fd != INVALID_SOCKET && makeSocketNonBlocking(fd);
+        if (ok && stream)
+        {
+            Tuple loopback(tuple.ipVersion() == V6 ? "::1" : "127.0.0.1", 0, tuple.ipVersion(), TCP);
+            ok = ::bind(fd, &loopback.getSockaddr(), loopback.length()) == 0 && ::listen(fd, 1) == 0;
+        }
+        if (!ok || !swapSocket(transport->getSocketDescriptor(), fd))
+        {
+            ErrLog(<< "Failed to release the port of " << t->getTuple() << ", " << getErrno());
+        }
+        if (fd != INVALID_SOCKET)
+        {
+            closeSocket(fd);
+        }
+    }
+    InfoLog(<< "Released the ports of " << mTransports.size() << " transport(s)");
+#endif
+}
+
+void SimpleSBC::logThreadingLayout()
+{
+    CmdRunner::StackMode mode = mConfig->mStackMode;
+    int udpSockets = mConfig->mSipUdpPort ? std::max(mConfig->mUdpSockets, 1) : 0;
+    int transports = (int)mTransports.size();
+
+    InfoLog(<< "Threading layout: stack-mode=" << CmdRunner::getStackModeName(mode)
+            << ", dum-workers=" << getShardCount());
+    InfoLog(<< "  EventStackThread: "
+            << (mode == CmdRunner::StackTransport ? "timers" : "transport i/o")
+            << (mode == CmdRunner::StackSingle ? ", transactions, dns" : ""));
+    if (mode != CmdRunner::StackSingle)
+    {
+        InfoLog(<< "  TransactionControllerThread, TransportSelectorThread, DnsThread");
+    }
+    if (mode == CmdRunner::StackTransport || mConfig->mSipAddresses.size() > 1 || (mConfig->mIpv6 && mConfig->mSipAddresses.empty()))
+    {
+        InfoLog(<< "  " << transports << " transport thread(s)");
+    }
+    else if (udpSockets > 1)
+    {
+        InfoLog(<< "  " << udpSockets << " UDP transport thread(s), SO_REUSEPORT");
+    }
+    InfoLog(<< "  " << getShardCount() << " DumThread(s)");
+    if (mOverloadGuard)
+    {
+        InfoLog(<< "  OverloadGuard thread");
+    }
+    if (mCdrWriter)
+    {
+        InfoLog(<< "  CdrWriter thread");
+    }
 }
 
 void SimpleSBC::onRefresh(ServerRegistrationHandle h, const SipMessage& reg)
 {
+    MetricsTimer timer(Metrics::OnRefresh);
     h->accept();
 }
 
 void SimpleSBC::onRemove(ServerRegistrationHandle h, const SipMessage& reg)
 {
+    MetricsTimer timer(Metrics::OnRemove);
     h->accept();
 }
 
 void SimpleSBC::onRemoveAll(ServerRegistrationHandle h, const SipMessage& reg)
 {
+    MetricsTimer timer(Metrics::OnRemoveAll);
     h->accept();
 }
 
 void SimpleSBC::onAdd(ServerRegistrationHandle h, const SipMessage& reg)
 {
+    MetricsTimer timer(Metrics::OnAdd);
     h->accept();
 }
 
 void SimpleSBC::onQuery(ServerRegistrationHandle h, const SipMessage& reg)
 {
+    MetricsTimer timer(Metrics::OnQuery);
     h->accept();
 }
 
-
+// Every dialog set of an invite session is a SSDialogSet, made by SSDialogSetFactory for
+// an inbound INVITE or by makeNewCall and B2BUA::bridge for the ones sent, and INVITE is
+// the only request sent out of dialog, so the handlers forward with a static_cast.
 void SimpleSBC::onNewSession(ClientInviteSessionHandle h, InviteSession::OfferAnswerType oat, const SipMessage& msg)
 {
-    dynamic_cast<SSDialogSet*>(h->getAppDialogSet().get())->onNewSession(h, oat, msg);
+    MetricsTimer timer(Metrics::OnNewSession);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onNewSession(h, oat, msg);
+}
+
+void SimpleSBC::onNewSession(ServerInviteSessionHandle h, InviteSession::OfferAnswerType oat, const SipMessage& msg)
+{
+    MetricsTimer timer(Metrics::OnNewSession);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onNewSession(h, oat, msg);
+}
+
+void SimpleSBC::onFailure(ClientInviteSessionHandle h, const SipMessage& msg)
+{
+    MetricsTimer timer(Metrics::OnFailure);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onFailure(h, msg);
+}
+
+void SimpleSBC::onEarlyMedia(ClientInviteSessionHandle h, const SipMessage& msg, const SdpContents& sdp)
+{
+    MetricsTimer timer(Metrics::OnEarlyMedia);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onEarlyMedia(h, msg, sdp);
 }
 
 void SimpleSBC::onProvisional(ClientInviteSessionHandle h, const SipMessage& msg)
 {
-    dynamic_cast<SSDialogSet*>(h->getAppDialogSet().get())->onProvisional(h, msg);
+    MetricsTimer timer(Metrics::OnProvisional);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onProvisional(h, msg);
 }
 
 void SimpleSBC::onConnected(ClientInviteSessionHandle h, const SipMessage& msg)
 {
-    dynamic_cast<SSDialogSet*>(h->getAppDialogSet().get())->onConnected(h, msg);
+    MetricsTimer timer(Metrics::OnConnected);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onConnected(h, msg);
+}
+
+void SimpleSBC::onConnected(InviteSessionHandle h, const SipMessage& msg)
+{
+    MetricsTimer timer(Metrics::OnConnected);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onConnected(h, msg);
 }
 
 void SimpleSBC::onTerminated(InviteSessionHandle h, InviteSessionHandler::TerminatedReason reason, const SipMessage* related /*= 0*/)
 {
+    MetricsTimer timer(Metrics::OnTerminated);
     Data reasonData;
 
     switch (reason)
@@ -436,111 +1148,291 @@ void SimpleSBC::onTerminated(InviteSessionHandle h, InviteSessionHandler::Termin
         InfoLog(<< "onTerminated: reason=" << reasonData);
     }
 
-    SSDialogSet* ds = dynamic_cast<SSDialogSet*>(h->getAppDialogSet().get());
-    if (ds)
-    {
-        eraseCall(ds);
-    }
+    SSDialogSet* ds = static_cast<SSDialogSet*>(h->getAppDialogSet().get());
+    ds->onTerminated(h, reason, related);
+    eraseCall(ds);
+}
+
+void SimpleSBC::onAnswer(InviteSessionHandle h, const SipMessage& msg, const SdpContents& sdp)
+{
+    MetricsTimer timer(Metrics::OnAnswer);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onAnswer(h, msg, sdp);
+}
+
+void SimpleSBC::onOffer(InviteSessionHandle h, const SipMessage& msg, const SdpContents& sdp)
+{
+    MetricsTimer timer(Metrics::OnOffer);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onOffer(h, msg, sdp);
+}
+
+void SimpleSBC::onOfferRequired(InviteSessionHandle h, const SipMessage& msg)
+{
+    MetricsTimer timer(Metrics::OnOfferRequired);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onOfferRequired(h, msg);
 }
 
-void SimpleSBC::onAnswer(InviteSessionHandle h, const SipMessage& msg, const SdpContents& sdp)
+void SimpleSBC::onOfferRejected(InviteSessionHandle h, const SipMessage* msg)
 {
-    dynamic_cast<SSDialogSet*>(h->getAppDialogSet().get())->onAnswer(h, msg, sdp);
+    MetricsTimer timer(Metrics::OnOfferRejected);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onOfferRejected(h, msg);
 }
 
 void SimpleSBC::onRemoteSdpChanged(InviteSessionHandle h, const SipMessage& msg, const SdpContents& sdp)
 {
-    dynamic_cast<SSDialogSet*>(h->getAppDialogSet().get())->onRemoteSdpChanged(h, msg, sdp);
+    MetricsTimer timer(Metrics::OnRemoteSdpChanged);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onRemoteSdpChanged(h, msg, sdp);
 }
 
 void SimpleSBC::onOfferRequestRejected(InviteSessionHandle h, const SipMessage& msg)
 {
-    dynamic_cast<SSDialogSet*>(h->getAppDialogSet().get())->onOfferRequestRejected(h, msg);
+    MetricsTimer timer(Metrics::OnOfferRequestRejected);
+    static_cast<SSDialogSet*>(h->getAppDialogSet().get())->onOfferRequestRejected(h, msg);
 }
 
 void SimpleSBC::onTrying(resip::AppDialogSetHandle h, const resip::SipMessage& msg)
 {
-    dynamic_cast<SSDialogSet*>(h.get())->onTrying(h, msg);
+    MetricsTimer timer(Metrics::OnTrying);
+    static_cast<SSDialogSet*>(h.get())->onTrying(h, msg);
+}
+
+void SimpleSBC::stopPersisting()
+{
+    if (mRegStore)
+    {
+        // the shards go on modifying their aors, the store no longer queues them
+        mRegStore->shutdown();
+        mRegStore->join();
+    }
+}
+
+void SimpleSBC::resumePersisting()
+{
+    if (mRegStore)
+    {
+        mRegStore->resume();
+    }
+}
+
+void SimpleSBC::release()
+{
+    releaseTransports();
+    if (mMetricsServer)
+    {
+        mMetricsServer->shutdown();
+        mMetricsServer->join();
+        delete mMetricsServer; mMetricsServer = 0;
+    }
+    mDrainUntil = Timer::getTimeMs() + (UInt64)mConfig->mHandoffDrain * 1000;
+    mReleased = true;
+}
+
+void SimpleSBC::onLoop()
+{
+    if (!mReleased)
+    {
+        return;
+    }
+    size_t calls = 0;
+    for (auto shard : mShards)
+    {
+        calls += shard->getCallCount();
+    }
+    if (calls && Timer::getTimeMs() < mDrainUntil)
+    {
+        return;
+    }
+    if (calls)
+    {
+        WarningLog(<< "Taken over, exiting with " << calls << " call leg(s) left after --handoff-drain");
+    }
+    else
+    {
+        InfoLog(<< "Taken over, all the calls ended, exiting");
+    }
+    onSignal(SIGTERM);
 }
 
 void SimpleSBC::cleanupObjects()
 {
-    delete mRegMgr; mRegMgr = 0;
-    delete mDumThread; mDumThread = 0;
-    delete mDum; mDum = 0;
+    for (auto shard : mShards)
+    {
+        delete shard;
+    }
+    mShards.clear();
+    // after the shards, the call legs they destroy post their records
+    delete mCdrWriter; mCdrWriter = 0;
+    delete mOverloadGuard; mOverloadGuard = 0;
+    delete mB2BUA; mB2BUA = 0;
+    delete mMetricsServer; mMetricsServer = 0;
+    delete mControlServer; mControlServer = 0;
+    delete mHandoffServer; mHandoffServer = 0;
+    delete mRegStore; mRegStore = 0;
     delete mStackThread; mStackThread = 0;
     delete mSipStack; mSipStack = 0;
+    // after the stack, its transports hold SSL contexts using it
+    delete mTlsSessions; mTlsSessions = 0;
+    delete mFifoWatcher; mFifoWatcher = 0;
     delete mAsyncProcessHandler; mAsyncProcessHandler = 0;
     delete mFdPollGrp; mFdPollGrp = 0;
 }
 
 
-bool SimpleSBC::makeNewCall(const AorContact& ac, const resip::Data& sdpfile)
+bool SimpleSBC::makeNewCall(DumShard& shard, const AorContact& ac, const resip::Data& sdpfile, std::shared_ptr<CallPacer> pacer)
 {
-    const ContactList* cl = ac.mContacts;
+    RegView::Contacts cl = ac.contacts();
     if (cl->empty())
     {
-        cerr << ac.mAor << " has no contact" << endl;
+        CmdOutput::err() << ac.mAor << " has no contact" << endl;
         return false;
     }
 
-    UInt64 now = Timer::getTimeSecs();
-    for (auto rec : *cl)
+    ContactInstanceRecord rec;
+    if (!selectContact(ac, rec))
     {
-        if (rec.mRegExpires > now)
-        {
-            std::shared_ptr<UserProfile> userProfile;
-            if (rec.mReceivedFrom.getType() == resip::UDP)
-            {
-                userProfile = std::make_shared<UserProfile>(mProxyUdp);
-            }
-            else if (rec.mReceivedFrom.getType() == resip::TCP)
-            {
-                userProfile = std::make_shared<UserProfile>(mProxyUdp);
-            }
-            else
-            {
-                ErrLog(<< "Only support UDP and TCP for INVITE!");
-                resip_assert(0);
-            }
+        CmdOutput::err() << ac.mAor << " has no valid contact!" << endl;
+        return false;
+    }
+
+    std::shared_ptr<UserProfile> userProfile = shard.getProfiles().get(rec.mReceivedFrom, ProfileCache::Local, Timer::getTimeSecs());
+    if (!userProfile)
+    {
+        CmdOutput::err() << ac.mAor << " is not registered over UDP, TCP, TLS or WSS, no call can be sent to it" << endl;
+        return false;
+    }
 
-            userProfile->setDefaultFrom(userProfile->getAnonymousUserProfile()->getDefaultFrom());
-            userProfile->clientOutboundEnabled() = true;
-            userProfile->setClientOutboundFlowTuple(rec.mReceivedFrom);
+    SSDialogSet* newCall = new SSDialogSet(*this, shard);
+    newCall->setPacer(std::move(pacer));
+    newCall->initiateCall(rec.mContact, std::move(userProfile), sdpfile);
 
-            SSDialogSet* newCall = new SSDialogSet(*this);
-            newCall->initiateCall(rec.mContact, std::move(userProfile), sdpfile);
+    addCall(newCall);
 
-            addCall(newCall);
+    return true;
+}
 
+bool SimpleSBC::selectContact(const AorContact& ac, resip::ContactInstanceRecord& rec) const
+{
+    // the first valid contact in the order RegDb keeps them, the order they were first
+    // registered in. The shards purge expired bindings every second, the first contact
+    // is nearly always the one taken, the check covers the second before a purge
+    UInt64 now = Timer::getTimeSecs();
+    RegView::Contacts contacts = ac.contacts();
+    for (auto& i : *contacts)
+    {
+        if (i.mRegExpires > now)
+        {
+            rec = i;
+            bindFlow(rec.mReceivedFrom);
             return true;
         }
     }
+    return false;
+}
 
-    cerr << ac.mAor << " has no valid contact!" << endl;
+void SimpleSBC::bindFlow(resip::Tuple& flow) const
+{
+    if (flow.mTransportKey)
+    {
+        return;
+    }
 
-    return false;
+    const Transport* best = 0;
+    int bestPrefix = -1;
+    int bits = flow.ipVersion() == V6 ? 128 : 32;
+    for (auto t : mTransports)
+    {
+        const Tuple& local = t->getTuple();
+        if (local.getType() != flow.getType() || local.ipVersion() != flow.ipVersion())
+        {
+            continue;
+        }
+        // bound to all adapters, matches any peer but a more specific interface wins
+        int prefix = 0;
+        if (!local.isAnyInterface())
+        {
+            prefix = bits;
+            while (prefix > 0 && !local.isEqualWithMask(flow, (short)prefix, true, true))
+            {
+                --prefix;
+            }
+        }
+        if (prefix > bestPrefix)
+        {
+            best = t;
+            bestPrefix = prefix;
+        }
+    }
+    if (best)
+    {
+        flow.mTransportKey = best->getKey();
+    }
 }
 
-void SimpleSBC::addCall(SSDialogSet* call)
+std::shared_ptr<SimpleSBC::UserProfile> SimpleSBC::makeUserProfile(const resip::Tuple& flow, ProfileCache::Kind kind) const
 {
-    mCalls[sCID++] = call;
+    std::shared_ptr<UserProfile> userProfile;
+    if (flow.getType() == resip::UDP)
+    {
+        userProfile = std::make_shared<UserProfile>(mProxyUdp);
+    }
+    else if (flow.getType() == resip::TCP || flow.getType() == resip::TLS || flow.getType() == resip::WSS)
+    {
+        // keepalives of a stream transport
+        userProfile = std::make_shared<UserProfile>(mProxyTcp);
+    }
+    else
+    {
+        ErrLog(<< "No call over " << toData(flow.getType()) << " flows");
+        return userProfile;
+    }
+
+    userProfile->clientOutboundEnabled() = true;
+    userProfile->setClientOutboundFlowTuple(flow);
+    if (kind == ProfileCache::Bridged)
+    {
+        // the sdp is relayed untouched, don't let the decorator rewrite it to our address
+        userProfile->setOutboundDecorator(std::shared_ptr<MessageDecorator>());
+    }
+    else
+    {
+        userProfile->setDefaultFrom(userProfile->getAnonymousUserProfile()->getDefaultFrom());
+    }
+    return userProfile;
 }
 
-void SimpleSBC::eraseCall(SSDialogSet* call)
+void SimpleSBC::writeAllocStats(std::ostream& strm) const
 {
-    for (auto i : mCalls)
+    const ObjectPool<SSDialogSet>::Stats& pool = ObjectPool<SSDialogSet>::stats();
+    UInt64 hits = 0;
+    UInt64 misses = 0;
+    for (auto shard : mShards)
     {
-        if (i.second == call)
-        {
-            mCalls.erase(i.first);
-            break;
-        }
+        hits += shard->getProfiles().getHits();
+        misses += shard->getProfiles().getMisses();
+    }
+    UInt64 dialogSets = pool.mHeapAllocs + pool.mReuses;
+
+    strm << "dialog sets: " << dialogSets << ", " << pool.mHeapAllocs << " allocated, " << pool.mReuses << " from the pool" << endl;
+    strm << "outbound profiles: " << hits + misses << ", " << misses << " allocated, " << hits << " cached" << endl;
+    if (dialogSets)
+    {
+        strm << "allocations per dialog set: " << fixed << setprecision(3)
+             << (double)(pool.mHeapAllocs + misses) / dialogSets << endl;
+        strm.unsetf(ios::floatfield);
     }
 }
 
+void SimpleSBC::addCall(SSDialogSet* call)
+{
+    call->getShard().addCall(sCID++, call);
+}
+
+void SimpleSBC::eraseCall(SSDialogSet* call)
+{
+    call->getShard().eraseCall(call);
+}
+
 //////////////////////////////////////////////////////////////////////////
-SSDialogSetFactory::SSDialogSetFactory(SimpleSBC& ss) : mSbc(ss)
+SSDialogSetFactory::SSDialogSetFactory(SimpleSBC& ss, DumShard& shard) : mSbc(ss), mShard(shard)
 {
 }
 
@@ -549,8 +1441,11 @@ resip::AppDialogSet* SSDialogSetFactory::createAppDialogSet(DialogUsageManager&
     switch (msg.method())
     {
     case INVITE:
-        return new SSDialogSet(mSbc);
-        break;
+    {
+        SSDialogSet* call = new SSDialogSet(mSbc, mShard);
+        call->mLogDump = AsyncLogger::isSampled(msg.header(h_CallId).value());
+        return call;
+    }
     default:
         return AppDialogSetFactory::createAppDialogSet(dum, msg);
         break;
@@ -558,28 +1453,195 @@ resip::AppDialogSet* SSDialogSetFactory::createAppDialogSet(DialogUsageManager&
 }
 
 //////////////////////////////////////////////////////////////////////////
-SSDialogSet::SSDialogSet(SimpleSBC& ss) : AppDialogSet(*ss.mDum), mSbc(ss)
+SSDialogSet::SSDialogSet(SimpleSBC& ss, DumShard& shard)
+    : AppDialogSet(shard)
+    , mSbc(ss)
+    , mShard(shard)
+    , mPeer(0)
+    , mRelayingOffer(false)
+    , mAnswered(false)
+    , mLogDump(false)
+    , mSetupStart(0)
+    , mState(Idle)
+    , mDumBytes(0)
 {
+    memset(mEntered, 0, sizeof(mEntered));
+    mEntered[Idle] = Timer::getTimeMs();
+    mShard.moveCallState(MaxState, Idle);
+    MemStats::change(MemStats::CallLeg, 1, sizeof(SSDialogSet));
+    if (mSbc.getCdrWriter())
+    {
+        mCdr.reset(new CdrRecord);
+    }
 }
 
 SSDialogSet::~SSDialogSet()
 {
-    cerr << *this << endl;
+    // a leg can go without its session ever being terminated
+    mShard.eraseCall(this);
+    unpair();
+    if (mPacer)
+    {
+        mPacer->onFailed();
+    }
+    if (!mCallId.empty())
+    {
+        DumShard::unpinCallId(mCallId);
+    }
+    if (mLogDump)
+    {
+        InfoLog(<< "Call ended: " << *this);
+    }
+    if (mCdr && mEntered[Trying])
+    {
+        mCdr->mStart = mEntered[Trying];
+        mCdr->mRing = mEntered[Early];
+        mCdr->mAnswer = mEntered[Connected];
+        mCdr->mEnd = mEntered[Terminated] ? mEntered[Terminated] : Timer::getTimeMs();
+        mSbc.getCdrWriter()->post(std::move(*mCdr));
+    }
+    if (mDumBytes)
+    {
+        MemStats::change(MemStats::DumSession, -1, -(SInt64)mDumBytes);
+    }
+    MemStats::change(MemStats::CallLeg, -1, -(SInt64)sizeof(SSDialogSet));
+    mShard.moveCallState(mState, MaxState);
+}
+
+// next state by [state][event], the events that don't apply leave the state as is
+const UInt8 SSDialogSet::sTransitions[MaxState][MaxEvent] =
+{
+    //               Invite       Provisional  Answered     Failed       Hangup       Terminated
+    /* Idle */        { Trying,      Early,       Connected,   Terminating, Terminating, Terminated },
+    /* Trying */      { Trying,      Early,       Connected,   Terminating, Terminating, Terminated },
+    /* Early */       { Early,       Early,       Connected,   Terminating, Terminating, Terminated },
+    /* Connected */   { Connected,   Connected,   Connected,   Connected,   Terminating, Terminated },
+    /* Terminating */ { Terminating, Terminating, Terminating, Terminating, Terminating, Terminated },
+    /* Terminated */  { Terminated,  Terminated,  Terminated,  Terminated,  Terminated,  Terminated },
+};
+
+const char* SSDialogSet::getStateName(CallState state)
+{
+    static const char* const names[MaxState] = { "idle", "trying", "early", "connected", "terminating", "terminated" };
+    return state < MaxState ? names[state] : "unknown";
+}
+
+void SSDialogSet::transit(CallEvent ev)
+{
+    CallState next = (CallState)sTransitions[mState][ev];
+    if (next != mState)
+    {
+        mShard.moveCallState(mState, next);
+        mState = next;
+        mEntered[next] = Timer::getTimeMs();
+        mShard.publishCall(this);
+    }
+}
+
+std::shared_ptr<const SSDialogSet::View> SSDialogSet::makeView() const
+{
+    std::shared_ptr<View> view = std::make_shared<View>();
+    view->mPeer = Data::from(*this);
+    view->mState = mState;
+    view->mEntered = mEntered[mState];
+    view->mStart = mEntered[Trying];
+    return view;
+}
+
+void SSDialogSet::accept()
+{
+    mAnswered = true;
+    if (mCdr)
+    {
+        mCdr->mStatus = 200;
+    }
+    mServerHandle->accept();
+    transit(EvAnswered);
+}
+
+void SSDialogSet::reject(int code)
+{
+    mAnswered = true;
+    if (mCdr)
+    {
+        mCdr->mStatus = code;
+    }
+    mServerHandle->reject(code);
+    transit(EvFailed);
 }
 
 void SSDialogSet::initiateCall(const resip::NameAddr& target, std::shared_ptr<resip::UserProfile> profile, const resip::Data& sdpfile)
 {
     SdpContents offer;
     makeOffer(offer, sdpfile);
-    auto invite = mSbc.getDialogUsageManager().makeInviteSession(target, std::move(profile), &offer, this);
-    mSbc.getDialogUsageManager().send(std::move(invite));
+    initiateCall(target, std::move(profile), offer);
+}
+
+void SSDialogSet::initiateCall(const resip::NameAddr& target, std::shared_ptr<resip::UserProfile> profile, const resip::SdpContents& offer,
+    const resip::NameAddr* from)
+{
+    auto invite = mShard.makeInviteSession(target, std::move(profile), &offer, this);
+    if (from)
+    {
+        // the tag identifies the dialog set already, only the identity changes
+        Data tag = invite->header(h_From).param(p_tag);
+        invite->header(h_From) = *from;
+        invite->header(h_From).param(p_tag) = tag;
+    }
+    if (mPacer)
+    {
+        mSetupStart = Timer::getTimeMicroSec();
+    }
+    if (!mPeer)
+    {
+        mLogDump = AsyncLogger::isSampled(invite->header(h_CallId).value());
+    }
+    const Data& callId = invite->header(h_CallId).value();
+    if (DumShard::shardOf(callId, mSbc.getShardCount()) != mShard.getIndex())
+    {
+        mCallId = callId;
+        DumShard::pinCallId(mCallId, mShard.getIndex());
+    }
+    if (mPeer && mPeer->mCdr)
+    {
+        mPeer->mCdr->mTarget = Data::from(target.uri());
+    }
+    if (mCdr)
+    {
+        mCdr->mCallId = invite->header(h_CallId).value();
+        mCdr->mCaller = Data::from(invite->header(h_From).uri());
+        mCdr->mCallee = Data::from(invite->header(h_To).uri());
+        mCdr->mTarget = Data::from(target.uri());
+    }
+    mShard.send(std::move(invite));
+    transit(EvInvite);
+}
+
+void SSDialogSet::pair(SSDialogSet& outbound)
+{
+    resip_assert(!mPeer && !outbound.mPeer);
+    mPeer = &outbound;
+    outbound.mPeer = this;
+    outbound.mLogDump = mLogDump;
+    // the inbound leg records the bridged call
+    outbound.mCdr.reset();
+    mRelayingOffer = true;
+}
+
+void SSDialogSet::unpair()
+{
+    if (mPeer)
+    {
+        mPeer->mPeer = 0;
+        mPeer = 0;
+    }
 }
 
 bool SSDialogSet::reinvite(const resip::Data& sdpfile)
 {
     if (!mInviteSessionHandle->isConnected())
     {
-        cerr << "call not connected, Illegal operation" << endl;
+        CmdOutput::err() << "call not connected, Illegal operation" << endl;
         return false;
     }
 
@@ -606,6 +1668,7 @@ bool SSDialogSet::reinvite(const resip::Data& sdpfile)
 
 void SSDialogSet::terminateCall()
 {
+    transit(EvHangup);
     if (mInviteSessionHandle.isValid())
     {
         mInviteSessionHandle->end(InviteSession::UserHangup);
@@ -616,27 +1679,195 @@ void SSDialogSet::terminateCall()
     }
 }
 
+void SSDialogSet::countDumSession(size_t sessionBytes)
+{
+    // what DUM keeps for the leg, the headers of the messages it holds are not counted
+    if (!mDumBytes)
+    {
+        mDumBytes = (UInt32)(sizeof(resip::DialogSet) + sizeof(resip::Dialog) + sessionBytes + sizeof(SipMessage));
+        MemStats::change(MemStats::DumSession, 1, mDumBytes);
+    }
+}
+
 void SSDialogSet::onNewSession(resip::ClientInviteSessionHandle h, resip::InviteSession::OfferAnswerType oat, const resip::SipMessage& msg)
 {
     mInviteSessionHandle = h->getSessionHandle();
+    countDumSession(sizeof(ClientInviteSession));
+}
+
+void SSDialogSet::onNewSession(resip::ServerInviteSessionHandle h, resip::InviteSession::OfferAnswerType oat, const resip::SipMessage& msg)
+{
+    mServerHandle = h;
+    mInviteSessionHandle = h->getSessionHandle();
+    transit(EvInvite);
+    countDumSession(sizeof(ServerInviteSession));
+    if (mCdr)
+    {
+        const Tuple& source = msg.getSource();
+        mCdr->mInbound = true;
+        mCdr->mCallId = msg.header(h_CallId).value();
+        mCdr->mCaller = Data::from(msg.header(h_From).uri());
+        mCdr->mCallee = Data::from(msg.header(h_To).uri());
+        mCdr->mSource = (source.ipVersion() == V6 ? "[" + Tuple::inet_ntop(source) + "]" : Tuple::inet_ntop(source))
+            + ":" + Data(source.getPort());
+    }
 }
 
 void SSDialogSet::onFailure(resip::ClientInviteSessionHandle h, const resip::SipMessage& msg)
 {
     mInviteSessionHandle = h->getSessionHandle();
     InfoLog(<< "Invite failure...");
+    transit(EvFailed);
+    if (mCdr)
+    {
+        mCdr->mStatus = msg.header(h_StatusLine).statusCode();
+    }
+    if (mPacer)
+    {
+        mPacer->onFailed();
+        mPacer.reset();
+    }
+
+    if (mPeer && mPeer->mServerHandle.isValid() && !mPeer->mAnswered)
+    {
+        mPeer->reject(msg.header(h_StatusLine).statusCode());
+    }
+}
+
+void SSDialogSet::onEarlyMedia(resip::ClientInviteSessionHandle h, const resip::SipMessage& msg, const resip::SdpContents& sdp)
+{
+    mInviteSessionHandle = h->getSessionHandle();
+    transit(EvProvisional);
+
+    // relay as the answer of the inbound leg, it goes out with the 18x
+    if (mPeer && mPeer->mServerHandle.isValid() && !mPeer->mAnswered && mPeer->mRelayingOffer)
+    {
+        mPeer->mRelayingOffer = false;
+        mPeer->mServerHandle->provideAnswer(sdp);
+        mPeer->mServerHandle->provisional(msg.header(h_StatusLine).statusCode(), true);
+        mPeer->transit(EvProvisional);
+    }
 }
 
 void SSDialogSet::onProvisional(resip::ClientInviteSessionHandle h, const resip::SipMessage& msg)
 {
     mInviteSessionHandle = h->getSessionHandle();
     InfoLog(<< "Received 180 Ringing...");
+    transit(EvProvisional);
+
+    // a provisional with early media is relayed by onEarlyMedia
+    if (mPeer && mPeer->mServerHandle.isValid() && !mPeer->mAnswered && !msg.getContents())
+    {
+        mPeer->mServerHandle->provisional(msg.header(h_StatusLine).statusCode());
+        mPeer->transit(EvProvisional);
+    }
 }
 
 void SSDialogSet::onConnected(resip::ClientInviteSessionHandle h, const resip::SipMessage& msg)
 {
     mInviteSessionHandle = h->getSessionHandle();
     InfoLog(<< "Invite Session Connected.");
+    transit(EvAnswered);
+    if (mCdr)
+    {
+        mCdr->mStatus = msg.header(h_StatusLine).statusCode();
+    }
+    if (mPacer)
+    {
+        mPacer->onAnswered(*this, Timer::getTimeMicroSec() - mSetupStart);
+        mPacer.reset();
+    }
+
+    if (mPeer && mPeer->mServerHandle.isValid() && !mPeer->mAnswered)
+    {
+        mPeer->accept();
+    }
+}
+
+void SSDialogSet::onConnected(resip::InviteSessionHandle h, const resip::SipMessage& msg)
+{
+    // ACK of an inbound leg
+    transit(EvAnswered);
+}
+
+void SSDialogSet::onTerminated(resip::InviteSessionHandle h, resip::InviteSessionHandler::TerminatedReason reason, const resip::SipMessage* msg)
+{
+    transit(EvTerminated);
+    if (mCdr)
+    {
+        mCdr->mReason = getCdrReason(reason);
+    }
+    if (!mPeer)
+    {
+        return;
+    }
+
+    SSDialogSet* peer = mPeer;
+    unpair();
+    if (peer->mServerHandle.isValid() && !peer->mAnswered)
+    {
+        // onFailure didn't reject the inbound leg, the outbound leg ended without a final response
+        peer->reject(reason == InviteSessionHandler::Timeout ? 408 : 480);
+    }
+    else
+    {
+        peer->terminateCall();
+    }
+}
+
+void SSDialogSet::onOffer(resip::InviteSessionHandle h, const resip::SipMessage& msg, const resip::SdpContents& offer)
+{
+    mInviteSessionHandle = h;
+
+    if (mServerHandle.isValid() && !mPeer && !mAnswered)
+    {
+        // offer of a new inbound INVITE
+        int code = mSbc.getB2BUA().bridge(*this, msg, offer);
+        if (code)
+        {
+            reject(code);
+        }
+        return;
+    }
+
+    if (mPeer && mPeer->mInviteSessionHandle.isValid() && mPeer->mInviteSessionHandle->isConnected())
+    {
+        // re-INVITE or UPDATE, answered once the peer gets the answer to the relayed offer
+        mRelayingOffer = true;
+        mPeer->mInviteSessionHandle->provideOffer(offer);
+        return;
+    }
+
+    if (h->isConnected())
+    {
+        // not bridged, keep the current media
+        h->provideAnswer(h->getLocalSdp());
+    }
+    else
+    {
+        h->reject(488);
+    }
+}
+
+void SSDialogSet::onOfferRequired(resip::InviteSessionHandle h, const resip::SipMessage& msg)
+{
+    mInviteSessionHandle = h;
+
+    if (mServerHandle.isValid() && !mPeer && !mAnswered)
+    {
+        // bridging an INVITE without offer is not supported
+        InfoLog(<< "Reject inbound INVITE without offer: " << msg.brief());
+        reject(488);
+    }
+}
+
+void SSDialogSet::onOfferRejected(resip::InviteSessionHandle h, const resip::SipMessage* msg)
+{
+    if (mPeer && mPeer->mRelayingOffer && mPeer->mInviteSessionHandle.isValid())
+    {
+        mPeer->mRelayingOffer = false;
+        mPeer->mInviteSessionHandle->reject(msg ? msg->header(h_StatusLine).statusCode() : 488);
+    }
 }
 
 void SSDialogSet::onTrying(resip::AppDialogSetHandle h, const resip::SipMessage& msg)
@@ -647,23 +1878,29 @@ void SSDialogSet::onTrying(resip::AppDialogSetHandle h, const resip::SipMessage&
 void SSDialogSet::onAnswer(resip::InviteSessionHandle h, const resip::SipMessage& msg, const resip::SdpContents& sdp)
 {
     mInviteSessionHandle = h->getSessionHandle();
-    InfoLog(<< "Received answer..." << msg);
+    InfoLog(<< "Received answer..." << (mLogDump ? Data::from(msg) : msg.brief()));
     const NameAddr& from = msg.header(h_From);
     const NameAddr& contact = msg.header(h_Contacts).front();
     InfoLog(<< "from displayname:" << from.displayName() << ", contact displayname:" << contact.displayName());
+
+    if (mPeer && mPeer->mRelayingOffer && mPeer->mInviteSessionHandle.isValid())
+    {
+        mPeer->mRelayingOffer = false;
+        mPeer->mInviteSessionHandle->provideAnswer(sdp);
+    }
 }
 
 
 void SSDialogSet::onRemoteSdpChanged(resip::InviteSessionHandle h, const resip::SipMessage& msg, const resip::SdpContents& sdp)
 {
     mInviteSessionHandle = h->getSessionHandle();
-    InfoLog(<< "Received onRemoteSdpChanged..." << msg);
+    InfoLog(<< "Received onRemoteSdpChanged..." << (mLogDump ? Data::from(msg) : msg.brief()));
 }
 
 void SSDialogSet::onOfferRequestRejected(resip::InviteSessionHandle h, const resip::SipMessage& msg)
 {
     mInviteSessionHandle = h->getSessionHandle();
-    InfoLog(<< "Received onOfferRequestRejected..." << msg);
+    InfoLog(<< "Received onOfferRequestRejected..." << (mLogDump ? Data::from(msg) : msg.brief()));
 }
 
 EncodeStream& SSDialogSet::dump(EncodeStream& strm) const
@@ -680,50 +1917,25 @@ EncodeStream& SSDialogSet::dump(EncodeStream& strm) const
 
 void SSDialogSet::makeOffer(resip::SdpContents& offer, const resip::Data& sdpfile)
 {
-    static Data txt("v=0\r\n"
-        "o=- 0 0 IN IP4 0.0.0.0\r\n"
-        "s=basicClient\r\n"
-        "c=IN IP4 10.18.0.200\r\n"
-        "t=0 0\r\n"
-        "m=audio 45678 RTP/AVP 0 101\r\n"
-        "a=rtpmap:0 pcmu/8000\r\n"
-        "a=rtpmap:101 telephone-event/8000\r\n"
-        "a=fmtp:101 0-15\r\n");
-
-    HeaderFieldValue hfv(txt.data(), txt.size());
-    Mime type("application", "sdp");
-    SdpContents offerSdp(hfv, type);
-
-    // Set sessionid and version for this offer
-    UInt64 currentTime = Timer::getTimeMicroSec();
-    offerSdp.session().origin().getSessionId() = currentTime;
-    offerSdp.session().origin().getVersion() = currentTime;
-
-    offer = offerSdp;
-
-    if (sdpfile.empty())
+    if (sdpfile.empty() || !readSdpFromFile(offer, sdpfile))
     {
-        readSdpFromFile(offer, sdpfile);
+        SdpTemplateCache::instance().makeOffer(Data::Empty, offer);
     }
 }
 
-bool SSDialogSet::readSdpFromFile(resip::SdpContents& sdp, const resip::Data& sdpfile)
+std::shared_ptr<resip::UserProfile> SSDialogSet::selectUASUserProfile(const resip::SipMessage& msg)
 {
-    try
-    {
-        Data txt(Data::fromFile(sdpfile));
-        HeaderFieldValue hfv(txt.data(), txt.size());
-        Mime type("application", "sdp");
-        SdpContents offerSdp(hfv, type);
-
-        sdp = offerSdp;
+    // every inbound INVITE is bridged
+    return mSbc.mB2BUasProfile;
+}
 
-        return true;
-    }
-    catch (...)
+bool SSDialogSet::readSdpFromFile(resip::SdpContents& sdp, const resip::Data& sdpfile)
+{
+    if (!SdpTemplateCache::instance().makeOffer(sdpfile, sdp))
     {
-        cerr << "failed to read sdp from file:" << sdpfile << ", use default sdp" << endl;
+        CmdOutput::err() << "failed to read sdp from file:" << sdpfile << ", use default sdp" << endl;
         return false;
     }
+    return true;
 }
 
@@ -13,10 +13,16 @@
 #include "resip/dum/UserProfile.hxx"
 #include "resip/dum/MasterProfile.hxx"
 #include "resip/dum/DialogSetHandler.hxx"
-#include "resip/dum/InMemorySyncRegDb.hxx"
+#include "resip/dum/ContactInstanceRecord.hxx"
 #include "resip/stack/SipMessage.hxx"
 
 #include "cmd_option.h"
+#include "object_pool.h"
+#include "profile_cache.h"
+#include "reg_db.h"
+
+#include <atomic>
+#include <vector>
 
 
 namespace resip
@@ -25,9 +31,13 @@ namespace resip
     class DialogUsageManager;
     class ThreadIf;
     class RegistrationPersistenceManager;
+    class Transport;
 }
 
-// Used to set the IP Address in outbound SDP to match the IP address choosen by the stack to send the message on
+// Sets the origin and connection address of an outbound sdp to the address of the
+// transport the stack chose to send it on. Runs for every outbound message, so the
+// messages without sdp are dismissed on their Content-Type, and the formatted address
+// of the few source tuples is cached per thread.
 class SdpMessageDecorator : public resip::MessageDecorator
 {
 public:
@@ -35,24 +45,28 @@ public:
     virtual void decorateMessage(resip::SipMessage& msg,
         const resip::Tuple& source,
         const resip::Tuple& destination,
-        const resip::Data& sigcompId)
-    {
-        resip::SdpContents* sdp = dynamic_cast<resip::SdpContents*>(msg.getContents());
-        if (sdp)
-        {
-            // Fill in IP and Port from source
-            sdp->session().origin().setAddress(resip::Tuple::inet_ntop(source), source.ipVersion() == resip::V6 ? resip::SdpContents::IP6 : resip::SdpContents::IP4);
-            sdp->session().connection().setAddress(resip::Tuple::inet_ntop(source), source.ipVersion() == resip::V6 ? resip::SdpContents::IP6 : resip::SdpContents::IP4);
-        }
-    }
+        const resip::Data& sigcompId);
     virtual void rollbackMessage(resip::SipMessage& msg) {}  // Nothing to do
     virtual resip::MessageDecorator* clone() const { return new SdpMessageDecorator; }
 };
 
 class SSDialogSet;
+class DumShard;
+class B2BUA;
+class FifoWatcher;
+class MetricsServer;
+class RegStore;
+class AsyncLogger;
+class CallPacer;
+class ControlServer;
+class TlsSessionCache;
+class OverloadGuard;
+class CdrWriter;
+struct CdrRecord;
+class HandoffServer;
+class HandoffClient;
 class SimpleSBC
     : public resip::ServerProcess
-    , public resip::InMemorySyncRegDbHandler
     , public resip::ServerRegistrationHandler
     , public resip::InviteSessionHandler
     , public resip::DialogSetHandler
@@ -73,13 +87,16 @@ public:
     class AorContact
     {
     public:
-        AorContact(const resip::Uri& aor, const resip::ContactList* contacts)
-            : mAor(aor), mContacts(contacts) {}
+        AorContact() {}
+        AorContact(const resip::Uri& aor, std::shared_ptr<RegView> view)
+            : mAor(aor), mView(std::move(view)) {}
         bool operator==(const AorContact* ac) {
             return mAor == ac->mAor;
         }
+        /// the bindings as last published, unchanged and valid for as long as it is held
+        RegView::Contacts contacts() const { return mView ? mView->load() : RegView::none(); }
         resip::Uri mAor;
-        const resip::ContactList* mContacts;
+        std::shared_ptr<RegView> mView;
     };
 
     SimpleSBC();
@@ -90,28 +107,60 @@ public:
 
     bool makeNewCall(const resip::Uri& aor, const resip::Data& sdpfile);
     bool makeNewCall(UInt64 id, const resip::Data& sdpfile);
+    /// start `count` calls at `rate` per second and print a summary once all of them
+    /// were answered or failed. `targets` is `all` the registrations, a range of their
+    /// ids `<first>-<last>`, or a file of one aor per line
+    bool makeNewCalls(unsigned count, unsigned rate, unsigned holdSecs, const resip::Data& targets, const resip::Data& sdpfile);
     void finishCall(const std::list<UInt64>& ids);
     bool makeReinvite(UInt64 id, const resip::Data& sdpfile);
     void showAllReg();
     void showAllCall();
+    void showStats();
+    /// live objects and estimated bytes of the registrations and calls, see MemStats
+    void showMem();
+    /// metrics of the whole process, prometheus text format if `prometheus` else human readable
+    void writeStats(std::ostream& strm, bool prometheus) const;
 
-    resip::DialogUsageManager& getDialogUsageManager() { return *mDum; }
+    const CmdRunner& getConfig() const { return *mConfig; }
+    unsigned getShardCount() const { return (unsigned)mShards.size(); }
+    DumShard& getShard(unsigned index) { return *mShards[index]; }
+    DumShard& selectShard(const resip::Uri& aor);
+
+    B2BUA& getB2BUA() { return *mB2BUA; }
+    /// null unless call detail records are written
+    CdrWriter* getCdrWriter() const { return mCdrWriter; }
+    /// first valid contact, its flow bound to a local transport, see bindFlow
+    bool selectContact(const AorContact& ac, resip::ContactInstanceRecord& rec) const;
+    /// new profile of the calls of `kind` sent to `flow`, see ProfileCache
+    std::shared_ptr<UserProfile> makeUserProfile(const resip::Tuple& flow, ProfileCache::Kind kind) const;
+    /// per call allocations of the dialog sets and the profiles since the start
+    void writeAllocStats(std::ostream& strm) const;
 
 protected:
     //////////////////////////////////////////////////////////////////////////
     friend class SSDialogSet;
+    friend class DumShard;
+    friend class B2BUA;
+    friend class CallPacer;
+    friend class HandoffServer;
 
     const resip::Data& getSdpFile() const { return resip::Data::Empty; }
 
     bool createSipStack();
     bool createDialogUsageManager();
-    bool createRegistrationManager();
+    void setupDialogUsageManager(DumShard& dum);
 
     void addDomains(resip::TransactionUser& tu);
     bool addTransports();
-
-    // InMemorySyncRegDbHandler ////////////////////////////////////////////////////////////////////////
-    void onAorModified(const resip::Uri& aor, const resip::ContactList& contacts);
+    void setupTlsSessions();
+    /// --takeover: install the listening sockets of the old process under the transports
+    void adoptSockets();
+    /// taken over: swap the listening sockets for idle ones, the transports go on polling them
+    void releaseTransports();
+    /// a flow restored from the RegStore lost the transport it was received on, give
+    /// it the transport of its type and family whose address is closest to the peer
+    void bindFlow(resip::Tuple& flow) const;
+    void logThreadingLayout();
 
     // Server Registration Handler ////////////////////////////////////////////////////////////////////////
     /// Called when registration is refreshed
@@ -129,16 +178,16 @@ protected:
     // Invite Session Handler ////////////////////////////////////////////////////////////////////////
     /// called when an initial INVITE or the intial response to an outoing invite  
     virtual void onNewSession(ClientInviteSessionHandle, InviteSession::OfferAnswerType oat, const SipMessage& msg);
-    virtual void onNewSession(ServerInviteSessionHandle, InviteSession::OfferAnswerType oat, const SipMessage& msg) {}
+    virtual void onNewSession(ServerInviteSessionHandle, InviteSession::OfferAnswerType oat, const SipMessage& msg);
     /// Received a failure response from UAS
-    virtual void onFailure(ClientInviteSessionHandle, const SipMessage& msg) {}
+    virtual void onFailure(ClientInviteSessionHandle, const SipMessage& msg);
     /// called when an in-dialog provisional response is received that contains a body
-    virtual void onEarlyMedia(ClientInviteSessionHandle, const SipMessage&, const SdpContents&) {}
+    virtual void onEarlyMedia(ClientInviteSessionHandle, const SipMessage&, const SdpContents&);
     /// called when dialog enters the Early state - typically after getting 18x
     virtual void onProvisional(ClientInviteSessionHandle, const SipMessage&);
     virtual void onConnected(ClientInviteSessionHandle, const SipMessage& msg);
     /// called when a dialog initiated as a UAS enters the connected state
-    virtual void onConnected(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onConnected(InviteSessionHandle, const SipMessage& msg);
     /// called when ACK (with out an answer) is received for initial invite (UAS)
     virtual void onConnectedConfirmed(InviteSessionHandle, const SipMessage &msg) {}
     /// called when PRACK is received for a reliable provisional answer (UAS)
@@ -169,7 +218,7 @@ protected:
     /// answering the call 
     virtual void onAnswer(InviteSessionHandle, const SipMessage& msg, const SdpContents&);
     /// called when an offer is received - must send an answer soon after this
-    virtual void onOffer(InviteSessionHandle, const SipMessage& msg, const SdpContents&) {}
+    virtual void onOffer(InviteSessionHandle, const SipMessage& msg, const SdpContents&);
     /// called when a modified body is received in a 2xx response to a
     /// session-timer reINVITE. Under normal circumstances where the response
     /// body is unchanged from current remote body no handler is called
@@ -178,10 +227,10 @@ protected:
     virtual void onOfferRequestRejected(InviteSessionHandle, const SipMessage& msg);
     /// called when an Invite w/out offer is sent, or any other context which
     /// requires an offer from the user
-    virtual void onOfferRequired(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onOfferRequired(InviteSessionHandle, const SipMessage& msg);
     /// called if an offer in a UPDATE or re-INVITE was rejected - not real
     /// useful. A SipMessage is provided if one is available
-    virtual void onOfferRejected(InviteSessionHandle, const SipMessage* msg) {}
+    virtual void onOfferRejected(InviteSessionHandle, const SipMessage* msg);
     /// called when INFO message is received 
     /// the application must call acceptNIT() or rejectNIT()
     /// once it is ready for another message.
@@ -209,9 +258,20 @@ protected:
     virtual void onTrying(resip::AppDialogSetHandle, const resip::SipMessage& msg);
     virtual void onNonDialogCreatingProvisional(resip::AppDialogSetHandle, const resip::SipMessage& msg) {}
 
+    // Handoff, see HandoffServer ///////////////////////////////////////////
+    /// a new process is taking over, flush the registrations and stop writing them
+    void stopPersisting();
+    /// the handoff failed, this process goes on serving and writes its registrations again
+    void resumePersisting();
+    /// the new process is receiving on the same ports, leave them to it and drain the calls
+    void release();
+    /// exits once the calls of a process taken over are drained
+    virtual void onLoop();
+
     //////////////////////////////////////////////////////////////////////////
     void cleanupObjects();
-    bool makeNewCall(const AorContact& ac, const resip::Data& sdpfile);
+    bool makeNewCall(DumShard& shard, const AorContact& ac, const resip::Data& sdpfile,
+        std::shared_ptr<CallPacer> pacer = std::shared_ptr<CallPacer>());
     void addCall(SSDialogSet* call);
     void eraseCall(SSDialogSet* call);
 
@@ -222,54 +282,127 @@ private:
     resip::AsyncProcessHandler  *mAsyncProcessHandler;
     resip::SipStack             *mSipStack;
     resip::ThreadIf             *mStackThread;
-    resip::DialogUsageManager   *mDum;
-    resip::ThreadIf             *mDumThread;
+    std::vector<DumShard*>      mShards;
+    std::vector<resip::Transport*> mTransports;  // owned by the stack
     std::shared_ptr<resip::MasterProfile>   mMasterProfile;
-    resip::RegistrationPersistenceManager*  mRegMgr;
     std::shared_ptr<resip::Profile> mProxyUdp;
     std::shared_ptr<resip::Profile> mProxyTcp;
-    HashMap<UInt64, AorContact>     mRegs;
-    HashMap<UInt64, SSDialogSet*>   mCalls;
-    HashMap<resip::Uri, UInt64>     mAor2Id;
-    static UInt64 sRID;
-    static UInt64 sCID;
+    std::shared_ptr<resip::UserProfile> mB2BUasProfile;
+    B2BUA*                      mB2BUA;
+    FifoWatcher*                mFifoWatcher;
+    OverloadGuard*              mOverloadGuard;
+    MetricsServer*              mMetricsServer;
+    ControlServer*              mControlServer;
+    RegStore*                   mRegStore;
+    AsyncLogger*                mAsyncLogger;
+    CdrWriter*                  mCdrWriter;
+    TlsSessionCache*            mTlsSessions;
+    HandoffServer*              mHandoffServer;
+    HandoffClient*              mTakeover;      // during the startup of --takeover only
+    std::atomic<bool>           mReleased;      // taken over, draining
+    UInt64                      mDrainUntil;
+    static std::atomic<UInt64> sRID;
+    static std::atomic<UInt64> sCID;
 };
 
 class SSDialogSetFactory : public resip::AppDialogSetFactory
 {
 public:
-    SSDialogSetFactory(SimpleSBC& ss);
+    SSDialogSetFactory(SimpleSBC& ss, DumShard& shard);
     resip::AppDialogSet* createAppDialogSet(resip::DialogUsageManager& ss, const resip::SipMessage&);
 private:
     SimpleSBC& mSbc;
+    DumShard& mShard;
 };
 
+// A call leg. Either a call originated by the `call` command, or one of the two legs
+// of a bridged call, in which case every event worth relaying is passed to the peer leg.
+// The phase of the leg is kept by a small state machine, the next state is looked up in
+// a table indexed by the current state and the event, and the time each state was
+// entered is kept, so `show call` and the metrics read the phase and its duration
+// without asking the invite session.
 class SSDialogSet : public resip::AppDialogSet
 {
+    friend class SSDialogSetFactory;
 public:
-    SSDialogSet(SimpleSBC& ss);
+    SS_DECLARE_POOLED(SSDialogSet)
+
+    enum CallState
+    {
+        Idle,           // nothing sent or received yet
+        Trying,         // INVITE sent or received, no provisional yet
+        Early,          // provisional sent or received
+        Connected,      // answered
+        Terminating,    // failed, rejected or hung up, waiting for the session to end
+        Terminated,
+        MaxState,
+    };
+
+    enum CallEvent
+    {
+        EvInvite,
+        EvProvisional,
+        EvAnswered,
+        EvFailed,
+        EvHangup,
+        EvTerminated,
+        MaxEvent,
+    };
+
+    static const char* getStateName(CallState state);
+
+    // What the other threads see of a call, published by the shard thread whenever the
+    // state changes and never modified afterwards
+    struct View
+    {
+        resip::Data mPeer;      // remote address once there is a session, else the dialog set id
+        CallState mState;
+        UInt64 mEntered;        // Timer::getTimeMs() when mState was entered
+        UInt64 mStart;          // when the INVITE was sent or received, 0 if not yet
+    };
+
+    SSDialogSet(SimpleSBC& ss, DumShard& shard);
     ~SSDialogSet();
 
+    DumShard& getShard() const { return mShard; }
+    /// report the setup of the call to `pacer`
+    void setPacer(std::shared_ptr<CallPacer> pacer) { mPacer = std::move(pacer); }
+
     void initiateCall(const resip::NameAddr& target, std::shared_ptr<resip::UserProfile> profile, const resip::Data& sdpfile);
+    /// `from` replaces the default From of the profile, shared by several calls
+    void initiateCall(const resip::NameAddr& target, std::shared_ptr<resip::UserProfile> profile, const resip::SdpContents& offer,
+        const resip::NameAddr* from = 0);
     bool reinvite(const resip::Data& sdpfile);
     void terminateCall();
 
+    /// pair an inbound leg with the outbound leg started for it, the inbound offer
+    /// waits for the answer of the outbound leg
+    void pair(SSDialogSet& outbound);
+    SSDialogSet* getPeer() const { return mPeer; }
+
+    CallState getState() const { return mState; }
+    /// Timer::getTimeMs() when `state` was entered, 0 if it never was
+    UInt64 getStateTime(CallState state) const { return mEntered[state]; }
+    /// ms spent in the current state
+    UInt64 getStateDuration(UInt64 now) const { return now - mEntered[mState]; }
+    std::shared_ptr<const View> makeView() const;
+
     virtual void onNewSession(resip::ClientInviteSessionHandle h, resip::InviteSession::OfferAnswerType oat, const resip::SipMessage& msg);
-    virtual void onNewSession(resip::ServerInviteSessionHandle h, resip::InviteSession::OfferAnswerType oat, const resip::SipMessage& msg) {}
+    virtual void onNewSession(resip::ServerInviteSessionHandle h, resip::InviteSession::OfferAnswerType oat, const resip::SipMessage& msg);
     virtual void onFailure(resip::ClientInviteSessionHandle h, const resip::SipMessage& msg);
-    virtual void onEarlyMedia(resip::ClientInviteSessionHandle, const resip::SipMessage&, const resip::SdpContents&) {}
+    virtual void onEarlyMedia(resip::ClientInviteSessionHandle, const resip::SipMessage&, const resip::SdpContents&);
     virtual void onProvisional(resip::ClientInviteSessionHandle, const resip::SipMessage& msg);
     virtual void onConnected(resip::ClientInviteSessionHandle h, const resip::SipMessage& msg);
-    virtual void onConnected(resip::InviteSessionHandle, const resip::SipMessage& msg) {}
+    virtual void onConnected(resip::InviteSessionHandle, const resip::SipMessage& msg);
     virtual void onStaleCallTimeout(resip::ClientInviteSessionHandle) {}
-    virtual void onTerminated(resip::InviteSessionHandle h, resip::InviteSessionHandler::TerminatedReason reason, const resip::SipMessage* msg) {}
+    virtual void onTerminated(resip::InviteSessionHandle h, resip::InviteSessionHandler::TerminatedReason reason, const resip::SipMessage* msg);
     virtual void onRedirected(resip::ClientInviteSessionHandle, const resip::SipMessage& msg) {}
     virtual void onAnswer(resip::InviteSessionHandle, const resip::SipMessage& msg, const resip::SdpContents&);
-    virtual void onOffer(resip::InviteSessionHandle handle, const resip::SipMessage& msg, const resip::SdpContents& offer) {}
+    virtual void onOffer(resip::InviteSessionHandle handle, const resip::SipMessage& msg, const resip::SdpContents& offer);
     virtual void onRemoteSdpChanged(resip::InviteSessionHandle, const resip::SipMessage& msg, const resip::SdpContents& sdp);
     virtual void onOfferRequestRejected(resip::InviteSessionHandle, const resip::SipMessage& msg);
-    virtual void onOfferRequired(resip::InviteSessionHandle, const resip::SipMessage& msg) {}
-    virtual void onOfferRejected(resip::InviteSessionHandle, const resip::SipMessage* msg) {}
+    virtual void onOfferRequired(resip::InviteSessionHandle, const resip::SipMessage& msg);
+    virtual void onOfferRejected(resip::InviteSessionHandle, const resip::SipMessage* msg);
     virtual void onInfo(resip::InviteSessionHandle, const resip::SipMessage& msg) {}
     virtual void onInfoSuccess(resip::InviteSessionHandle, const resip::SipMessage& msg) {}
     virtual void onInfoFailure(resip::InviteSessionHandle, const resip::SipMessage& msg) {}
@@ -292,9 +425,31 @@ public:
 protected:
     void makeOffer(resip::SdpContents& offer, const resip::Data& sdpfile);
     bool readSdpFromFile(resip::SdpContents& sdp, const resip::Data& sdpfile);
+    virtual std::shared_ptr<resip::UserProfile> selectUASUserProfile(const resip::SipMessage&);
+    void unpair();
+    void transit(CallEvent ev);
+    /// final response of an inbound leg
+    void accept();
+    void reject(int code);
+    void countDumSession(size_t sessionBytes);
 private:
+    static const UInt8 sTransitions[MaxState][MaxEvent];
+
     SimpleSBC& mSbc;
+    DumShard& mShard;
+    resip::Data mCallId;    // pinned to this shard, see DumShard::pinCallId
     resip::InviteSessionHandle mInviteSessionHandle;
+    resip::ServerInviteSessionHandle mServerHandle;
+    SSDialogSet* mPeer;
+    bool mRelayingOffer;    // an offer received on this leg was passed to the peer, waiting for its answer
+    bool mAnswered;         // a final response was sent on this inbound leg
+    bool mLogDump;          // the call is sampled, complete messages are logged, see AsyncLogger::isSampled
+    std::shared_ptr<CallPacer> mPacer;  // started by `call --count`, reset once the setup is reported
+    UInt64 mSetupStart;
+    CallState mState;
+    UInt64 mEntered[MaxState];  // Timer::getTimeMs() when each state was entered
+    std::unique_ptr<CdrRecord> mCdr;    // posted to the CdrWriter when the leg is gone, null if none is written
+    UInt32 mDumBytes;           // estimate of the DUM objects of the leg once it has an invite session, see MemStats
 };
 
 
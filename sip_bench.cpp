@@ -0,0 +1,319 @@
+#include "sip_bench.h"
+#include "cmd_option.h"
+#include "dum_command.h"
+#include "sdp_cache.h"
+#include "ss_subsystem.h"
+
+#include "resip/stack/SipStack.hxx"
+#include "resip/stack/EventStackThread.hxx"
+#include "resip/dum/AppDialogSet.hxx"
+#include "resip/dum/ClientRegistration.hxx"
+#include "resip/dum/DialogUsageManager.hxx"
+#include "resip/dum/DumThread.hxx"
+#include "resip/dum/MasterProfile.hxx"
+#include "resip/dum/ServerInviteSession.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+using namespace std;
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+namespace
+{
+    const char* sUserPrefix = "bench";
+    const unsigned sGraceSecs = 10;
+}
+
+// Calling side of one INVITE->BYE cycle, its destruction marks the end of the BYE
+// transaction (or of the failed INVITE)
+class SipBench::BenchCall : public AppDialogSet
+{
+public:
+    BenchCall(SipBench& bench)
+        : AppDialogSet(*bench.mDum)
+        , mBench(bench)
+        , mStart(Timer::getTimeMicroSec())
+        , mByeStart(0)
+    {
+    }
+
+    ~BenchCall()
+    {
+        if (mByeStart)
+        {
+            mBench.mByeLatency.record(Timer::getTimeMicroSec() - mByeStart);
+            ++mBench.mDone;
+        }
+        else
+        {
+            ++mBench.mFailed;
+        }
+    }
+
+    SipBench& mBench;
+    UInt64 mStart;
+    UInt64 mByeStart;
+};
+
+SipBench::SipBench(const CmdRunner& config)
+    : mConfig(config)
+    , mUas(config.mBenchUas > 1 ? (unsigned)config.mBenchUas : 2)
+    , mRate(config.mBenchRate > 0 ? (unsigned)config.mBenchRate : 1)
+    , mFdPollGrp(0)
+    , mInterruptor(0)
+    , mStack(0)
+    , mStackThread(0)
+    , mDum(0)
+    , mDumThread(0)
+    , mMasterProfile(new MasterProfile)
+    , mPhase(Register)
+    , mDone(0)
+    , mFailed(0)
+{
+}
+
+SipBench::~SipBench()
+{
+    stopStack();
+}
+
+bool SipBench::run(std::ostream& strm)
+{
+    if (!mConfig.mSipUdpPort)
+    {
+        strm << "sip benchmark needs the sbc listening on udp, see `--udp-port`" << endl;
+        return false;
+    }
+    if (!startStack())
+    {
+        strm << "Failed to start the benchmark user agents" << endl;
+        return false;
+    }
+
+    strm << "stack-mode: " << CmdRunner::getStackModeName(mConfig.mStackMode)
+         << ", dum-workers: " << mConfig.mDumWorkers
+         << ", user agents: " << mUas
+         << ", target rate: " << mRate << "/s" << endl;
+    strm << setw(10) << "phase" << setw(9) << "ok" << setw(9) << "failed" << setw(11) << "rate/s"
+         << setw(11) << "p50 us" << setw(11) << "p99 us" << setw(11) << "p999 us" << setw(11) << "max us" << endl;
+
+    mRegs.resize(mUas);
+    mStart.resize(mUas);
+
+    runPhase(Register, mUas, [this](unsigned i)
+    {
+        mStart[i] = Timer::getTimeMicroSec();
+        mDum->send(mDum->makeRegistration(mProfiles[i]->getDefaultFrom(), mProfiles[i]));
+    }, strm);
+
+    runPhase(Refresh, mUas, [this](unsigned i)
+    {
+        mStart[i] = Timer::getTimeMicroSec();
+        if (mRegs[i].isValid())
+        {
+            mRegs[i]->requestRefresh();
+        }
+        else
+        {
+            ++mFailed;
+        }
+    }, strm);
+
+    unsigned duration = mConfig.mBenchDuration > 0 ? (unsigned)mConfig.mBenchDuration : 1;
+    runPhase(Call, mRate * duration, [this](unsigned k)
+    {
+        unsigned caller = k % mUas;
+        unsigned callee = (k + 1) % mUas;
+        SdpContents offer;
+        SdpTemplateCache::instance().makeOffer(Data::Empty, offer);
+        mDum->send(mDum->makeInviteSession(mProfiles[callee]->getDefaultFrom(), mProfiles[caller], &offer, new BenchCall(*this)));
+    }, strm);
+
+    stopStack();
+    return true;
+}
+
+bool SipBench::startStack()
+{
+    Data host = mConfig.mSipAddresses.empty() ? Data("127.0.0.1") : mConfig.mSipAddresses.front();
+    int port = mConfig.mSipUdpPort + 1;
+
+    mFdPollGrp = FdPollGrp::create();
+    mInterruptor = new EventThreadInterruptor(*mFdPollGrp);
+    mStack = new SipStack(0, DnsStub::EmptyNameserverList, mInterruptor, false, 0, 0, mFdPollGrp, false);
+    mStack->statisticsManagerEnabled() = false;
+    try
+    {
+        mStack->addTransport(UDP, port, V4, StunDisabled, host);
+    }
+    catch (BaseException& e)
+    {
+        ErrLog(<< "sip benchmark failed to add transport on " << host << ":" << port << ", " << e);
+        return false;
+    }
+    mStackThread = new EventStackThread(*mStack, *mInterruptor, *mFdPollGrp);
+
+    mDum = new DialogUsageManager(*mStack);
+    mDum->setMasterProfile(mMasterProfile);
+    mDum->setClientRegistrationHandler(this);
+    mDum->setInviteSessionHandler(this);
+    mDumThread = new DumThread(*mDum);
+
+    for (unsigned i = 0; i < mUas; ++i)
+    {
+        Data aor;
+        {
+            DataStream ds(aor);
+            ds << "sip:" << sUserPrefix << i << "@" << host << ":" << mConfig.mSipUdpPort;
+        }
+        std::shared_ptr<UserProfile> profile = std::make_shared<UserProfile>(mMasterProfile);
+        profile->setDefaultFrom(NameAddr(aor));
+        profile->setDefaultRegistrationTime(3600);
+        mProfiles.push_back(profile);
+    }
+
+    mStackThread->run();
+    mDumThread->run();
+    return true;
+}
+
+void SipBench::stopStack()
+{
+    if (mDumThread)
+    {
+        mDumThread->shutdown();
+        mDumThread->join();
+    }
+    if (mStackThread)
+    {
+        mStackThread->shutdown();
+        mStackThread->join();
+    }
+    delete mDumThread; mDumThread = 0;
+    delete mDum; mDum = 0;
+    delete mStackThread; mStackThread = 0;
+    delete mStack; mStack = 0;
+    delete mInterruptor; mInterruptor = 0;
+    delete mFdPollGrp; mFdPollGrp = 0;
+}
+
+void SipBench::pace(unsigned count, unsigned rate, std::function<void(unsigned)> op)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds interval(1000000000ull / rate);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        std::this_thread::sleep_until(start + interval * i);
+        mDum->post(new DumFunctorCommand(std::bind(op, i), "SipBench"));
+    }
+}
+
+bool SipBench::waitFor(unsigned count, unsigned timeoutSecs)
+{
+    UInt64 deadline = Timer::getTimeMs() + timeoutSecs * 1000ull;
+    while (mDone + mFailed < count)
+    {
+        if (Timer::getTimeMs() > deadline)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+void SipBench::runPhase(Phase phase, unsigned count, std::function<void(unsigned)> op, std::ostream& strm)
+{
+    static const char* names[] = { "register", "refresh", "call" };
+
+    mDum->post(new DumFunctorCommand([this, phase]() { mPhase = phase; }, "SipBench"));
+    mDone = 0;
+    mFailed = 0;
+
+    UInt64 start = Timer::getTimeMs();
+    pace(count, mRate, op);
+    if (!waitFor(count, count / mRate + sGraceSecs))
+    {
+        ErrLog(<< "sip benchmark phase " << names[phase] << " timed out, " << count - mDone - mFailed << " requests unanswered");
+    }
+    report(strm, names[phase], mLatency[phase], Timer::getTimeMs() - start);
+    if (phase == Call)
+    {
+        report(strm, "bye", mByeLatency, Timer::getTimeMs() - start);
+    }
+}
+
+void SipBench::report(std::ostream& strm, const char* phase, const LatencyHistogram& latency, UInt64 elapsedMs)
+{
+    double rate = elapsedMs ? (double)mDone * 1000 / elapsedMs : 0;
+    // next to the threading layout logged by the startup, one run per --stack-mode
+    // gives the numbers of every layout
+    InfoLog(<< "sip benchmark, stack-mode=" << CmdRunner::getStackModeName(mConfig.mStackMode)
+            << ", dum-workers=" << mConfig.mDumWorkers << ", " << phase << ": " << mDone << " ok, " << mFailed << " failed, "
+            << (UInt64)rate << "/s, p50 " << latency.percentile(0.5) << " us, p99 " << latency.percentile(0.99)
+            << " us, p999 " << latency.percentile(0.999) << " us, max " << latency.max() << " us");
+    strm << setw(10) << phase << setw(9) << mDone << setw(9) << mFailed
+         << setw(11) << fixed << setprecision(1) << rate
+         << setw(11) << latency.percentile(0.5)
+         << setw(11) << latency.percentile(0.99)
+         << setw(11) << latency.percentile(0.999)
+         << setw(11) << latency.max() << endl;
+}
+
+int SipBench::uaIndex(const SipMessage& msg) const
+{
+    const Data& user = msg.header(h_To).uri().user();
+    size_t len = strlen(sUserPrefix);
+    if (user.size() <= len || strncmp(user.data(), sUserPrefix, len) != 0)
+    {
+        return -1;
+    }
+    int index = user.substr(len).convertInt();
+    return index < (int)mUas ? index : -1;
+}
+
+void SipBench::onSuccess(ClientRegistrationHandle h, const SipMessage& response)
+{
+    int i = uaIndex(response);
+    if (i < 0 || mPhase == Call)
+    {
+        return;
+    }
+    mRegs[i] = h;
+    mLatency[mPhase].record(Timer::getTimeMicroSec() - mStart[i]);
+    ++mDone;
+}
+
+void SipBench::onFailure(ClientRegistrationHandle h, const SipMessage& response)
+{
+    ++mFailed;
+}
+
+void SipBench::onConnected(ClientInviteSessionHandle h, const SipMessage& msg)
+{
+    BenchCall* call = static_cast<BenchCall*>(h->getAppDialogSet().get());
+    UInt64 now = Timer::getTimeMicroSec();
+    mLatency[Call].record(now - call->mStart);
+    call->mByeStart = now;
+    h->end();
+}
+
+void SipBench::onOffer(InviteSessionHandle h, const SipMessage& msg, const SdpContents& offer)
+{
+    // called side auto answers with the offer itself
+    h->provideAnswer(offer);
+    ServerInviteSession* uas = dynamic_cast<ServerInviteSession*>(h.get());
+    if (uas && !uas->isAccepted())
+    {
+        uas->accept();
+    }
+}
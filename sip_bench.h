@@ -0,0 +1,131 @@
+#if !defined(SIP_BENCH__H)
+#define SIP_BENCH__H
+
+#include "resip/dum/RegistrationHandler.hxx"
+#include "resip/dum/InviteSessionHandler.hxx"
+#include "resip/dum/Handles.hxx"
+
+#include "histogram.h"
+
+#include <atomic>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+
+class CmdRunner;
+namespace resip
+{
+    class SipStack;
+    class DialogUsageManager;
+    class ThreadIf;
+    class FdPollGrp;
+    class EventThreadInterruptor;
+    class MasterProfile;
+    class UserProfile;
+}
+
+// `--bench sip`: N synthetic user agents on their own stack and DUM, driving the sbc
+// running in the same process over loopback.
+// The phases run one after another at the target rate:
+//  - initial REGISTER of every UA
+//  - REGISTER refresh storm of every UA
+//  - INVITE->200->ACK->BYE cycles, UA k calling UA k+1 through the B2BUA
+// and each one reports its achieved rate and p50/p99/p999 latency.
+class SipBench
+    : public resip::ClientRegistrationHandler
+    , public resip::InviteSessionHandler
+{
+public:
+    using SipMessage = resip::SipMessage;
+    using SdpContents = resip::SdpContents;
+    using ClientRegistrationHandle = resip::ClientRegistrationHandle;
+    using ClientInviteSessionHandle = resip::ClientInviteSessionHandle;
+    using ServerInviteSessionHandle = resip::ServerInviteSessionHandle;
+    using InviteSessionHandle = resip::InviteSessionHandle;
+    using InviteSession = resip::InviteSession;
+    using ClientSubscriptionHandle = resip::ClientSubscriptionHandle;
+    using ServerSubscriptionHandle = resip::ServerSubscriptionHandle;
+
+    SipBench(const CmdRunner& config);
+    ~SipBench();
+
+    bool run(std::ostream& strm);
+
+    // ClientRegistrationHandler ////////////////////////////////////////////////////////////////////////
+    virtual void onSuccess(ClientRegistrationHandle h, const SipMessage& response);
+    virtual void onRemoved(ClientRegistrationHandle, const SipMessage& response) {}
+    virtual int onRequestRetry(ClientRegistrationHandle, int retrySeconds, const SipMessage& response) { return -1; }
+    virtual void onFailure(ClientRegistrationHandle, const SipMessage& response);
+
+    // InviteSessionHandler ////////////////////////////////////////////////////////////////////////
+    virtual void onNewSession(ClientInviteSessionHandle, InviteSession::OfferAnswerType oat, const SipMessage& msg) {}
+    virtual void onNewSession(ServerInviteSessionHandle, InviteSession::OfferAnswerType oat, const SipMessage& msg) {}
+    virtual void onFailure(ClientInviteSessionHandle, const SipMessage& msg) {}
+    virtual void onEarlyMedia(ClientInviteSessionHandle, const SipMessage&, const SdpContents&) {}
+    virtual void onProvisional(ClientInviteSessionHandle, const SipMessage&) {}
+    virtual void onConnected(ClientInviteSessionHandle, const SipMessage& msg);
+    virtual void onConnected(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onTerminated(InviteSessionHandle, InviteSessionHandler::TerminatedReason reason, const SipMessage* related = 0) {}
+    virtual void onForkDestroyed(ClientInviteSessionHandle) {}
+    virtual void onRedirected(ClientInviteSessionHandle, const SipMessage& msg) {}
+    virtual void onAnswer(InviteSessionHandle, const SipMessage& msg, const SdpContents&) {}
+    virtual void onOffer(InviteSessionHandle, const SipMessage& msg, const SdpContents&);
+    virtual void onOfferRequired(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onOfferRejected(InviteSessionHandle, const SipMessage* msg) {}
+    virtual void onInfo(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onInfoSuccess(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onInfoFailure(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onMessage(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onMessageSuccess(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onMessageFailure(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onRefer(InviteSessionHandle, ServerSubscriptionHandle, const SipMessage& msg) {}
+    virtual void onReferNoSub(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onReferRejected(InviteSessionHandle, const SipMessage& msg) {}
+    virtual void onReferAccepted(InviteSessionHandle, ClientSubscriptionHandle, const SipMessage& msg) {}
+
+private:
+    class BenchCall;
+    friend class BenchCall;
+
+    enum Phase
+    {
+        Register,
+        Refresh,
+        Call,
+    };
+
+    bool startStack();
+    void stopStack();
+    /// run op(0..count-1) on the DUM thread, evenly spaced at `rate` per second
+    void pace(unsigned count, unsigned rate, std::function<void(unsigned)> op);
+    bool waitFor(unsigned count, unsigned timeoutSecs);
+    void runPhase(Phase phase, unsigned count, std::function<void(unsigned)> op, std::ostream& strm);
+    void report(std::ostream& strm, const char* phase, const LatencyHistogram& latency, UInt64 elapsedMs);
+    int uaIndex(const SipMessage& msg) const;
+
+    const CmdRunner& mConfig;
+    unsigned mUas;
+    unsigned mRate;
+    resip::FdPollGrp*               mFdPollGrp;
+    resip::EventThreadInterruptor*  mInterruptor;
+    resip::SipStack*                mStack;
+    resip::ThreadIf*                mStackThread;
+    resip::DialogUsageManager*      mDum;
+    resip::ThreadIf*                mDumThread;
+    std::shared_ptr<resip::MasterProfile>           mMasterProfile;
+    std::vector<std::shared_ptr<resip::UserProfile> > mProfiles;
+
+    // written on the bench DUM thread only
+    Phase mPhase;
+    std::vector<ClientRegistrationHandle> mRegs;
+    std::vector<UInt64> mStart;
+    LatencyHistogram mLatency[3];
+    LatencyHistogram mByeLatency;
+
+    std::atomic<unsigned> mDone;
+    std::atomic<unsigned> mFailed;
+};
+
+#endif // #if !defined(SIP_BENCH__H)
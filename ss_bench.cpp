@@ -0,0 +1,807 @@
+#include "ss_bench.h"
+#include "dum_shard.h"
+#include "mem_stats.h"
+#include "reg_db.h"
+#include "reg_store.h"
+#include "registry.h"
+#include "simple_sbc.h"
+#include "tls_session_cache.h"
+
+#include "resip/dum/MasterProfile.hxx"
+#include "resip/stack/HeaderFieldValue.hxx"
+#include "resip/stack/SdpContents.hxx"
+#include "resip/stack/SipMessage.hxx"
+#include "resip/stack/SipStack.hxx"
+#include "rutil/Timer.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+using namespace resip;
+using namespace std;
+
+#if defined(USE_SSL)
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
+#if !defined(WIN32)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+
+namespace
+{
+    typedef std::chrono::steady_clock BenchClock;
+
+    double nanosPerOp(BenchClock::duration elapsed, size_t ops)
+    {
+        return ops ? (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / ops : 0;
+    }
+
+    struct FakeCall
+    {
+        UInt64 mPayload;
+    };
+
+    // SdpMessageDecorator as it was before the content type check and address cache
+    class LegacySdpMessageDecorator : public MessageDecorator
+    {
+    public:
+        virtual void decorateMessage(SipMessage& msg, const Tuple& source, const Tuple& destination, const Data& sigcompId)
+        {
+            SdpContents* sdp = dynamic_cast<SdpContents*>(msg.getContents());
+            if (sdp)
+            {
+                sdp->session().origin().setAddress(Tuple::inet_ntop(source), source.ipVersion() == V6 ? SdpContents::IP6 : SdpContents::IP4);
+                sdp->session().connection().setAddress(Tuple::inet_ntop(source), source.ipVersion() == V6 ? SdpContents::IP6 : SdpContents::IP4);
+            }
+        }
+        virtual void rollbackMessage(SipMessage& msg) {}
+        virtual MessageDecorator* clone() const { return new LegacySdpMessageDecorator; }
+    };
+
+    const char* sBenchSdp =
+        "v=0\r\n"
+        "o=- 1 1 IN IP4 192.0.2.1\r\n"
+        "s=bench\r\n"
+        "c=IN IP4 192.0.2.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 45678 RTP/AVP 0 101\r\n"
+        "a=rtpmap:0 pcmu/8000\r\n"
+        "a=rtpmap:101 telephone-event/8000\r\n";
+
+    SipMessage* makeMessage(const char* startLine, const char* method, bool withSdp)
+    {
+        Data text;
+        {
+            DataStream ds(text);
+            ds << startLine << "\r\n"
+               << "Via: SIP/2.0/UDP 192.0.2.1:5060;branch=z9hG4bK-bench\r\n"
+               << "Max-Forwards: 70\r\n"
+               << "To: <sip:bob@192.0.2.2>;tag=2\r\n"
+               << "From: <sip:alice@192.0.2.1>;tag=1\r\n"
+               << "Call-ID: bench@192.0.2.1\r\n"
+               << "CSeq: 1 " << method << "\r\n"
+               << "Contact: <sip:alice@192.0.2.1:5060>\r\n";
+            if (withSdp)
+            {
+                ds << "Content-Type: application/sdp\r\n"
+                   << "Content-Length: " << strlen(sBenchSdp) << "\r\n\r\n"
+                   << sBenchSdp;
+            }
+            else
+            {
+                ds << "Content-Length: 0\r\n\r\n";
+            }
+        }
+        return SipMessage::make(text);
+    }
+
+    SInt64 trackedBytes(MemStats::Kind first, MemStats::Kind last)
+    {
+        SInt64 sum = 0;
+        for (int k = first; k <= last; ++k)
+        {
+            SInt64 objects = 0;
+            SInt64 bytes = 0;
+            MemStats::total((MemStats::Kind)k, objects, bytes);
+            sum += bytes;
+        }
+        return sum;
+    }
+
+    // the aor and binding of simulated user agent `i`, one per address
+    Uri benchContact(size_t i, UInt64 now, ContactInstanceRecord& rec)
+    {
+        Data user("ua" + Data((UInt64)i));
+        Data address("10." + Data((UInt32)((i >> 16) & 255)) + "." + Data((UInt32)((i >> 8) & 255)) + "." + Data((UInt32)(i & 255)));
+        rec.mContact = NameAddr("<sip:" + user + "@" + address + ":5060>");
+        rec.mReceivedFrom = Tuple(address, 5060, UDP);
+        rec.mRegExpires = now + 3600;
+        rec.mLastUpdated = now;
+        rec.mUserAgent = "bench-ua/1.0";
+        return Uri("sip:" + user + "@sbc.example.com");
+    }
+
+#if defined(SO_REUSEPORT)
+    int openUdp(int port, bool reusePort)
+    {
+        int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0)
+        {
+            return -1;
+        }
+        int on = 1;
+        if (reusePort)
+        {
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        }
+        // the receivers wake up regularly to notice the end of a run
+        timeval tv = { 0, 100000 };
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int localPort(int fd)
+    {
+        sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (::getsockname(fd, (sockaddr*)&addr, &len) != 0)
+        {
+            return 0;
+        }
+        return ntohs(addr.sin_port);
+    }
+#endif
+
+#if defined(USE_SSL)
+    // self-signed RSA 2048 certificate, the usual trunk certificate cost
+    bool makeCertificate(EVP_PKEY*& key, X509*& cert)
+    {
+        key = 0;
+        cert = 0;
+        EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, 0);
+        if (!kctx || EVP_PKEY_keygen_init(kctx) <= 0 || EVP_PKEY_CTX_set_rsa_keygen_bits(kctx, 2048) <= 0
+            || EVP_PKEY_keygen(kctx, &key) <= 0)
+        {
+            EVP_PKEY_CTX_free(kctx);
+            return false;
+        }
+        EVP_PKEY_CTX_free(kctx);
+
+        cert = X509_new();
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"sbc.bench", -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        return X509_sign(cert, key, EVP_sha256()) > 0;
+    }
+
+    // handshake of a client and a server over a memory bio pair, on this thread
+    bool handshake(SSL_CTX* clientCtx, SSL_CTX* serverCtx, SSL_SESSION*& session)
+    {
+        SSL* client = SSL_new(clientCtx);
+        SSL* server = SSL_new(serverCtx);
+        BIO* clientBio = 0;
+        BIO* serverBio = 0;
+        BIO_new_bio_pair(&clientBio, 0, &serverBio, 0);
+        SSL_set_bio(client, clientBio, clientBio);
+        SSL_set_bio(server, serverBio, serverBio);
+        SSL_set_connect_state(client);
+        SSL_set_accept_state(server);
+        if (session)
+        {
+            SSL_set_session(client, session);
+        }
+
+        bool done = false;
+        for (int i = 0; i < 16 && !done; ++i)
+        {
+            int c = SSL_do_handshake(client);
+            int s = SSL_do_handshake(server);
+            done = c == 1 && s == 1;
+        }
+        if (done)
+        {
+            // a TLS 1.3 ticket follows the handshake, reading takes it in
+            char buf[1];
+            SSL_read(client, buf, sizeof(buf));
+            SSL_SESSION_free(session);
+            session = SSL_get1_session(client);
+            // a session freed without a close_notify is dropped from the cache as bad
+            SSL_shutdown(client);
+            SSL_shutdown(server);
+        }
+        SSL_free(client);
+        SSL_free(server);
+        return done;
+    }
+#endif
+}
+
+bool SSBench::run(const resip::Data& scenario, std::ostream& strm)
+{
+    if (scenario == "registry")
+    {
+        return runRegistry(strm);
+    }
+    if (scenario == "decorator")
+    {
+        return runDecorator(strm);
+    }
+    if (scenario == "udp")
+    {
+        return runUdp(strm);
+    }
+    if (scenario == "tls")
+    {
+        return runTls(strm);
+    }
+    if (scenario == "mem")
+    {
+        return runMem(strm);
+    }
+    if (scenario == "store")
+    {
+        return runStore(strm);
+    }
+
+    strm << "Unknown benchmark scenario: " << scenario << endl;
+    return false;
+}
+
+bool SSBench::runRegistry(std::ostream& strm)
+{
+    static const size_t sizes[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+    static const size_t rounds = 200000;
+    static const size_t batch = 10;
+    // the previous linear scan is only measured while it finishes in reasonable time
+    static const size_t maxScanSize = 100000;
+    static const size_t scanRounds = 1000;
+
+    strm << setw(10) << "calls" << setw(18) << "erase ns/op" << setw(22) << "linear scan ns/op" << endl;
+
+    for (size_t n : sizes)
+    {
+        std::vector<FakeCall> calls(n);
+        // the views are published by the DUM thread, the erase path is what is measured
+        CallRegistry<FakeCall, FakeCall> registry;
+        std::shared_ptr<const FakeCall> view = std::make_shared<FakeCall>();
+        UInt64 nextId = 1;
+        for (auto& c : calls)
+        {
+            registry.add(nextId++, &c, view);
+        }
+
+        // erase a batch of calls, then put them back untimed so the table size is steady
+        BenchClock::duration elapsed(0);
+        size_t ops = 0;
+        for (size_t r = 0; r < rounds / batch; ++r)
+        {
+            size_t first = (r * batch) % n;
+            size_t count = std::min(batch, n - first);
+            BenchClock::time_point start = BenchClock::now();
+            for (size_t i = first; i < first + count; ++i)
+            {
+                registry.erase(&calls[i]);
+            }
+            elapsed += BenchClock::now() - start;
+            ops += count;
+            for (size_t i = first; i < first + count; ++i)
+            {
+                registry.add(nextId++, &calls[i], view);
+            }
+        }
+
+        strm << setw(10) << n << setw(18) << fixed << setprecision(1) << nanosPerOp(elapsed, ops);
+
+        if (n <= maxScanSize)
+        {
+            HashMap<UInt64, FakeCall*> table;
+            UInt64 scanId = 1;
+            for (auto& c : calls)
+            {
+                table[scanId++] = &c;
+            }
+
+            BenchClock::duration scanElapsed(0);
+            for (size_t r = 0; r < scanRounds; ++r)
+            {
+                FakeCall* target = &calls[(r * 7919) % n];
+                BenchClock::time_point start = BenchClock::now();
+                for (auto i : table)
+                {
+                    if (i.second == target)
+                    {
+                        table.erase(i.first);
+                        break;
+                    }
+                }
+                scanElapsed += BenchClock::now() - start;
+                table[scanId++] = target;
+            }
+            strm << setw(22) << nanosPerOp(scanElapsed, scanRounds);
+        }
+        else
+        {
+            strm << setw(22) << "-";
+        }
+        strm << endl;
+    }
+
+    return true;
+}
+
+bool SSBench::runDecorator(std::ostream& strm)
+{
+    static const size_t rounds = 200000;
+
+    // one call and one registration worth of signaling, two of the ten messages carry sdp:
+    // the INVITE alternates between two sources so its sdp is rewritten every time, the 200
+    // always leaves through the same one so its sdp already holds the right address
+    struct Load
+    {
+        const char* mStartLine;
+        const char* mMethod;
+        bool mSdp;
+        bool mAlternate;
+    };
+    static const Load load[] = {
+        { "INVITE sip:bob@192.0.2.2 SIP/2.0",   "INVITE",   true,  true },
+        { "SIP/2.0 100 Trying",                 "INVITE",   false, false },
+        { "SIP/2.0 180 Ringing",                "INVITE",   false, false },
+        { "SIP/2.0 200 OK",                     "INVITE",   true,  false },
+        { "ACK sip:bob@192.0.2.2 SIP/2.0",      "ACK",      false, false },
+        { "BYE sip:bob@192.0.2.2 SIP/2.0",      "BYE",      false, false },
+        { "SIP/2.0 200 OK",                     "BYE",      false, false },
+        { "REGISTER sip:192.0.2.2 SIP/2.0",     "REGISTER", false, false },
+        { "SIP/2.0 200 OK",                     "REGISTER", false, false },
+        { "OPTIONS sip:bob@192.0.2.2 SIP/2.0",  "OPTIONS",  false, false },
+    };
+    static const size_t count = sizeof(load) / sizeof(load[0]);
+
+    Tuple sources[2] = { Tuple("10.0.0.1", 5060, V4, UDP), Tuple("10.0.0.2", 5060, V4, UDP) };
+    Tuple destination("192.0.2.2", 5060, V4, UDP);
+
+    LegacySdpMessageDecorator legacy;
+    SdpMessageDecorator current;
+    MessageDecorator* decorators[] = { &legacy, &current };
+    const char* names[] = { "legacy", "current" };
+
+    strm << setw(10) << "decorator" << setw(16) << "ns/message" << endl;
+    for (int d = 0; d < 2; ++d)
+    {
+        std::vector<std::unique_ptr<SipMessage> > msgs;
+        for (auto& l : load)
+        {
+            msgs.push_back(std::unique_ptr<SipMessage>(makeMessage(l.mStartLine, l.mMethod, l.mSdp)));
+        }
+
+        // the first pass parses the sdp bodies, which is not the decorator's cost
+        for (size_t i = 0; i < count; ++i)
+        {
+            decorators[d]->decorateMessage(*msgs[i], sources[0], destination, Data::Empty);
+        }
+
+        BenchClock::time_point start = BenchClock::now();
+        for (size_t r = 0; r < rounds; ++r)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                const Tuple& source = load[i].mAlternate ? sources[r & 1] : sources[0];
+                decorators[d]->decorateMessage(*msgs[i], source, destination, Data::Empty);
+            }
+        }
+        strm << setw(10) << names[d] << setw(16) << fixed << setprecision(1)
+             << nanosPerOp(BenchClock::now() - start, rounds * count) << endl;
+    }
+
+    return true;
+}
+
+bool SSBench::runUdp(std::ostream& strm)
+{
+#if defined(SO_REUSEPORT)
+    static const unsigned socketCounts[] = { 1, 2, 4, 8 };
+    static const unsigned senders = 4;
+    // source ports per sender, the kernel spreads them over the sockets by hashing the address
+    static const unsigned flowsPerSender = 64;
+    static const int warmupMs = 200;
+    static const int runMs = 2000;
+
+    Data datagram;
+    {
+        DataStream ds(datagram);
+        ds << "OPTIONS sip:bob@127.0.0.1 SIP/2.0\r\n"
+           << "Via: SIP/2.0/UDP 127.0.0.1:5060;branch=z9hG4bK-bench\r\n"
+           << "Max-Forwards: 70\r\n"
+           << "To: <sip:bob@127.0.0.1>\r\n"
+           << "From: <sip:alice@127.0.0.1>;tag=1\r\n"
+           << "Call-ID: bench@127.0.0.1\r\n"
+           << "CSeq: 1 OPTIONS\r\n"
+           << "Content-Length: 0\r\n\r\n";
+    }
+
+    strm << "every datagram is received and parsed as UdpTransport does, " << senders << " sender threads, "
+         << std::thread::hardware_concurrency() << " cpus" << endl;
+    strm << setw(10) << "sockets" << setw(16) << "datagrams/s" << setw(10) << "speedup" << setw(16) << "busiest socket" << endl;
+
+    double base = 0;
+    for (unsigned n : socketCounts)
+    {
+        std::vector<int> fds;
+        int port = 0;
+        for (unsigned i = 0; i < n; ++i)
+        {
+            int fd = openUdp(port, true);
+            if (fd < 0)
+            {
+                strm << "failed to open " << n << " sockets on one port, errno " << errno << endl;
+                for (int f : fds)
+                {
+                    ::close(f);
+                }
+                return false;
+            }
+            fds.push_back(fd);
+            port = localPort(fd);
+        }
+
+        std::atomic<bool> stop(false);
+        std::atomic<bool> counting(false);
+        std::vector<std::atomic<UInt64> > counts(n);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < n; ++i)
+        {
+            counts[i] = 0;
+            threads.push_back(std::thread([&, i]()
+            {
+                char buf[4096];
+                while (!stop)
+                {
+                    ssize_t len = ::recv(fds[i], buf, sizeof(buf), 0);
+                    if (len <= 0)
+                    {
+                        continue;
+                    }
+                    delete SipMessage::make(Data(buf, (Data::size_type)len), true);
+                    if (counting)
+                    {
+                        counts[i].fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            }));
+        }
+        for (unsigned s = 0; s < senders; ++s)
+        {
+            threads.push_back(std::thread([&]()
+            {
+                sockaddr_in to;
+                memset(&to, 0, sizeof(to));
+                to.sin_family = AF_INET;
+                to.sin_port = htons((unsigned short)port);
+                to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+                std::vector<int> flows;
+                for (unsigned f = 0; f < flowsPerSender; ++f)
+                {
+                    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+                    if (fd >= 0)
+                    {
+                        flows.push_back(fd);
+                    }
+                }
+                while (!stop)
+                {
+                    for (int fd : flows)
+                    {
+                        ::sendto(fd, datagram.data(), datagram.size(), MSG_DONTWAIT, (sockaddr*)&to, sizeof(to));
+                    }
+                }
+                for (int fd : flows)
+                {
+                    ::close(fd);
+                }
+            }));
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(warmupMs));
+        counting = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(runMs));
+        counting = false;
+        stop = true;
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+        for (int fd : fds)
+        {
+            ::close(fd);
+        }
+
+        UInt64 total = 0;
+        UInt64 busiest = 0;
+        for (auto& c : counts)
+        {
+            total += c;
+            busiest = std::max<UInt64>(busiest, c);
+        }
+        double rate = (double)total * 1000 / runMs;
+        if (!base)
+        {
+            base = rate;
+        }
+        strm << setw(10) << n << setw(16) << fixed << setprecision(0) << rate
+             << setw(10) << setprecision(2) << (base ? rate / base : 0)
+             << setw(15) << setprecision(1) << (total ? 100.0 * busiest / total : 0) << "%" << endl;
+    }
+    return true;
+#else
+    strm << "SO_REUSEPORT is not supported on this platform" << endl;
+    return false;
+#endif
+}
+
+bool SSBench::runTls(std::ostream& strm)
+{
+#if defined(USE_SSL)
+    static const unsigned clients = 1000;
+    static const unsigned connects = 10;     // per client, the first one can't be resumed
+
+    EVP_PKEY* key = 0;
+    X509* cert = 0;
+    if (!makeCertificate(key, cert))
+    {
+        strm << "failed to make a self-signed certificate" << endl;
+        return false;
+    }
+
+    struct Scenario
+    {
+        const char* mName;
+        int mVersion;
+        bool mResume;
+    };
+    static const Scenario scenarios[] = {
+        { "TLS 1.3 no resumption",  TLS1_3_VERSION, false },
+        { "TLS 1.3 shared tickets", TLS1_3_VERSION, true },
+        { "TLS 1.2 shared ids",     TLS1_2_VERSION, true },
+    };
+
+    strm << clients << " clients reconnecting " << connects << " times, alternating between two transports" << endl;
+    strm << setw(24) << left << "scenario" << right << setw(10) << "full" << setw(10) << "resumed"
+         << setw(14) << "handshakes/s" << setw(10) << "us/full" << setw(12) << "us/resumed" << endl;
+
+    for (auto& sc : scenarios)
+    {
+        // two transports with their own context, like a TLS and a WSS transport
+        SSL_CTX* serverCtx[2];
+        TlsSessionCache cache(clients * 2, 3600);
+        for (auto& ctx : serverCtx)
+        {
+            ctx = SSL_CTX_new(TLS_server_method());
+            SSL_CTX_use_certificate(ctx, cert);
+            SSL_CTX_use_PrivateKey(ctx, key);
+            SSL_CTX_set_max_proto_version(ctx, sc.mVersion);
+            if (sc.mResume)
+            {
+                cache.attach(ctx);
+            }
+            else
+            {
+                SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+                SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+                SSL_CTX_set_num_tickets(ctx, 0);
+                TlsSessionCache::countHandshakes(ctx);
+            }
+        }
+        SSL_CTX* clientCtx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_max_proto_version(clientCtx, sc.mVersion);
+        if (sc.mVersion < TLS1_3_VERSION)
+        {
+            // resumed by session id only
+            SSL_CTX_set_options(clientCtx, SSL_OP_NO_TICKET);
+        }
+
+        UInt64 full0 = TlsSessionCache::getFullHandshakes();
+        UInt64 resumed0 = TlsSessionCache::getResumedHandshakes();
+        std::vector<SSL_SESSION*> sessions(clients, (SSL_SESSION*)0);
+        BenchClock::duration fullTime(0);
+        BenchClock::duration resumedTime(0);
+        bool ok = true;
+        for (unsigned round = 0; round < connects && ok; ++round)
+        {
+            for (unsigned c = 0; c < clients && ok; ++c)
+            {
+                SSL_SESSION*& session = sessions[c];
+                if (!sc.mResume)
+                {
+                    SSL_SESSION_free(session);
+                    session = 0;
+                }
+                UInt64 resumedBefore = TlsSessionCache::getResumedHandshakes();
+                BenchClock::time_point start = BenchClock::now();
+                ok = handshake(clientCtx, serverCtx[(c + round) & 1], session);
+                BenchClock::duration elapsed = BenchClock::now() - start;
+                (TlsSessionCache::getResumedHandshakes() != resumedBefore ? resumedTime : fullTime) += elapsed;
+            }
+        }
+        for (auto s : sessions)
+        {
+            SSL_SESSION_free(s);
+        }
+        SSL_CTX_free(clientCtx);
+        for (auto ctx : serverCtx)
+        {
+            SSL_CTX_free(ctx);
+        }
+        if (!ok)
+        {
+            strm << sc.mName << ": handshake failed" << endl;
+            break;
+        }
+
+        UInt64 full = TlsSessionCache::getFullHandshakes() - full0;
+        UInt64 resumed = TlsSessionCache::getResumedHandshakes() - resumed0;
+        double seconds = std::chrono::duration<double>(fullTime + resumedTime).count();
+        strm << setw(24) << left << sc.mName << right << setw(10) << full << setw(10) << resumed
+             << setw(14) << fixed << setprecision(0) << (seconds > 0 ? (full + resumed) / seconds : 0)
+             << setw(10) << setprecision(1) << nanosPerOp(fullTime, (size_t)full) / 1000
+             << setw(12) << nanosPerOp(resumedTime, (size_t)resumed) / 1000 << endl;
+    }
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return true;
+#else
+    strm << "built without USE_SSL" << endl;
+    return false;
+#endif
+}
+
+bool SSBench::runMem(std::ostream& strm)
+{
+    // Registrations go through the RegDb and registry of a shard the way REGISTER does.
+    // Calls are the two legs the B2BUA makes, each with its DUM dialog set and INVITE as
+    // it is about to be sent, the outbound profile is shared as for calls to one flow.
+    // The dialog and invite session of an answered call come on top, estimated by the
+    // dum_session kind of `show mem`.
+    // The heap is the one of this thread, nothing else runs meanwhile.
+    static const size_t scales[] = { 10000, 100000, 1000000 };
+
+    if (!MemStats::getHeapBytes())
+    {
+        strm << "the allocator does not report the heap in use" << endl;
+        return false;
+    }
+
+    HeaderFieldValue hfv(sBenchSdp, (unsigned)strlen(sBenchSdp));
+    SdpContents offer(hfv, Mime("application", "sdp"));
+    offer.session();
+
+    strm << setw(10) << "scale" << setw(14) << "B/reg" << setw(18) << "tracked B/reg"
+         << setw(14) << "B/call" << setw(18) << "tracked B/call" << endl;
+    for (size_t n : scales)
+    {
+        // a shard of its own at every scale, torn down before the next one
+        SimpleSBC sbc;
+        SipStack stack;
+        std::unique_ptr<DumShard> shard(new DumShard(stack, sbc, 0, 1));
+        std::shared_ptr<MasterProfile> master = std::make_shared<MasterProfile>();
+        shard->setMasterProfile(master);
+        std::shared_ptr<UserProfile> profile = std::make_shared<UserProfile>(master);
+        profile->setDefaultFrom(NameAddr("<sip:caller@192.0.2.1>"));
+
+        UInt64 now = Timer::getTimeSecs();
+        UInt64 heap0 = MemStats::getHeapBytes();
+        SInt64 tracked0 = trackedBytes(MemStats::AorEntry, MemStats::Bindings);
+        for (size_t i = 0; i < n; ++i)
+        {
+            ContactInstanceRecord rec;
+            Uri aor = benchContact(i, now, rec);
+            shard->getRegDb()->updateContact(aor, rec);
+        }
+        UInt64 heap1 = MemStats::getHeapBytes();
+        SInt64 tracked1 = trackedBytes(MemStats::AorEntry, MemStats::Bindings);
+
+        SInt64 legs0 = trackedBytes(MemStats::CallLeg, MemStats::DumSession);
+        for (size_t i = 0; i < n; ++i)
+        {
+            NameAddr target("<sip:ua" + Data((UInt64)i) + "@10.0.0.1:5060>");
+            for (int leg = 0; leg < 2; ++leg)
+            {
+                shard->makeInviteSession(target, profile, &offer, new SSDialogSet(sbc, *shard));
+            }
+        }
+        UInt64 heap2 = MemStats::getHeapBytes();
+        SInt64 legs1 = trackedBytes(MemStats::CallLeg, MemStats::DumSession);
+
+        strm << setw(10) << n << setw(14) << (heap1 - heap0) / n << setw(18) << (tracked1 - tracked0) / (SInt64)n
+             << setw(14) << (heap2 - heap1) / n << setw(18) << (legs1 - legs0) / (SInt64)n << endl;
+    }
+    return true;
+}
+
+bool SSBench::runStore(std::ostream& strm)
+{
+    // 1M aors of one binding each, written to a snapshot by the compaction a stopping
+    // store does, then loaded into an empty database the way the startup does.
+    // The files go to the current directory and are removed afterwards.
+    static const size_t sAors = 1000000;
+    Data path("./ss_bench_store." + Data(Timer::getTimeMs()));
+    UInt64 now = Timer::getTimeSecs();
+
+    RegDb written;
+    for (size_t i = 0; i < sAors; ++i)
+    {
+        ContactInstanceRecord rec;
+        Uri aor = benchContact(i, now, rec);
+        written.updateContact(aor, rec);
+    }
+
+    BenchClock::time_point start = BenchClock::now();
+    {
+        RegStore store(path);
+        store.addDb(&written);
+        store.run();
+        store.shutdown();
+        store.join();
+    }
+    BenchClock::duration writeTime = BenchClock::now() - start;
+
+    std::ifstream snap((path + ".snap").c_str(), std::ios::binary | std::ios::ate);
+    UInt64 snapBytes = snap ? (UInt64)snap.tellg() : 0;
+    snap.close();
+
+    RegDb loaded;
+    size_t aors = 0;
+    start = BenchClock::now();
+    {
+        RegStore store(path);
+        store.addDb(&loaded);
+        aors = store.load([&loaded](const Uri& aor, const ContactList& contacts)
+        {
+            loaded.restore(aor, contacts);
+        });
+    }
+    BenchClock::duration loadTime = BenchClock::now() - start;
+
+    remove((path + ".snap").c_str());
+    remove((path + ".log").c_str());
+
+    strm << setw(10) << "aors" << setw(14) << "snapshot MB" << setw(12) << "write ms" << setw(12) << "load ms" << endl;
+    strm << setw(10) << aors << setw(14) << fixed << setprecision(1) << snapBytes / 1048576.0
+         << setw(12) << std::chrono::duration_cast<std::chrono::milliseconds>(writeTime).count()
+         << setw(12) << std::chrono::duration_cast<std::chrono::milliseconds>(loadTime).count() << endl;
+    return aors == sAors;
+}
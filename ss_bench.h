@@ -0,0 +1,30 @@
+#if !defined(SS_BENCH__H)
+#define SS_BENCH__H
+
+#include "rutil/Data.hxx"
+#include <iosfwd>
+
+
+// Offline benchmarks selected by `--bench <scenario>`, run instead of the sbc
+class SSBench
+{
+public:
+    static bool run(const resip::Data& scenario, std::ostream& strm);
+
+protected:
+    /// cost of removing a terminated call with 10 to 1M active calls
+    static bool runRegistry(std::ostream& strm);
+    /// per message cost of the outbound sdp decorator on a mixed signaling load
+    static bool runDecorator(std::ostream& strm);
+    /// received and parsed SIP datagrams per second with 1 to 8 SO_REUSEPORT sockets on one port
+    static bool runUdp(std::ostream& strm);
+    /// full and resumed TLS handshakes of 1000 clients reconnecting 10 times each
+    static bool runTls(std::ostream& strm);
+    /// heap bytes per registration and per call with 10k to 1M of them, against the
+    /// estimates of MemStats
+    static bool runMem(std::ostream& strm);
+    /// writing and loading the RegStore files of 1M registrations
+    static bool runStore(std::ostream& strm);
+};
+
+#endif // #if !defined(SS_BENCH__H)
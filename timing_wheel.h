@@ -0,0 +1,111 @@
+#if !defined(TIMING_WHEEL__H)
+#define TIMING_WHEEL__H
+
+#include "rutil/compat.hxx"
+
+#include <vector>
+
+
+// Hierarchical timing wheel with a one second tick.
+// 4 levels of 64 slots: level 0 holds what is due within 64 seconds, every level above
+// covers 64 times the span of the one below, up to about 194 days. Entries further away
+// wait in the last level and are placed again when it turns. Scheduling is constant
+// time and advancing costs one slot per elapsed tick plus the entries it moves or fires,
+// whatever the number of pending entries.
+// There is no cancellation, the owner checks the fired entry is still wanted.
+// Not thread safe.
+template <typename T>
+class TimingWheel
+{
+public:
+    explicit TimingWheel(UInt64 now) : mNow(now), mSize(0) {}
+
+    /// fire `item` at the tick `when`, on the next tick if already passed
+    void schedule(UInt64 when, const T& item)
+    {
+        Entry e;
+        e.mWhen = when;
+        e.mItem = item;
+        place(e, mNow + 1);
+        ++mSize;
+    }
+
+    /// run every tick up to `now`, `fire(item, when)` is called for every entry due,
+    /// it may schedule again
+    /// @return number of entries fired
+    template <typename F>
+    size_t advance(UInt64 now, F fire)
+    {
+        size_t fired = 0;
+        std::vector<Entry> due;
+        while (mNow < now)
+        {
+            ++mNow;
+            unsigned top = 0;
+            while (top < sLevels - 1 && ((mNow >> (sSlotBits * top)) & sSlotMask) == 0)
+            {
+                ++top;
+            }
+            for (unsigned level = top; level > 0; --level)
+            {
+                // the levels below wrapped, spread the current slot of this one over them,
+                // from the top so what lands in a lower current slot is spread again
+                std::vector<Entry> moved;
+                moved.swap(mSlots[level][(mNow >> (sSlotBits * level)) & sSlotMask]);
+                for (auto& e : moved)
+                {
+                    place(e, mNow);
+                }
+            }
+
+            due.clear();
+            due.swap(mSlots[0][mNow & sSlotMask]);
+            mSize -= due.size();
+            for (auto& e : due)
+            {
+                fire(e.mItem, e.mWhen);
+            }
+            fired += due.size();
+        }
+        return fired;
+    }
+
+    UInt64 now() const { return mNow; }
+    size_t size() const { return mSize; }
+
+private:
+    static const unsigned sLevels = 4;
+    static const unsigned sSlotBits = 6;
+    static const UInt64 sSlots = 1 << sSlotBits;
+    static const UInt64 sSlotMask = sSlots - 1;
+
+    struct Entry
+    {
+        UInt64 mWhen;
+        T mItem;
+    };
+
+    /// `earliest` is the first tick not yet run
+    void place(const Entry& e, UInt64 earliest)
+    {
+        UInt64 when = e.mWhen > earliest ? e.mWhen : earliest;
+        UInt64 delta = when - mNow;
+        unsigned level = 0;
+        while (level < sLevels - 1 && delta >= (sSlots << (sSlotBits * level)))
+        {
+            ++level;
+        }
+        if (delta >= (sSlots << (sSlotBits * level)))
+        {
+            // beyond the span of the wheel, parked in the farthest slot
+            when = mNow + (sSlots << (sSlotBits * level)) - 1;
+        }
+        mSlots[level][(when >> (sSlotBits * level)) & sSlotMask].push_back(e);
+    }
+
+    UInt64 mNow;
+    size_t mSize;
+    std::vector<Entry> mSlots[sLevels][sSlots];
+};
+
+#endif // #if !defined(TIMING_WHEEL__H)
@@ -0,0 +1,190 @@
+#include "tls_session_cache.h"
+#include "ss_subsystem.h"
+
+#include "rutil/Lock.hxx"
+#include "rutil/Logger.hxx"
+#include "rutil/Timer.hxx"
+using namespace resip;
+
+#if defined(USE_SSL)
+#include <openssl/rand.h>
+#endif
+
+
+#define RESIPROCATE_SUBSYSTEM SipSvrSubsystem::SSMODULE
+
+
+int TlsSessionCache::sIndex = -1;
+std::atomic<UInt64> TlsSessionCache::sFull(0);
+std::atomic<UInt64> TlsSessionCache::sResumed(0);
+
+TlsSessionCache::TlsSessionCache(size_t maxSessions, long timeoutSecs)
+    : mMaxSessions(maxSessions ? maxSessions : 1)
+    , mTimeoutSecs(timeoutSecs)
+{
+#if defined(USE_SSL)
+    if (sIndex < 0)
+    {
+        sIndex = SSL_CTX_get_ex_new_index(0, 0, 0, 0, 0);
+    }
+#endif
+}
+
+TlsSessionCache::~TlsSessionCache()
+{
+}
+
+size_t TlsSessionCache::size() const
+{
+    Lock lock(mMutex);
+    return mSessions.size();
+}
+
+#if defined(USE_SSL)
+
+void TlsSessionCache::attach(SSL_CTX* ctx)
+{
+    static const char sContext[] = "simple_sbc";
+
+    SSL_CTX_set_ex_data(ctx, sIndex, this);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)sContext, sizeof(sContext) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_timeout(ctx, mTimeoutSecs);
+    SSL_CTX_sess_set_new_cb(ctx, onNewSession);
+    SSL_CTX_sess_set_get_cb(ctx, onGetSession);
+    SSL_CTX_sess_set_remove_cb(ctx, onRemoveSession);
+    countHandshakes(ctx);
+
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    if (mTicketKeys.empty())
+    {
+        // the length differs between OpenSSL versions, asked with null keys
+        long len = SSL_CTX_get_tlsext_ticket_keys(ctx, 0, 0);
+        mTicketKeys.resize(len > 0 ? len : 0);
+        if (mTicketKeys.empty() || RAND_bytes(mTicketKeys.data(), (int)mTicketKeys.size()) != 1)
+        {
+            ErrLog(<< "tls: no shared session ticket keys, tickets are resumed by the transport issuing them only");
+            mTicketKeys.clear();
+            return;
+        }
+    }
+    SSL_CTX_set_tlsext_ticket_keys(ctx, mTicketKeys.data(), (long)mTicketKeys.size());
+}
+
+void TlsSessionCache::countHandshakes(SSL_CTX* ctx)
+{
+    SSL_CTX_set_info_callback(ctx, onInfo);
+}
+
+TlsSessionCache* TlsSessionCache::fromCtx(SSL_CTX* ctx)
+{
+    return static_cast<TlsSessionCache*>(SSL_CTX_get_ex_data(ctx, sIndex));
+}
+
+int TlsSessionCache::onNewSession(SSL* ssl, SSL_SESSION* session)
+{
+    TlsSessionCache* cache = fromCtx(SSL_get_SSL_CTX(ssl));
+    if (!cache)
+    {
+        return 0;
+    }
+
+    unsigned int idLen = 0;
+    const unsigned char* id = SSL_SESSION_get_id(session, &idLen);
+    int derLen = i2d_SSL_SESSION(session, 0);
+    if (!idLen || derLen <= 0)
+    {
+        return 0;
+    }
+    std::string key((const char*)id, idLen);
+    std::string der(derLen, '\0');
+    unsigned char* p = (unsigned char*)&der[0];
+    i2d_SSL_SESSION(session, &p);
+
+    Lock lock(cache->mMutex);
+    auto it = cache->mSessions.find(key);
+    if (it != cache->mSessions.end())
+    {
+        cache->mAges.erase(it->second.mAge);
+        cache->mSessions.erase(it);
+    }
+    while (cache->mSessions.size() >= cache->mMaxSessions)
+    {
+        cache->mSessions.erase(cache->mAges.front());
+        cache->mAges.pop_front();
+    }
+    Entry& e = cache->mSessions[key];
+    e.mDer.swap(der);
+    e.mExpires = Timer::getTimeSecs() + cache->mTimeoutSecs;
+    e.mAge = cache->mAges.insert(cache->mAges.end(), key);
+
+    // the session is serialized, OpenSSL keeps its reference
+    return 0;
+}
+
+SSL_SESSION* TlsSessionCache::onGetSession(SSL* ssl, const unsigned char* id, int len, int* copy)
+{
+    *copy = 0;
+    TlsSessionCache* cache = fromCtx(SSL_get_SSL_CTX(ssl));
+    if (!cache)
+    {
+        return 0;
+    }
+
+    std::string der;
+    {
+        Lock lock(cache->mMutex);
+        auto it = cache->mSessions.find(std::string((const char*)id, len));
+        if (it == cache->mSessions.end())
+        {
+            return 0;
+        }
+        if (it->second.mExpires <= Timer::getTimeSecs())
+        {
+            cache->mAges.erase(it->second.mAge);
+            cache->mSessions.erase(it);
+            return 0;
+        }
+        der = it->second.mDer;
+    }
+
+    // a new session owned by the caller, hence no copy
+    const unsigned char* p = (const unsigned char*)der.data();
+    return d2i_SSL_SESSION(0, &p, (long)der.size());
+}
+
+void TlsSessionCache::onRemoveSession(SSL_CTX* ctx, SSL_SESSION* session)
+{
+    TlsSessionCache* cache = fromCtx(ctx);
+    if (!cache)
+    {
+        return;
+    }
+
+    unsigned int idLen = 0;
+    const unsigned char* id = SSL_SESSION_get_id(session, &idLen);
+    Lock lock(cache->mMutex);
+    auto it = cache->mSessions.find(std::string((const char*)id, idLen));
+    if (it != cache->mSessions.end())
+    {
+        cache->mAges.erase(it->second.mAge);
+        cache->mSessions.erase(it);
+    }
+}
+
+void TlsSessionCache::onInfo(const SSL* ssl, int where, int ret)
+{
+    if ((where & SSL_CB_HANDSHAKE_DONE) && SSL_is_server(const_cast<SSL*>(ssl)))
+    {
+        if (SSL_session_reused(const_cast<SSL*>(ssl)))
+        {
+            sResumed.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            sFull.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,73 @@
+#if !defined(TLS_SESSION_CACHE__H)
+#define TLS_SESSION_CACHE__H
+
+#include "rutil/Mutex.hxx"
+#include "rutil/compat.hxx"
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(USE_SSL)
+#include <openssl/ssl.h>
+#endif
+
+
+// Server side TLS session resumption shared by every TLS and WSS transport.
+// Each transport may have its own SSL_CTX, OpenSSL would keep a session cache and
+// ticket keys per context, so a client reconnecting to another transport or interface
+// would get a full handshake. The contexts attached here share:
+//  - one session ID cache, in DER form, least recently stored evicted first
+//  - the session ticket keys, a ticket issued by one context is accepted by all
+// Every server handshake is counted as full or resumed.
+// The callbacks run on the transport threads, the cache is guarded by a mutex.
+class TlsSessionCache
+{
+public:
+    TlsSessionCache(size_t maxSessions, long timeoutSecs);
+    ~TlsSessionCache();
+
+#if defined(USE_SSL)
+    /// serve the sessions of `ctx` from this cache, the cache must outlive `ctx`
+    void attach(SSL_CTX* ctx);
+    /// count the handshakes of `ctx` only, done by attach()
+    static void countHandshakes(SSL_CTX* ctx);
+#endif
+
+    size_t size() const;
+
+    static UInt64 getFullHandshakes() { return sFull.load(std::memory_order_relaxed); }
+    static UInt64 getResumedHandshakes() { return sResumed.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry
+    {
+        std::string mDer;
+        UInt64 mExpires;
+        std::list<std::string>::iterator mAge;
+    };
+
+#if defined(USE_SSL)
+    static TlsSessionCache* fromCtx(SSL_CTX* ctx);
+    static int onNewSession(SSL* ssl, SSL_SESSION* session);
+    static SSL_SESSION* onGetSession(SSL* ssl, const unsigned char* id, int len, int* copy);
+    static void onRemoveSession(SSL_CTX* ctx, SSL_SESSION* session);
+    static void onInfo(const SSL* ssl, int where, int ret);
+#endif
+
+    const size_t mMaxSessions;
+    const long mTimeoutSecs;
+    std::vector<unsigned char> mTicketKeys;
+
+    mutable resip::Mutex mMutex;
+    std::unordered_map<std::string, Entry> mSessions;
+    std::list<std::string> mAges;    // session ids, oldest first
+
+    static int sIndex;
+    static std::atomic<UInt64> sFull;
+    static std::atomic<UInt64> sResumed;
+};
+
+#endif // #if !defined(TLS_SESSION_CACHE__H)